@@ -26,36 +26,68 @@
  *      in aesd_buffer.
  * @return the struct aesd_buffer_entry structure representing the position described by char_offset, or
  * NULL if this position is not available in the buffer (not enough data is written).
+ * Binary searches the entry start offsets, O(log n) in the number of entries.
  */
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-   
-    size_t current_index = buffer->out_offs;    // current index we are checking, starting at out_offs
-    size_t current_offset = 0;                  // cumulative offset 
-    size_t entry_count = 0;                     // count of entries we have checked
-    
-    while (entry_count < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-    
-        struct aesd_buffer_entry *current_entry = &buffer->entry[current_index];
-    
-        // Determine whether char_offset is within this entry
-        if (char_offset < current_offset + current_entry->size) {
-            // Found it!
-            *entry_offset_byte_rtn = char_offset - current_offset;
-            return current_entry;
+    return aesd_circular_buffer_find_in_slots(buffer->entry, buffer->mask, buffer->out_offs, buffer->count,
+            buffer->total_size, char_offset, entry_offset_byte_rtn);
+}
+
+/**
+ * Same search as aesd_circular_buffer_find_entry_offset_for_fpos, on a buffer described by its fields.
+ * Lets a caller search a copy of the fields it took without holding the buffer's lock: every slot
+ * accessed is within slots[0..mask], whatever the slot contents are.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_find_in_slots(struct aesd_buffer_entry *slots,
+            uint32_t mask, uint32_t out_offs, uint32_t count, size_t total_size,
+            size_t char_offset, size_t *entry_offset_byte_rtn)
+{
+    uint64_t base;                  // stream offset of the oldest entry
+    uint32_t low = 0;               // the entry is at index low or later...
+    uint32_t high = count;          // ...and before index high
+    struct aesd_buffer_entry *found_entry;
+
+    if (char_offset >= total_size || count == 0) {
+        return NULL;
+    }
+    base = slots[out_offs & mask].start;
+
+    // Find the last entry starting at or before char_offset
+    while (high - low > 1) {
+        uint32_t middle = low + (high - low) / 2;
+        if (slots[(out_offs + middle) & mask].start - base <= char_offset) {
+            low = middle;
         }
-        
-        current_offset += current_entry->size;
-        current_index = (current_index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        entry_count++;
-    
-        if (!buffer->full && current_index == buffer->in_offs) {
-            break;
+        else {
+            high = middle;
         }
     }
-   
-    return NULL;
+
+    found_entry = &slots[(out_offs + low) & mask];
+    *entry_offset_byte_rtn = char_offset - (size_t)(found_entry->start - base);
+    return found_entry;
+}
+
+/**
+ * @param buffer the buffer to index.  Any necessary locking must be performed by caller.
+ * @param index the zero referenced entry to return, 0 being the oldest
+ * @param char_offset_rtn is set to the position of the first byte of the entry, as used by
+ *      aesd_circular_buffer_find_entry_offset_for_fpos
+ * @return the entry, or NULL if there are not that many entries. O(1).
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer,
+            uint32_t index, size_t *char_offset_rtn)
+{
+    struct aesd_buffer_entry *indexed_entry;
+
+    if (index >= buffer->count) {
+        return NULL;
+    }
+    indexed_entry = &buffer->entry[(buffer->out_offs + index) & buffer->mask];
+    *char_offset_rtn = (size_t)(indexed_entry->start - buffer->entry[buffer->out_offs].start);
+    return indexed_entry;
 }
 
 /**
@@ -72,25 +104,162 @@ const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 
     // On overwrite condition, free entry and advance out_offs
     if (buffer->full) {
-        overwritten_entry = buffer->entry[buffer->out_offs].buffptr;
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        overwritten_entry = aesd_circular_buffer_remove_oldest(buffer);
     }
     
     
     buffer->entry[buffer->in_offs] = *add_entry;
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->entry[buffer->in_offs].start = buffer->next_start;
+    buffer->next_start += add_entry->size;
+    buffer->in_offs = (buffer->in_offs + 1) & buffer->mask;
+    buffer->count++;
+    buffer->total_size += add_entry->size;
     
-    if (buffer->in_offs == buffer->out_offs) {
+    if (buffer->count == buffer->capacity) {
         buffer->full = true;
     }
     
     return overwritten_entry;
 }
 
+/**
+* Removes the oldest entry of @param buffer, used to evict entries by size or before shrinking.
+* Any necessary locking must be handled by the caller
+* @return the buffptr of the removed entry, for the caller to free, or NULL if the buffer is empty
+*/
+const char *aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *oldest;
+    const char *removed_entry;
+
+    if (buffer->count == 0) {
+        return NULL;
+    }
+
+    oldest = &buffer->entry[buffer->out_offs];
+    removed_entry = oldest->buffptr;
+    buffer->total_size -= oldest->size;
+    oldest->buffptr = NULL;
+    oldest->size = 0;
+
+    buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
+    buffer->count--;
+    buffer->full = false;
+
+    return removed_entry;
+}
+
+/**
+* Removes the oldest entry of @param buffer, which must not be empty, copying it to @param evicted
+*/
+static void aesd_circular_buffer_evict_oldest(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *evicted)
+{
+    *evicted = buffer->entry[buffer->out_offs];
+    aesd_circular_buffer_remove_oldest(buffer);
+}
+
+/**
+* Removes the oldest entry of @param buffer if @param incoming more bytes don't fit in @param budget
+* bytes, 0 meaning no budget. Called until it returns false to make room for an entry of incoming bytes,
+* which may take every stored entry, or with incoming 0 after lowering the budget, which keeps the
+* newest entry even if it alone is over budget.
+* Any necessary locking must be handled by the caller
+* @return true if an entry was removed and copied to @param evicted, for the caller to release its buffptr
+*/
+bool aesd_circular_buffer_evict_over_budget(struct aesd_circular_buffer *buffer, size_t budget,
+            size_t incoming, struct aesd_buffer_entry *evicted)
+{
+    uint32_t keep = incoming ? 0 : 1;
+
+    if (budget == 0 || buffer->count <= keep || buffer->total_size + incoming <= budget) {
+        return false;
+    }
+    aesd_circular_buffer_evict_oldest(buffer, evicted);
+    return true;
+}
+
+/**
+* Removes the oldest entry of @param buffer if it holds more than @param capacity entries.
+* Called until it returns false before aesd_circular_buffer_resize() shrinks the buffer.
+* Any necessary locking must be handled by the caller
+* @return true if an entry was removed and copied to @param evicted, for the caller to release its buffptr
+*/
+bool aesd_circular_buffer_evict_over_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity,
+            struct aesd_buffer_entry *evicted)
+{
+    if (buffer->count <= capacity) {
+        return false;
+    }
+    aesd_circular_buffer_evict_oldest(buffer, evicted);
+    return true;
+}
+
+/**
+* @return the number of slots a buffer of @param capacity entries needs, a power of two.
+* Capacities up to AESDCHAR_INLINE_SLOTS fit in the slots embedded in the buffer.
+*/
+uint32_t aesd_circular_buffer_slots_for(uint32_t capacity)
+{
+    uint32_t slots = AESDCHAR_INLINE_SLOTS;
+
+    while (slots < capacity) {
+        slots <<= 1;
+    }
+    return slots;
+}
+
+/**
+* Changes the capacity of @param buffer to @param capacity entries, keeping the stored entries in order.
+* @param slots is an array of aesd_circular_buffer_slots_for(capacity) zeroed entries, or NULL
+* when that is AESDCHAR_INLINE_SLOTS and the embedded slots should be used.
+* The caller must first remove entries beyond the new capacity with aesd_circular_buffer_evict_over_capacity().
+* Any necessary locking must be handled by the caller
+* @return the previous slot array for the caller to free, or NULL if it was the embedded one
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *slots, uint32_t capacity)
+{
+    struct aesd_buffer_entry kept[AESDCHAR_INLINE_SLOTS];
+    struct aesd_buffer_entry *previous = buffer->entry;
+    uint32_t slot_count = aesd_circular_buffer_slots_for(capacity);
+    uint32_t index;
+
+    // Staying inline moves the entries within the same array, so go through a copy
+    if (!slots && previous == buffer->inline_entry) {
+        for (index = 0; index < buffer->count; index++) {
+            kept[index] = previous[(buffer->out_offs + index) & buffer->mask];
+        }
+        memset(buffer->inline_entry, 0, sizeof(buffer->inline_entry));
+        memcpy(buffer->inline_entry, kept, buffer->count * sizeof(struct aesd_buffer_entry));
+    }
+    else {
+        struct aesd_buffer_entry *target = slots ? slots : buffer->inline_entry;
+        if (!slots) {
+            memset(buffer->inline_entry, 0, sizeof(buffer->inline_entry));
+        }
+        for (index = 0; index < buffer->count; index++) {
+            target[index] = previous[(buffer->out_offs + index) & buffer->mask];
+        }
+        buffer->entry = target;
+    }
+
+    buffer->mask = slot_count - 1;
+    buffer->capacity = capacity;
+    buffer->out_offs = 0;
+    buffer->in_offs = buffer->count & buffer->mask;
+    buffer->full = buffer->count == capacity;
+
+    return previous == buffer->inline_entry ? NULL : previous;
+}
+
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
+* holding up to AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries in its embedded slots
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->inline_entry;
+    buffer->mask = AESDCHAR_INLINE_SLOTS - 1;
+    buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
 }
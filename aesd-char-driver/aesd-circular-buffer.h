@@ -16,8 +16,22 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Default capacity, the number of entries kept by a buffer set up with aesd_circular_buffer_init()
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
 
+/**
+ * Slots embedded in every buffer, the smallest power of two holding the default capacity.
+ * Larger capacities use a slot array supplied to aesd_circular_buffer_resize()
+ */
+#define AESDCHAR_INLINE_SLOTS 16
+
+/**
+ * Largest capacity a buffer can be resized to
+ */
+#define AESDCHAR_MAX_CAPACITY (1U << 16)
+
 struct aesd_buffer_entry
 {
     /**
@@ -28,23 +42,51 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Offset of the first byte of this entry in the stream of everything ever added to the
+     * buffer, set by aesd_circular_buffer_add_entry(). Increasing from the oldest entry to the
+     * newest, it is the prefix sum of the entry sizes that lookups binary search.
+     */
+    uint64_t start;
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * The slots holding the most recent write operations, either inline_entry or an array
+     * supplied to aesd_circular_buffer_resize(). Always a power of two in length.
+     */
+    struct aesd_buffer_entry *entry;
+    struct aesd_buffer_entry inline_entry[AESDCHAR_INLINE_SLOTS];
+    /**
+     * Number of slots minus one. Slot indexes wrap by masking with it rather than with %
+     */
+    uint32_t mask;
+    /**
+     * Number of entries kept before the oldest is overwritten, at most mask + 1
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t capacity;
+    /**
+     * Number of entries currently stored
+     */
+    uint32_t count;
+    /**
+     * Sum of the sizes of the stored entries
+     */
+    size_t total_size;
+    /**
+     * Stream offset the next entry added will start at
+     */
+    uint64_t next_start;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
      * set to true when the buffer entry structure is full
      */
@@ -54,8 +96,28 @@ struct aesd_circular_buffer
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
+extern struct aesd_buffer_entry *aesd_circular_buffer_find_in_slots(struct aesd_buffer_entry *slots,
+            uint32_t mask, uint32_t out_offs, uint32_t count, size_t total_size,
+            size_t char_offset, size_t *entry_offset_byte_rtn);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer,
+            uint32_t index, size_t *char_offset_rtn);
+
 extern const char *aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern const char *aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer);
+
+extern bool aesd_circular_buffer_evict_over_budget(struct aesd_circular_buffer *buffer, size_t budget,
+            size_t incoming, struct aesd_buffer_entry *evicted);
+
+extern bool aesd_circular_buffer_evict_over_capacity(struct aesd_circular_buffer *buffer, uint32_t capacity,
+            struct aesd_buffer_entry *evicted);
+
+extern uint32_t aesd_circular_buffer_slots_for(uint32_t capacity);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *slots, uint32_t capacity);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
 /**
@@ -63,9 +125,9 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -74,7 +136,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<=(buffer)->mask; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
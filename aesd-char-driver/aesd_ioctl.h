@@ -33,14 +33,107 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * For AESDCHAR_IOCREADAT, reading from a write command into a user buffer
+ */
+struct aesd_read_at {
+    /**
+     * The zero referenced write command to start in, and offset within it
+     */
+    uint32_t write_cmd;
+    uint32_t write_cmd_offset;
+    /**
+     * User buffer to fill and its size. Copying carries on into the following writes
+     * until it is full or there is no more data
+     */
+    uint64_t buf;
+    uint64_t len;
+    /**
+     * Set to the number of bytes copied
+     */
+    uint64_t copied;
+};
+
+/**
+ * Where one write command is in the device, as returned by AESDCHAR_IOCENTRIES
+ */
+struct aesd_entry_info {
+    /**
+     * File position of the first byte of the write
+     */
+    uint64_t offset;
+    uint64_t size;
+};
+
+/**
+ * For AESDCHAR_IOCENTRIES, describing write commands first to first + count - 1
+ */
+struct aesd_entries {
+    uint32_t first;
+    /**
+     * Room in entries on the way in, number filled in on the way out
+     */
+    uint32_t count;
+    /**
+     * Set to the number of writes held by the device
+     */
+    uint32_t total;
+    uint32_t reserved;
+    /**
+     * User pointer to an array of count struct aesd_entry_info
+     */
+    uint64_t entries;
+};
+
+/**
+ * Counters and state of a device, returned by AESDCHAR_IOCSTATS
+ */
+struct aesd_stats_info {
+    uint64_t commands;          // Writes completed by a newline
+    uint64_t bytes_written;
+    uint64_t evictions;         // Writes dropped to make room or to shrink
+    uint64_t reads;             // Reads that returned data
+    uint64_t bytes_read;
+    uint64_t total_size;        // Bytes currently held
+    uint32_t entries;           // Writes currently held
+    uint32_t capacity;          // Writes held before the oldest is dropped
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+/**
+ * Turn tail mode on (nonzero) or off (0) for this open file. In tail mode a read with nothing
+ * left to return sleeps until more is written (or fails with EAGAIN under O_NONBLOCK), and the
+ * read position follows the data as old writes are evicted instead of staying a fixed offset
+ * from the oldest one. Writes evicted before a tail reader got to them are skipped.
+ */
+#define AESDCHAR_IOCTAIL _IOW(AESD_IOC_MAGIC, 2, uint32_t)
+/**
+ * Copy from a write command into a user buffer without moving the file position
+ */
+#define AESDCHAR_IOCREADAT _IOWR(AESD_IOC_MAGIC, 3, struct aesd_read_at)
+/**
+ * Fetch the offset and size of a range of write commands in one call
+ */
+#define AESDCHAR_IOCENTRIES _IOWR(AESD_IOC_MAGIC, 4, struct aesd_entries)
+/**
+ * Fetch the counters of the device
+ */
+#define AESDCHAR_IOCSTATS _IOR(AESD_IOC_MAGIC, 5, struct aesd_stats_info)
+/**
+ * Drop every write held by the device at once
+ */
+#define AESDCHAR_IOCCLEAR _IO(AESD_IOC_MAGIC, 6)
+/**
+ * Change the number of writes this device holds (1-65536), dropping the oldest if needed
+ */
+#define AESDCHAR_IOCRESIZE _IOW(AESD_IOC_MAGIC, 7, uint32_t)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 7
 
 #endif /* AESD_IOCTL_H */
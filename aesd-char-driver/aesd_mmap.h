@@ -0,0 +1,72 @@
+/*
+ * aesd_mmap.h
+ *
+ *  @brief Layout of the read-only mapping of an aesdchar device
+ *
+ * With the module loaded with mmap_size set, mmap() of the device at offset 0 maps a
+ * header page followed by the data area twice, back to back. Every byte written to the
+ * device has a stream offset and the data area holds byte S at S % data_size, so a run of
+ * up to data_size bytes starting at data_offset + S % data_size is contiguous in the
+ * mapping even when it wraps around the end of the data area.
+ *
+ * Entries are numbered from 0 since the module was loaded. Entry i is described by
+ * entries[i % max_entries] for next_index - entry_count <= i < next_index, oldest first.
+ * Only entries still buffered by the device and still whole in the data area are listed.
+ *
+ * The driver makes generation odd while it updates the mapping. To read consistently,
+ * wait for an even generation, copy what you need, then check generation is unchanged.
+ */
+
+#ifndef AESD_MMAP_H
+#define AESD_MMAP_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#define AESD_MMAP_VERSION 1
+
+struct aesd_mmap_entry {
+    /**
+     * Stream offset of the first byte of the entry
+     */
+    uint64_t start;
+    /**
+     * Number of bytes in the entry
+     */
+    uint64_t size;
+};
+
+struct aesd_mmap_header {
+    uint32_t version;
+    /**
+     * Odd while the driver is updating the header or the data area
+     */
+    uint32_t generation;
+    /**
+     * Number of slots in entries
+     */
+    uint32_t max_entries;
+    /**
+     * Number of entries currently listed
+     */
+    uint32_t entry_count;
+    /**
+     * Number of the entry that will be added next
+     */
+    uint64_t next_index;
+    /**
+     * Stream offset the next entry will start at
+     */
+    uint64_t next_start;
+    /**
+     * Offset of the data area in the mapping, and its size in bytes
+     */
+    uint64_t data_offset;
+    uint64_t data_size;
+    struct aesd_mmap_entry entries[];
+};
+
+#endif /* AESD_MMAP_H */
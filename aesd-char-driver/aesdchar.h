@@ -8,7 +8,7 @@
 #ifndef AESD_CHAR_DRIVER_AESDCHAR_H_
 #define AESD_CHAR_DRIVER_AESDCHAR_H_
 
-#define AESD_DEBUG
+/* AESD_DEBUG is defined by building with DEBUG=y, see the Makefile */
 
 #undef PDEBUG             /* undef it, just in case */
 
@@ -25,24 +25,130 @@
 #endif
 
 #include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
+#include <linux/wait.h>
+#include <linux/llist.h>
 #include "aesd-circular-buffer.h"
+#include "aesd_mmap.h"
+
+/*
+ * A block of pages that writes are copied into, at the start of its first page.
+ * Commands are carved out of data in place, or copied to the device's pack block when short
+ * and staged in a mostly empty block. Each circular buffer entry points into a block
+ * and holds a reference, as does the staging area while it still appends to the block,
+ * and each reader copying out of an entry. Readers find entries without buff_lock, so the
+ * pages are only released an RCU grace period after the last reference is dropped,
+ * to the block pool if it has room.
+ */
+struct aesd_entry_data
+{
+    refcount_t refs;
+    union {
+        struct rcu_head rcu;
+        struct llist_node pool_node;    /* Once released to the pool */
+    };
+    unsigned int order;     /* The block is 2^order pages */
+    char data[];
+};
+
+/*
+ * Where written bytes wait for the newline that completes a command
+ */
+struct aesd_staging
+{
+    struct aesd_entry_data *block;  /* NULL before the first write */
+    size_t start;   /* Offset in block->data of the first byte not yet part of an entry */
+    size_t used;    /* Bytes of block->data written so far, none after start is a newline */
+};
+
+/*
+ * Size histograms count sizes of 2^i to 2^(i+1) - 1 bytes in bucket i, and everything
+ * larger in the last
+ */
+#define AESD_SIZE_BUCKETS 20
+
+/*
+ * Counters for one device. Those kept by writers are updated under buff_lock,
+ * those kept by readers are atomic since readers don't take it
+ */
+struct aesd_stats
+{
+    u64 commands;           /* Entries added */
+    u64 bytes_written;      /* Bytes in those entries */
+    u64 evictions;          /* Entries dropped to make room or to shrink */
+    atomic64_t reads;       /* Reads that returned data */
+    atomic64_t bytes_read;
+    u64 entry_sizes[AESD_SIZE_BUCKETS];         /* Sizes of the entries added */
+    atomic64_t read_sizes[AESD_SIZE_BUCKETS];   /* Bytes returned by each read that returned data */
+};
+
+/*
+ * Time spent waiting for and holding buff_lock, updated by its holder
+ */
+struct aesd_lock_stats
+{
+    u64 acquired;
+    u64 wait_ns;
+    u64 max_wait_ns;
+    u64 hold_ns;
+    u64 max_hold_ns;
+    u64 locked_at;          /* When the current holder took it */
+};
 
 struct aesd_dev
 {
     // Added structures and locks needed to complete assignment requirements
 
     struct cdev cdev;     /* Char device structure      */
+    unsigned int index;   /* Minor number, relative to aesd_minor */
+    struct device *device;
+    struct aesd_stats stats;
+    struct aesd_lock_stats lock_stats;
     struct aesd_circular_buffer buff;
-    char *partial_write_buff;
-    size_t bytes_stored;
-    struct mutex buff_lock;
+    /*
+     * Unterminated bytes left by openers that closed, taken over by the next write from a file
+     * with nothing staged so a line can still be written by several processes in turn.
+     * Protected by buff_lock, block is NULL when there are none
+     */
+    struct aesd_staging orphan;
+    /*
+     * Block short commands are copied into when they were staged in a mostly empty block, so
+     * an open writing a single short line doesn't leave a whole block pinned by its entry.
+     * Protected by buff_lock, everything in it is part of an entry
+     */
+    struct aesd_staging pack;
+    struct mutex buff_lock;     /* Serializes writers, readers don't take it */
+    seqcount_mutex_t buff_seq;  /* Bumped around every change to buff, readers retry across one */
+    wait_queue_head_t readq;    /* Woken when entries are added */
+    /*
+     * Header page and data area shared read-only with mmap() users, see aesd_mmap.h.
+     * Set up at load time when mmap_size is given, NULL otherwise. Updated under buff_lock.
+     */
+    struct aesd_mmap_header *mmap_header;
+    char *mmap_data;
+};
+
+/*
+ * State of one open of the device, in filp->private_data
+ */
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    bool tail;              /* Set by AESDCHAR_IOCTAIL */
+    uint64_t stream_pos;    /* In tail mode, stream offset of the next byte to read */
+    struct mutex write_lock;        /* Serializes writes through this open */
+    struct aesd_staging staging;    /* Bytes written through this open since its last newline */
 };
 
 loff_t aesd_llseek(struct file *filp, loff_t offset, int whence);
 int aesd_open(struct inode *inode, struct file *filp);
 int aesd_release(struct inode *inode, struct file *filp);
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from);
+__poll_t aesd_poll(struct file *filp, struct poll_table_struct *wait);
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma);
 int aesd_init_module(void);
 void aesd_cleanup_module(void);
 
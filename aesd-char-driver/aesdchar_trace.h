@@ -0,0 +1,126 @@
+/*
+ * aesdchar_trace.h
+ *
+ *  @brief Tracepoints of the aesdchar driver
+ *
+ * Enabled at runtime under /sys/kernel/tracing/events/aesdchar. Every event carries the
+ * index of the device it happened on, the same index as in the /dev/aesdchar<index> name.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/**
+ * A command was added to the circular buffer, leaving it with entries entries of bytes in total
+ */
+TRACE_EVENT(aesdchar_write_commit,
+    TP_PROTO(unsigned int index, uint64_t start, size_t size, uint32_t entries, size_t bytes),
+    TP_ARGS(index, start, size, entries, bytes),
+    TP_STRUCT__entry(
+        __field(unsigned int, index)
+        __field(uint64_t, start)
+        __field(size_t, size)
+        __field(uint32_t, entries)
+        __field(size_t, bytes)
+    ),
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->start = start;
+        __entry->size = size;
+        __entry->entries = entries;
+        __entry->bytes = bytes;
+    ),
+    TP_printk("dev=%u start=%llu size=%zu entries=%u bytes=%zu",
+              __entry->index, __entry->start, __entry->size, __entry->entries, __entry->bytes)
+);
+
+/**
+ * The oldest entry was dropped to make room for a new one or to shrink the buffer
+ */
+TRACE_EVENT(aesdchar_evict,
+    TP_PROTO(unsigned int index, uint64_t start, size_t size),
+    TP_ARGS(index, start, size),
+    TP_STRUCT__entry(
+        __field(unsigned int, index)
+        __field(uint64_t, start)
+        __field(size_t, size)
+    ),
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->start = start;
+        __entry->size = size;
+    ),
+    TP_printk("dev=%u start=%llu size=%zu", __entry->index, __entry->start, __entry->size)
+);
+
+/**
+ * A read of requested bytes at file position pos returned result
+ */
+TRACE_EVENT(aesdchar_read,
+    TP_PROTO(unsigned int index, loff_t pos, size_t requested, ssize_t result),
+    TP_ARGS(index, pos, requested, result),
+    TP_STRUCT__entry(
+        __field(unsigned int, index)
+        __field(loff_t, pos)
+        __field(size_t, requested)
+        __field(ssize_t, result)
+    ),
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->pos = pos;
+        __entry->requested = requested;
+        __entry->result = result;
+    ),
+    TP_printk("dev=%u pos=%lld requested=%zu result=%zd",
+              __entry->index, __entry->pos, __entry->requested, __entry->result)
+);
+
+TRACE_EVENT(aesdchar_llseek,
+    TP_PROTO(unsigned int index, loff_t offset, int whence, loff_t result),
+    TP_ARGS(index, offset, whence, result),
+    TP_STRUCT__entry(
+        __field(unsigned int, index)
+        __field(loff_t, offset)
+        __field(int, whence)
+        __field(loff_t, result)
+    ),
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->offset = offset;
+        __entry->whence = whence;
+        __entry->result = result;
+    ),
+    TP_printk("dev=%u offset=%lld whence=%d result=%lld",
+              __entry->index, __entry->offset, __entry->whence, __entry->result)
+);
+
+TRACE_EVENT(aesdchar_ioctl,
+    TP_PROTO(unsigned int index, unsigned int cmd, long result),
+    TP_ARGS(index, cmd, result),
+    TP_STRUCT__entry(
+        __field(unsigned int, index)
+        __field(unsigned int, cmd)
+        __field(long, result)
+    ),
+    TP_fast_assign(
+        __entry->index = index;
+        __entry->cmd = cmd;
+        __entry->result = result;
+    ),
+    TP_printk("dev=%u cmd=0x%x nr=%u result=%ld",
+              __entry->index, __entry->cmd, _IOC_NR(__entry->cmd), __entry->result)
+);
+
+#endif /* AESD_CHAR_DRIVER_AESDCHAR_TRACE_H_ */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
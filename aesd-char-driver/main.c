@@ -17,8 +17,32 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/slab.h>
+#include <linux/moduleparam.h>
+#include <linux/uio.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/refcount.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/gfp.h>
+#include <linux/llist.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/device.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
@@ -26,59 +50,794 @@ int aesd_minor =   0;
 MODULE_AUTHOR("Eric Percin"); 
 MODULE_LICENSE("Dual BSD/GPL");
 
-struct aesd_dev aesd_device;
+// Devices are minors aesd_minor to aesd_minor + aesd_nr_devices - 1, each with its own history
+#define AESD_MAX_DEVICES 64
+static unsigned int aesd_nr_devices = 1;
+static struct aesd_dev *aesd_devices;
+static struct class *aesd_class;
+// /sys/kernel/debug/aesdchar, with a directory per device
+static struct dentry *aesd_debugfs;
+
+// Entries kept, and total bytes kept (0 for no limit). Both can be given at load time
+// and changed at runtime through /sys/module/aesdchar/parameters
+static unsigned int aesd_capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+static unsigned long aesd_byte_budget = 0;
+// Parameters set before the device is initialized only record the value
+static bool aesd_device_ready = false;
+// Bytes of written data mirrored for mmap(), rounded up to a power of two pages.
+// 0 leaves mmap() unsupported
+static unsigned long aesd_mmap_size = 0;
+
+
+// The fields of buff a lockless reader needs, copied by aesd_read_view()
+struct aesd_buff_view {
+    struct aesd_buffer_entry *slots;
+    uint32_t mask;
+    uint32_t out_offs;
+    uint32_t count;
+    size_t total_size;
+    uint64_t next_start;
+};
+
+
+// Released blocks of up to 2^(AESD_POOL_ORDERS - 1) pages are kept for reuse, one list per
+// order, so steady writing recycles the same pages rather than going back to the page allocator
+#define AESD_POOL_ORDERS 4
+
+static struct llist_head aesd_pool[AESD_POOL_ORDERS];
+// Blocks are added to the lists from RCU callbacks without it, it only serializes taking them off
+static DEFINE_SPINLOCK(aesd_pool_lock);
+// Pages kept in the pool, at most aesd_pool_limit
+static atomic_long_t aesd_pool_pages = ATOMIC_LONG_INIT(0);
+static unsigned long aesd_pool_limit = 64;
+// Blocks in use by entries, staging areas and readers, and their pages
+static atomic_long_t aesd_blocks = ATOMIC_LONG_INIT(0);
+static atomic_long_t aesd_block_pages = ATOMIC_LONG_INIT(0);
+
+
+// Allocate a block with room for at least size bytes of entries, holding the staging reference
+static struct aesd_entry_data *aesd_block_alloc(size_t size)
+{
+    unsigned int order = get_order(offsetof(struct aesd_entry_data, data) + size);
+    struct aesd_entry_data *data = NULL;
+    struct llist_node *node = NULL;
+    struct page *page;
+
+    if (order < AESD_POOL_ORDERS) {
+        spin_lock(&aesd_pool_lock);
+        node = llist_del_first(&aesd_pool[order]);
+        spin_unlock(&aesd_pool_lock);
+    }
+    if (node) {
+        data = llist_entry(node, struct aesd_entry_data, pool_node);
+        atomic_long_sub(1L << order, &aesd_pool_pages);
+    }
+    else {
+        page = alloc_pages(GFP_KERNEL | __GFP_COMP | __GFP_NOWARN, order);
+        if (!page) {
+            return NULL;
+        }
+        data = page_address(page);
+    }
+    refcount_set(&data->refs, 1);
+    data->order = order;
+    atomic_long_inc(&aesd_blocks);
+    atomic_long_add(1L << order, &aesd_block_pages);
+    return data;
+}
+
+// Free every block in the pool
+static void aesd_pool_drain(void)
+{
+    struct aesd_entry_data *data;
+    struct llist_node *node, *next;
+    unsigned int order;
+
+    for (order = 0; order < AESD_POOL_ORDERS; order++) {
+        spin_lock(&aesd_pool_lock);
+        node = llist_del_all(&aesd_pool[order]);
+        spin_unlock(&aesd_pool_lock);
+        llist_for_each_safe(node, next, node) {
+            data = llist_entry(node, struct aesd_entry_data, pool_node);
+            atomic_long_sub(1L << order, &aesd_pool_pages);
+            __free_pages(virt_to_page(data), order);
+        }
+    }
+}
+
+static size_t aesd_block_capacity(const struct aesd_entry_data *data)
+{
+    return (PAGE_SIZE << data->order) - offsetof(struct aesd_entry_data, data);
+}
+
+static void aesd_block_free_rcu(struct rcu_head *rcu)
+{
+    struct aesd_entry_data *data = container_of(rcu, struct aesd_entry_data, rcu);
+    long pages = 1L << data->order;
+
+    atomic_long_dec(&aesd_blocks);
+    atomic_long_sub(pages, &aesd_block_pages);
+    // The limit may be overshot by racing callbacks, by a block each at most
+    if (data->order < AESD_POOL_ORDERS &&
+            atomic_long_read(&aesd_pool_pages) + pages <= (long)READ_ONCE(aesd_pool_limit)) {
+        atomic_long_add(pages, &aesd_pool_pages);
+        llist_add(&data->pool_node, &aesd_pool[data->order]);
+        return;
+    }
+    __free_pages(virt_to_page(data), data->order);
+}
+
+// Drop a reference to a block.
+// A reader may still be looking at it without a reference, so it is freed after a grace period.
+static void aesd_block_put(struct aesd_entry_data *data)
+{
+    if (refcount_dec_and_test(&data->refs)) {
+        call_rcu(&data->rcu, aesd_block_free_rcu);
+    }
+}
+
+// The block an entry was carved from, found from any byte of it
+static struct aesd_entry_data *aesd_entry_data_of(const char *buffptr)
+{
+    return page_address(virt_to_head_page(buffptr));
+}
+
+// Drop an entry's reference to its block, NULL is ignored
+static void aesd_entry_put(const char *buffptr)
+{
+    if (buffptr) {
+        aesd_block_put(aesd_entry_data_of(buffptr));
+    }
+}
+
+// Make room in staging for count more bytes, with the lock protecting it held.
+// When the block is full the line in progress moves to a new one at least twice the size
+// of the old, so a long line written in small pieces is copied O(1) times per byte
+static int aesd_staging_reserve(struct aesd_staging *staging, size_t count)
+{
+    struct aesd_entry_data *block;
+    size_t pending = staging->used - staging->start;
+    size_t size = pending + count;
+
+    if (staging->block && staging->used + count <= aesd_block_capacity(staging->block)) {
+        return 0;
+    }
+    if (staging->block && pending) {
+        size = max(size, 2 * aesd_block_capacity(staging->block));
+    }
+    block = aesd_block_alloc(size);
+    if (!block) {
+        return -ENOMEM;
+    }
+    if (staging->block) {
+        memcpy(block->data, staging->block->data + staging->start, pending);
+        aesd_block_put(staging->block);
+    }
+    staging->block = block;
+    staging->start = 0;
+    staging->used = pending;
+    return 0;
+}
+
+// Point entry at the command of length bytes at the start of staging's pending bytes, with
+// buff_lock held, and take a reference on the block it ends up in.
+// Carving it in place pins the whole staging block for as long as the entry lives, so a short
+// command in a mostly empty block is copied to dev's pack block instead, densely packed with
+// the others. The budget only counts the bytes of entries, not the blocks they keep.
+static void aesd_place_command(struct aesd_dev *dev, struct aesd_staging *staging,
+                               size_t length, struct aesd_buffer_entry *entry)
+{
+    const char *command = staging->block->data + staging->start;
+
+    if (staging->used * 2 < aesd_block_capacity(staging->block) &&
+            aesd_staging_reserve(&dev->pack, length) == 0) {
+        entry->buffptr = memcpy(dev->pack.block->data + dev->pack.used, command, length);
+        dev->pack.used += length;
+        dev->pack.start = dev->pack.used;
+        refcount_inc(&dev->pack.block->refs);
+        return;
+    }
+    // Also when the pack block can't grow, the command is there already
+    entry->buffptr = command;
+    refcount_inc(&staging->block->refs);
+}
+
+// Copy the shape of dev's buffer without buff_lock, under rcu_read_lock if slots is used.
+// Returns the sequence count to check the rest of the lookup against with read_seqcount_retry().
+// The slots are only looked at once they are known to go with mask, so a lookup
+// racing a writer may read stale slot contents but never outside the slot array.
+// The oldest buffered byte is at stream offset next_start - total_size.
+static unsigned int aesd_read_view(struct aesd_dev *dev, struct aesd_buff_view *view)
+{
+    unsigned int seq;
+
+    do {
+        seq = read_seqcount_begin(&dev->buff_seq);
+        view->slots = READ_ONCE(dev->buff.entry);
+        view->mask = READ_ONCE(dev->buff.mask);
+        view->out_offs = READ_ONCE(dev->buff.out_offs);
+        view->count = READ_ONCE(dev->buff.count);
+        view->total_size = READ_ONCE(dev->buff.total_size);
+        view->next_start = dev->buff.next_start;
+    } while (read_seqcount_retry(&dev->buff_seq, seq));
+
+    return seq;
+}
+
+// Stream offset just past the newest byte written to dev
+static uint64_t aesd_stream_end(struct aesd_dev *dev)
+{
+    struct aesd_buff_view view;
+
+    aesd_read_view(dev, &view);
+    return view.next_start;
+}
+
+// Find the entry holding byte *pos without buff_lock, copy it to *entry and take a reference
+// on its storage, to be dropped with aesd_entry_put(). Returns false past the end of the data.
+// With stream given the byte looked for is the one at stream offset *stream instead, moved up
+// to the oldest byte if it was evicted, and *pos is set to where that byte was found.
+static bool aesd_get_entry_for_pos(struct aesd_dev *dev, loff_t *pos, uint64_t *stream,
+                                   struct aesd_buffer_entry *entry, size_t *entry_offset)
+{
+    uint64_t oldest;
+    struct aesd_buff_view view;
+    struct aesd_buffer_entry *found;
+    unsigned int seq;
+    bool referenced;
+
+    do {
+        rcu_read_lock();
+        do {
+            seq = aesd_read_view(dev, &view);
+            if (stream) {
+                oldest = view.next_start - view.total_size;
+                *stream = max(*stream, oldest);
+                *pos = *stream - oldest;
+            }
+            found = aesd_circular_buffer_find_in_slots(view.slots, view.mask, view.out_offs, view.count,
+                                                       view.total_size, (size_t)*pos, entry_offset);
+            if (found) {
+                *entry = *found;
+            }
+        } while (read_seqcount_retry(&dev->buff_seq, seq));
+
+        if (!found) {
+            rcu_read_unlock();
+            return false;
+        }
+        // Fails only if the entry was evicted since, then look again
+        referenced = refcount_inc_not_zero(&aesd_entry_data_of(entry->buffptr)->refs);
+        rcu_read_unlock();
+    } while (!referenced);
+
+    return true;
+}
+
 
+// Allocate dev's header page and a data area of at least data_size bytes
+static int aesd_mmap_setup(struct aesd_dev *dev, unsigned long data_size)
+{
+    struct aesd_mmap_header *header;
+
+    data_size = roundup_pow_of_two(PAGE_ALIGN(data_size));
+    // vmalloc_user() memory is zeroed and can be handed to vm_insert_page() page by page
+    header = vmalloc_user(PAGE_SIZE + data_size);
+    if (!header) {
+        return -ENOMEM;
+    }
+    header->version = AESD_MMAP_VERSION;
+    header->max_entries = (PAGE_SIZE - sizeof(struct aesd_mmap_header)) / sizeof(struct aesd_mmap_entry);
+    header->data_offset = PAGE_SIZE;
+    header->data_size = data_size;
+    dev->mmap_header = header;
+    dev->mmap_data = (char *)header + PAGE_SIZE;
+    return 0;
+}
+
+// Start an update of dev's mapping, with buff_lock held
+static void aesd_mmap_begin(struct aesd_dev *dev)
+{
+    if (dev->mmap_header) {
+        WRITE_ONCE(dev->mmap_header->generation, dev->mmap_header->generation + 1);
+        smp_wmb();
+    }
+}
+
+// Mirror the entry just added to dev's buffer into the data area and list it,
+// between aesd_mmap_begin() and aesd_mmap_end()
+static void aesd_mmap_append(struct aesd_dev *dev, const struct aesd_buffer_entry *entry)
+{
+    struct aesd_mmap_header *header = dev->mmap_header;
+    const char *src = entry->buffptr;
+    size_t size = entry->size;
+    uint64_t start = entry->start;
+    size_t offset, first;
+    u32 slot;
+
+    if (!header) {
+        return;
+    }
+    // Only the tail of an entry larger than the data area fits, and it can't be listed
+    if (size > header->data_size) {
+        src += size - header->data_size;
+        start += size - header->data_size;
+        size = header->data_size;
+    }
+    offset = start & (header->data_size - 1);
+    first = min(size, (size_t)(header->data_size - offset));
+    memcpy(dev->mmap_data + offset, src, first);
+    memcpy(dev->mmap_data, src + first, size - first);
+
+    if (size == entry->size) {
+        div_u64_rem(header->next_index, header->max_entries, &slot);
+        header->entries[slot].start = entry->start;
+        header->entries[slot].size = entry->size;
+        if (header->entry_count < header->max_entries) {
+            header->entry_count++;
+        }
+    }
+    else {
+        header->entry_count = 0;
+    }
+    header->next_index++;
+}
+
+// Finish an update of dev's mapping, dropping the listed entries that were evicted
+// from the buffer or overwritten in the data area since it started
+static void aesd_mmap_end(struct aesd_dev *dev)
+{
+    struct aesd_mmap_header *header = dev->mmap_header;
+    uint64_t next_start = dev->buff.next_start;
+    uint64_t oldest = next_start;
+    u32 slot;
+
+    if (!header) {
+        return;
+    }
+    if (dev->buff.count > 0) {
+        oldest = dev->buff.entry[dev->buff.out_offs & dev->buff.mask].start;
+    }
+    if (next_start > header->data_size) {
+        oldest = max(oldest, next_start - header->data_size);
+    }
+    while (header->entry_count > 0) {
+        div_u64_rem(header->next_index - header->entry_count, header->max_entries, &slot);
+        if (header->entries[slot].start >= oldest) {
+            break;
+        }
+        header->entry_count--;
+    }
+    header->next_start = next_start;
+    smp_wmb();
+    WRITE_ONCE(header->generation, header->generation + 1);
+}
+
+
+
+// Take dev's buff_lock, accounting the time spent waiting for it in dev->lock_stats
+static void aesd_buff_lock(struct aesd_dev *dev)
+{
+    u64 wait_start = ktime_get_ns();
+    u64 wait;
+
+    mutex_lock(&dev->buff_lock);
+    dev->lock_stats.locked_at = ktime_get_ns();
+    wait = dev->lock_stats.locked_at - wait_start;
+    dev->lock_stats.acquired++;
+    dev->lock_stats.wait_ns += wait;
+    dev->lock_stats.max_wait_ns = max(dev->lock_stats.max_wait_ns, wait);
+}
+
+// Release dev's buff_lock, accounting the time it was held
+static void aesd_buff_unlock(struct aesd_dev *dev)
+{
+    u64 hold = ktime_get_ns() - dev->lock_stats.locked_at;
+
+    dev->lock_stats.hold_ns += hold;
+    dev->lock_stats.max_hold_ns = max(dev->lock_stats.max_hold_ns, hold);
+    mutex_unlock(&dev->buff_lock);
+}
+
+// Histogram bucket counting entries or reads of size bytes
+static unsigned int aesd_size_bucket(size_t size)
+{
+    return size ? min_t(unsigned int, ilog2(size), AESD_SIZE_BUCKETS - 1) : 0;
+}
+
+// Account for an entry evicted from dev and drop its reference, with buff_lock held
+static void aesd_release_evicted(struct aesd_dev *dev, const struct aesd_buffer_entry *evicted)
+{
+    trace_aesdchar_evict(dev->index, evicted->start, evicted->size);
+    aesd_entry_put(evicted->buffptr);
+    dev->stats.evictions++;
+}
+
+// Drop the oldest entry of dev, with buff_lock held and inside a buff_seq write section
+static void aesd_evict_oldest(struct aesd_dev *dev)
+{
+    struct aesd_buffer_entry evicted;
+
+    if (aesd_circular_buffer_evict_over_capacity(&dev->buff, dev->buff.count - 1, &evicted)) {
+        aesd_release_evicted(dev, &evicted);
+    }
+}
+
+// Evict the oldest entries until incoming more bytes fit in the byte budget, with buff_lock
+// held and inside a buff_seq write section.
+// The newest entry is always kept, even if it alone is over budget.
+static void aesd_enforce_budget(struct aesd_dev *dev, size_t incoming)
+{
+    struct aesd_buffer_entry evicted;
+
+    while (aesd_circular_buffer_evict_over_budget(&dev->buff, aesd_byte_budget, incoming, &evicted)) {
+        aesd_release_evicted(dev, &evicted);
+    }
+}
+
+// Change the number of entries dev keeps, dropping the oldest ones when shrinking
+static int aesd_resize(struct aesd_dev *dev, unsigned int capacity)
+{
+    struct aesd_buffer_entry *slots = NULL;
+    struct aesd_buffer_entry *previous;
+    struct aesd_buffer_entry evicted;
+    uint32_t slot_count;
+
+    if (capacity < 1 || capacity > AESDCHAR_MAX_CAPACITY) {
+        return -EINVAL;
+    }
+
+    // Allocate before taking the lock, so readers and writers don't wait on it
+    slot_count = aesd_circular_buffer_slots_for(capacity);
+    if (slot_count > AESDCHAR_INLINE_SLOTS) {
+        slots = kcalloc(slot_count, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+        if (!slots) {
+            return -ENOMEM;
+        }
+    }
+
+    aesd_buff_lock(dev);
+    write_seqcount_begin(&dev->buff_seq);
+    aesd_mmap_begin(dev);
+    while (aesd_circular_buffer_evict_over_capacity(&dev->buff, capacity, &evicted)) {
+        aesd_release_evicted(dev, &evicted);
+    }
+    previous = aesd_circular_buffer_resize(&dev->buff, slots, capacity);
+    aesd_mmap_end(dev);
+    write_seqcount_end(&dev->buff_seq);
+    aesd_buff_unlock(dev);
+
+    // Lockless readers may still be searching the old slots
+    if (previous) {
+        synchronize_rcu();
+        kfree(previous);
+    }
+    PDEBUG("aesd_resize: capacity now %u entries in %u slots", capacity, slot_count);
+    return 0;
+}
+
+static int aesd_capacity_set(const char *val, const struct kernel_param *kp)
+{
+    unsigned int capacity, index;
+    int err = kstrtouint(val, 0, &capacity);
+
+    if (err) {
+        return err;
+    }
+    if (capacity < 1 || capacity > AESDCHAR_MAX_CAPACITY) {
+        return -EINVAL;
+    }
+    // Devices already resized stay that way if a later one fails
+    for (index = 0; aesd_device_ready && index < aesd_nr_devices; index++) {
+        err = aesd_resize(&aesd_devices[index], capacity);
+        if (err) {
+            return err;
+        }
+    }
+    aesd_capacity = capacity;
+    return 0;
+}
+
+static int aesd_byte_budget_set(const char *val, const struct kernel_param *kp)
+{
+    unsigned long byte_budget;
+    unsigned int index;
+    struct aesd_dev *dev;
+    int err = kstrtoul(val, 0, &byte_budget);
+
+    if (err) {
+        return err;
+    }
+    aesd_byte_budget = byte_budget;
+    for (index = 0; aesd_device_ready && index < aesd_nr_devices; index++) {
+        dev = &aesd_devices[index];
+        aesd_buff_lock(dev);
+        write_seqcount_begin(&dev->buff_seq);
+        aesd_mmap_begin(dev);
+        aesd_enforce_budget(dev, 0);
+        aesd_mmap_end(dev);
+        write_seqcount_end(&dev->buff_seq);
+        aesd_buff_unlock(dev);
+    }
+    return 0;
+}
+
+static int aesd_pool_pages_set(const char *val, const struct kernel_param *kp)
+{
+    unsigned long previous = aesd_pool_limit;
+    int err = param_set_ulong(val, kp);
+
+    // Start over from empty when shrinking rather than picking blocks to free
+    if (!err && aesd_pool_limit < previous) {
+        aesd_pool_drain();
+    }
+    return err;
+}
+
+// Memory behind the entries of all devices, in /sys/module/aesdchar/parameters/footprint
+static int aesd_footprint_get(char *buffer, const struct kernel_param *kp)
+{
+    size_t buffered = 0, orphaned = 0;
+    unsigned int index;
+
+    for (index = 0; aesd_device_ready && index < aesd_nr_devices; index++) {
+        buffered += READ_ONCE(aesd_devices[index].buff.total_size);
+        orphaned += READ_ONCE(aesd_devices[index].orphan.used) - READ_ONCE(aesd_devices[index].orphan.start);
+    }
+    return scnprintf(buffer, PAGE_SIZE,
+                     "blocks %ld\nblock_bytes %lu\npooled_bytes %lu\nbuffered_bytes %zu\norphaned_bytes %zu\n",
+                     atomic_long_read(&aesd_blocks),
+                     atomic_long_read(&aesd_block_pages) * PAGE_SIZE,
+                     atomic_long_read(&aesd_pool_pages) * PAGE_SIZE,
+                     buffered, orphaned);
+}
+
+static const struct kernel_param_ops aesd_capacity_ops = {
+    .set = aesd_capacity_set,
+    .get = param_get_uint,
+};
+
+static const struct kernel_param_ops aesd_byte_budget_ops = {
+    .set = aesd_byte_budget_set,
+    .get = param_get_ulong,
+};
+
+module_param_cb(capacity, &aesd_capacity_ops, &aesd_capacity, 0644);
+MODULE_PARM_DESC(capacity, "Number of writes kept (1-65536, default 10)");
+module_param_cb(byte_budget, &aesd_byte_budget_ops, &aesd_byte_budget, 0644);
+MODULE_PARM_DESC(byte_budget, "Total bytes kept, oldest writes are evicted beyond it (0 for no limit)");
+static const struct kernel_param_ops aesd_pool_pages_ops = {
+    .set = aesd_pool_pages_set,
+    .get = param_get_ulong,
+};
+
+static const struct kernel_param_ops aesd_footprint_ops = {
+    .get = aesd_footprint_get,
+};
+
+module_param_named(devices, aesd_nr_devices, uint, 0444);
+MODULE_PARM_DESC(devices, "Number of aesdchar devices, each with its own history (1-64, default 1)");
+module_param_named(mmap_size, aesd_mmap_size, ulong, 0444);
+MODULE_PARM_DESC(mmap_size, "Bytes of history mirrored for read-only mmap() of each device (0 to disable mmap)");
+module_param_cb(pool_pages, &aesd_pool_pages_ops, &aesd_pool_limit, 0644);
+MODULE_PARM_DESC(pool_pages, "Pages of released entry blocks kept for reuse (default 64)");
+module_param_cb(footprint, &aesd_footprint_ops, NULL, 0444);
+MODULE_PARM_DESC(footprint, "Memory used for entries, read only");
 
 
 // llseek implementation for A9 supporing SEEK_SET, SEEK_CUR, and SEEK_END
 loff_t aesd_llseek(struct file *filp, loff_t offset, int whence) {
 
     loff_t retpos; 
-    struct aesd_dev *my_dev;
-    size_t total_size = 0;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_buff_view view;
 
-    my_dev = filp->private_data;
-    
     PDEBUG("aesd_llseek: starting with offset=%lld, whence=%d", offset, whence);
     
-    mutex_lock(&my_dev->buff_lock);
-    
-    for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-        if (my_dev->buff.entry[i].buffptr != NULL) {
-            total_size += my_dev->buff.entry[i].size;
-        }
-    }
-    
-    mutex_unlock(&my_dev->buff_lock);   
+    // No need to take buff_lock, the view is consistent on its own
+    aesd_read_view(file->dev, &view);
     
     // Implementation strategy #2: add my own llseek function with logging and locking,
     // but use fixed_size_llseek for logic:
-    retpos = fixed_size_llseek(filp, offset, whence, total_size);
+    retpos = fixed_size_llseek(filp, offset, whence, view.total_size);
+    if (retpos >= 0 && file->tail) {
+        file->stream_pos = view.next_start - view.total_size + retpos;
+    }
     
     PDEBUG("aesd_llseek: returning position %lld", retpos);
+    trace_aesdchar_llseek(file->dev->index, offset, whence, retpos);
     
     return retpos;
 
 }
 
-// ioctl implementation for A9
+// Find write command write_cmd, counting from the oldest, without buff_lock. Copies it to *entry
+// and sets *offset to the file position of its first byte. Returns false if there is no such write
+static bool aesd_entry_for_cmd(struct aesd_dev *dev, uint32_t write_cmd,
+                               struct aesd_buffer_entry *entry, size_t *offset)
+{
+    struct aesd_buff_view view;
+    unsigned int seq;
+    bool found;
+
+    // Index into cb from the oldest command, which also gives the offset of its first byte.
+    // Lockless like reads, retried if a writer changed the buffer meanwhile
+    rcu_read_lock();
+    do {
+        seq = aesd_read_view(dev, &view);
+        found = write_cmd < view.count;
+        if (found) {
+            *entry = view.slots[(view.out_offs + write_cmd) & view.mask];
+            *offset = (size_t)(entry->start - (view.next_start - view.total_size));
+        }
+    } while (read_seqcount_retry(&dev->buff_seq, seq));
+    rcu_read_unlock();
+
+    return found;
+}
+
+// Snapshot dev's counters and state
+static void aesd_stats_fill(struct aesd_dev *dev, struct aesd_stats_info *info)
+{
+    aesd_buff_lock(dev);
+    info->commands = dev->stats.commands;
+    info->bytes_written = dev->stats.bytes_written;
+    info->evictions = dev->stats.evictions;
+    info->total_size = dev->buff.total_size;
+    info->entries = dev->buff.count;
+    info->capacity = dev->buff.capacity;
+    aesd_buff_unlock(dev);
+    info->reads = atomic64_read(&dev->stats.reads);
+    info->bytes_read = atomic64_read(&dev->stats.bytes_read);
+}
+
+static ssize_t aesd_copy_out(struct aesd_dev *dev, loff_t *pos, uint64_t *stream, struct iov_iter *to);
+
+// AESDCHAR_IOCREADAT: like pread() from the start of a write command
+static long aesd_ioctl_read_at(struct aesd_dev *dev, struct aesd_read_at __user *arg)
+{
+    struct aesd_read_at read_at;
+    struct aesd_buffer_entry entry;
+    struct iovec iov;
+    struct iov_iter iter;
+    size_t offset;
+    uint64_t stream;
+    loff_t pos;
+    ssize_t copied;
+
+    if (copy_from_user(&read_at, arg, sizeof(read_at))) {
+        return -EFAULT;
+    }
+    if (!aesd_entry_for_cmd(dev, read_at.write_cmd, &entry, &offset) ||
+            read_at.write_cmd_offset >= entry.size) {
+        return -EINVAL;
+    }
+
+    iov.iov_base = u64_to_user_ptr(read_at.buf);
+    iov.iov_len = min_t(uint64_t, read_at.len, MAX_RW_COUNT);
+    iov_iter_init(&iter, READ, &iov, 1, iov.iov_len);
+
+    // Followed by stream offset, so writes evicted meanwhile don't shift where it reads from
+    stream = entry.start + read_at.write_cmd_offset;
+    pos = offset + read_at.write_cmd_offset;
+    copied = aesd_copy_out(dev, &pos, &stream, &iter);
+    if (copied < 0) {
+        return copied;
+    }
+    read_at.copied = copied;
+    if (copy_to_user(&arg->copied, &read_at.copied, sizeof(read_at.copied))) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+// AESDCHAR_IOCENTRIES: offsets and sizes of a range of write commands
+static long aesd_ioctl_entries(struct aesd_dev *dev, struct aesd_entries __user *arg)
+{
+    struct aesd_entries request;
+    struct aesd_entry_info *infos;
+    struct aesd_buff_view view;
+    uint64_t oldest;
+    uint32_t index, filled;
+    unsigned int seq;
+    long retval = 0;
+
+    if (copy_from_user(&request, arg, sizeof(request))) {
+        return -EFAULT;
+    }
+    request.count = min_t(uint32_t, request.count, AESDCHAR_MAX_CAPACITY);
+    infos = kvmalloc_array(max_t(uint32_t, request.count, 1), sizeof(struct aesd_entry_info), GFP_KERNEL);
+    if (!infos) {
+        return -ENOMEM;
+    }
+
+    rcu_read_lock();
+    do {
+        seq = aesd_read_view(dev, &view);
+        oldest = view.next_start - view.total_size;
+        filled = 0;
+        for (index = request.first; index < view.count && filled < request.count; index++) {
+            const struct aesd_buffer_entry *entry = &view.slots[(view.out_offs + index) & view.mask];
+            infos[filled].offset = entry->start - oldest;
+            infos[filled].size = entry->size;
+            filled++;
+        }
+    } while (read_seqcount_retry(&dev->buff_seq, seq));
+    rcu_read_unlock();
+
+    request.total = view.count;
+    request.count = filled;
+    if (copy_to_user(u64_to_user_ptr(request.entries), infos, filled * sizeof(struct aesd_entry_info)) ||
+            copy_to_user(arg, &request, sizeof(request))) {
+        retval = -EFAULT;
+    }
+    kvfree(infos);
+    return retval;
+}
+
+// AESDCHAR_IOCCLEAR: drop every entry in one buff_seq write section, so lockless
+// readers see either all of the history or none of it
+static long aesd_ioctl_clear(struct aesd_dev *dev)
+{
+    aesd_buff_lock(dev);
+    write_seqcount_begin(&dev->buff_seq);
+    aesd_mmap_begin(dev);
+    while (dev->buff.count > 0) {
+        aesd_entry_put(aesd_circular_buffer_remove_oldest(&dev->buff));
+    }
+    aesd_mmap_end(dev);
+    write_seqcount_end(&dev->buff_seq);
+    aesd_buff_unlock(dev);
+    return 0;
+}
+
+// ioctl implementation for A9, extended with the commands after AESDCHAR_IOCSEEKTO in aesd_ioctl.h
+// AESDCHAR_IOCSEEKTO:
 // First value = command to seek to in circular buffer
 // Second value = zero referenced offset within this command to seek into
-static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) 
+static long aesd_ioctl_cmd(struct file *filp, unsigned int cmd, unsigned long arg) 
 {
 
-    struct aesd_dev *my_dev = filp->private_data;
+    struct aesd_file *file = filp->private_data;
+    struct aesd_dev *my_dev = file->dev;
     struct aesd_seekto seekto;
-    uint32_t entry_count = 0;
-    uint32_t starting_index = 0;
+    struct aesd_buff_view view;
+    struct aesd_buffer_entry target_entry;
+    struct aesd_stats_info stats;
     size_t retoffset = 0;
-    int target_cmd;
-    int current_index;
+    uint32_t value;
     
     PDEBUG("aesd_ioctl: cmd = %d, arg = %ld", cmd, arg);
 
-    // Only handle AESDCHAR_IOCSEEKTO for now
-    if (cmd != AESDCHAR_IOCSEEKTO) {
+    switch (cmd) {
+    case AESDCHAR_IOCSEEKTO:
+        break;
+    case AESDCHAR_IOCTAIL:
+        if (copy_from_user(&value, (uint32_t __user *)arg, sizeof(value))) {
+            return -EFAULT;
+        }
+        // Tail reads pick up from the current position
+        if (value && !file->tail) {
+            aesd_read_view(my_dev, &view);
+            file->stream_pos = view.next_start - view.total_size + min_t(uint64_t, filp->f_pos, view.total_size);
+        }
+        file->tail = value != 0;
+        return 0;
+    case AESDCHAR_IOCREADAT:
+        return aesd_ioctl_read_at(my_dev, (struct aesd_read_at __user *)arg);
+    case AESDCHAR_IOCENTRIES:
+        return aesd_ioctl_entries(my_dev, (struct aesd_entries __user *)arg);
+    case AESDCHAR_IOCSTATS:
+        aesd_stats_fill(my_dev, &stats);
+        return copy_to_user((struct aesd_stats_info __user *)arg, &stats, sizeof(stats)) ? -EFAULT : 0;
+    case AESDCHAR_IOCCLEAR:
+        return aesd_ioctl_clear(my_dev);
+    case AESDCHAR_IOCRESIZE:
+        if (copy_from_user(&value, (uint32_t __user *)arg, sizeof(value))) {
+            return -EFAULT;
+        }
+        return aesd_resize(my_dev, value);
+    default:
         PDEBUG("aesd_ioctl: command not supported");
         return -1;
     }
@@ -89,233 +848,489 @@ static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         return -1;
     }
         
-    mutex_lock(&my_dev->buff_lock);
-    
-    // Count the number of entries and validate the command index
-    for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-        if (my_dev->buff.entry[i].buffptr != NULL) {
-            entry_count++;
-        }
-    }
-
-    if (seekto.write_cmd >= entry_count) {
-        mutex_unlock(&my_dev->buff_lock);
+    if (!aesd_entry_for_cmd(my_dev, seekto.write_cmd, &target_entry, &retoffset)) {
         PDEBUG("aesd_ioctl: invalid command index");
         return -1;
     }
     
-    // Now index into cb from the oldest command, double checking validity
-    starting_index = (my_dev->buff.out_offs + seekto.write_cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    
-    if (seekto.write_cmd_offset >= my_dev->buff.entry[starting_index].size) {
-        mutex_unlock(&my_dev->buff_lock);
+    // Double check validity of the offset within the command
+    if (seekto.write_cmd_offset >= target_entry.size) {
         PDEBUG("aesd_ioctl: command index out of range");
         return -1;
     }
     
-    current_index = my_dev->buff.out_offs; 
-    target_cmd = (int)seekto.write_cmd;  
-
-    // Sum the size of each command preceeding the target
-    for (int i = 0; i < target_cmd; i++) {
-        retoffset += my_dev->buff.entry[current_index].size;
-        current_index = (current_index + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    }
-    
     // And add the offset from the target command itself to finish
     retoffset += seekto.write_cmd_offset;
 
     filp->f_pos = retoffset;    
+    file->stream_pos = target_entry.start + seekto.write_cmd_offset;
 
-    mutex_unlock(&my_dev->buff_lock);
     return 0;
 
 } 
 
+static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct aesd_file *file = filp->private_data;
+    long retval = aesd_ioctl_cmd(filp, cmd, arg);
+
+    trace_aesdchar_ioctl(file->dev->index, cmd, retval);
+    return retval;
+}
+
+
+// Take over dev's orphaned bytes as the start of the line being written to staging,
+// which has nothing pending, with the file's write_lock held
+static void aesd_staging_adopt(struct aesd_dev *dev, struct aesd_staging *staging)
+{
+    struct aesd_staging unused = *staging;
+
+    aesd_buff_lock(dev);
+    if (dev->orphan.block) {
+        *staging = dev->orphan;
+        memset(&dev->orphan, 0, sizeof(dev->orphan));
+    }
+    else {
+        unused.block = NULL;
+    }
+    aesd_buff_unlock(dev);
+
+    if (unused.block) {
+        aesd_block_put(unused.block);
+    }
+}
+
+// Hand the unterminated bytes of a closing open to dev, after those already left there
+static void aesd_staging_orphan(struct aesd_dev *dev, struct aesd_staging *staging)
+{
+    size_t pending = staging->used - staging->start;
+
+    if (pending) {
+        aesd_buff_lock(dev);
+        if (!dev->orphan.block) {
+            dev->orphan = *staging;
+            staging->block = NULL;
+        }
+        else if (aesd_staging_reserve(&dev->orphan, pending) == 0) {
+            memcpy(dev->orphan.block->data + dev->orphan.used, staging->block->data + staging->start, pending);
+            dev->orphan.used += pending;
+        }
+        else {
+            printk(KERN_WARNING "aesdchar: dropping %zu unterminated bytes on close\n", pending);
+        }
+        aesd_buff_unlock(dev);
+    }
+    if (staging->block) {
+        aesd_block_put(staging->block);
+    }
+}
 
 int aesd_open(struct inode *inode, struct file *filp)
 {
     
-    struct aesd_dev *my_dev;
+    struct aesd_file *file;
 
     PDEBUG("open");
     
-    // Handle open: set flip->private_data with our aesd_dev device struct
+    // Handle open: set flip->private_data with this open's state, pointing at our aesd_dev
     // Use inode->i_cdev w/ container_of to locate within aesd_dev
-    my_dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
-    filp->private_data = my_dev;
+    file = kzalloc(sizeof(struct aesd_file), GFP_KERNEL);
+    if (!file) {
+        return -ENOMEM;
+    }
+    file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    mutex_init(&file->write_lock);
+    filp->private_data = file;
     
     return 0;
 }
 
 int aesd_release(struct inode *inode, struct file *filp)
 {
+    struct aesd_file *file = filp->private_data;
+
     PDEBUG("release");
     // Handle release:
-    //struct aesd_dev *my_dev = filp->private_data;
+    aesd_staging_orphan(file->dev, &file->staging);
+    mutex_destroy(&file->write_lock);
+    kfree(file);
     
     return 0;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+// Copy from byte *pos of dev into to, across as many consecutive entries as it takes to fill it.
+// Never takes buff_lock: each entry is found locklessly and pinned by a reference while it is
+// copied. With stream given, reads from that stream offset instead and advances it too.
+// Returns the bytes copied, 0 at the end of the data
+static ssize_t aesd_copy_out(struct aesd_dev *dev, loff_t *pos, uint64_t *stream, struct iov_iter *to)
 {
     ssize_t retval = 0;
-    struct aesd_dev *my_dev;
     size_t entry_offset_byte_rtn;
-    struct aesd_buffer_entry *read_entry;
-    size_t copy_bytes, total_bytes;
-    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
+    struct aesd_buffer_entry read_entry;
+    size_t copy_bytes, copied_bytes;
 
-    // Handle read
-    
-    my_dev = filp->private_data;
-    
-    
-    mutex_lock(&my_dev->buff_lock);
-    
-    // Find which circular buffer entry contains the byte at f_pos
-    read_entry =  aesd_circular_buffer_find_entry_offset_for_fpos(
-                    &my_dev->buff,
-                    (size_t)(*f_pos),
-                    &entry_offset_byte_rtn);
-    
-    if (!read_entry) {
-        // No data to return
-        mutex_unlock(&my_dev->buff_lock);
-        return 0;
-    }
-     
-    // Determine how many bytes should be copied 
-    total_bytes = read_entry->size - entry_offset_byte_rtn;
-    if (count < total_bytes) {
-        copy_bytes = count;
-    }
-    else {
-        copy_bytes = total_bytes;
+    while (iov_iter_count(to) > 0) {
+        // Find which circular buffer entry contains the byte at pos
+        if (!aesd_get_entry_for_pos(dev, pos, stream, &read_entry, &entry_offset_byte_rtn)) {
+            // No more data to return
+            break;
+        }
+         
+        // Copy the rest of this entry, or as much of it as fits
+        copy_bytes = min(read_entry.size - entry_offset_byte_rtn, iov_iter_count(to));
+        copied_bytes = copy_to_iter(read_entry.buffptr + entry_offset_byte_rtn, copy_bytes, to);
+        aesd_entry_put(read_entry.buffptr);
+        *pos += copied_bytes;
+        if (stream) {
+            *stream += copied_bytes;
+        }
+        retval += copied_bytes;
+        
+        if (copied_bytes < copy_bytes) {
+            // Copy failed, report what made it unless nothing did
+            if (retval == 0) {
+                retval = -EFAULT;
+            }
+            break;
+        }
     }
-     
-    // Copy the bytes     
-    if (copy_to_user(buf, read_entry->buffptr + entry_offset_byte_rtn, copy_bytes)) {
-        // Copy failed...
-        mutex_unlock(&my_dev->buff_lock);
-        return -1;
-    }     
+    return retval;
+}
 
-    *f_pos += copy_bytes;
+// read_iter implementation, also used by the VFS for plain read()
+// One read (or readv) drains the device. In tail mode a read finding nothing
+// waits for the next write instead of returning 0
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    ssize_t retval;
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    struct aesd_dev *my_dev = file->dev;
+    uint64_t *stream = file->tail ? &file->stream_pos : NULL;
+    bool nonblock = (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+    loff_t pos = iocb->ki_pos;
+    size_t requested = iov_iter_count(to);
+    PDEBUG("read %zu bytes with offset %lld",requested,pos);
+
+    // Handle read
     
-    mutex_unlock(&my_dev->buff_lock);
+    retval = aesd_copy_out(my_dev, &pos, stream, to);
+    while (retval == 0 && stream && iov_iter_count(to) > 0) {
+        if (nonblock) {
+            retval = -EAGAIN;
+            break;
+        }
+        if (wait_event_interruptible(my_dev->readq, aesd_stream_end(my_dev) > *stream)) {
+            retval = -ERESTARTSYS;
+            break;
+        }
+        retval = aesd_copy_out(my_dev, &pos, stream, to);
+    }
     
-    retval = copy_bytes;
+    trace_aesdchar_read(my_dev->index, iocb->ki_pos, requested, retval);
+    iocb->ki_pos = pos;
+    if (retval > 0) {
+        atomic64_inc(&my_dev->stats.reads);
+        atomic64_add(retval, &my_dev->stats.bytes_read);
+        atomic64_inc(&my_dev->stats.read_sizes[aesd_size_bucket(retval)]);
+    }
      
     return retval;
 }
 
-ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
-                loff_t *f_pos)
+// poll implementation, readable once a read would return data
+__poll_t aesd_poll(struct file *filp, struct poll_table_struct *wait)
+{
+    struct aesd_file *file = filp->private_data;
+    struct aesd_buff_view view;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &file->dev->readq, wait);
+
+    aesd_read_view(file->dev, &view);
+    if (file->tail ? view.next_start > file->stream_pos : filp->f_pos < view.total_size) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    return mask;
+}
+
+// write_iter implementation, also used by the VFS for plain write()
+// A writev() of many lines is taken in one call. Bytes are gathered in this open's own
+// staging area, so writers through different opens never interleave within a line, and
+// buff_lock is only taken to commit each completed command
+ssize_t aesd_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    ssize_t retval = -ENOMEM;
-    struct aesd_dev *my_dev;
+    struct aesd_file *file = iocb->ki_filp->private_data;
+    struct aesd_dev *my_dev = file->dev;
+    struct aesd_staging *staging;
     char *next_newline = NULL;
+    bool added = false;
     struct aesd_buffer_entry command_entry;
-    PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
+    size_t count = iov_iter_count(from);
+    size_t scan_from;
+    PDEBUG("write %zu bytes with offset %lld",count,iocb->ki_pos);
     
     // Handle write
     
-    my_dev = filp->private_data;
+    if (count == 0) {
+        return 0;
+    }
+    staging = &file->staging;
     
-    mutex_lock(&my_dev->buff_lock);
+    mutex_lock(&file->write_lock);
     
-    // Allocate the partial write buffer, or expand existing by size 'count'
-    if (my_dev->partial_write_buff == NULL) {
-        my_dev->partial_write_buff = kmalloc(count, GFP_KERNEL);
-        if (!my_dev->partial_write_buff) {
-            // Allocation failed!
-            mutex_unlock(&my_dev->buff_lock);
-            return -1;
-        }
-        my_dev->bytes_stored = 0;
+    // A lockless peek, adopting takes buff_lock and looks again
+    if (staging->used == staging->start && READ_ONCE(my_dev->orphan.block)) {
+        aesd_staging_adopt(my_dev, staging);
     }
-    else {
-        char *temp_buff;
-        temp_buff = krealloc(my_dev->partial_write_buff, my_dev->bytes_stored + count, GFP_KERNEL);
-        if (!temp_buff) {
-            // Allocation failed!
-            mutex_unlock(&my_dev->buff_lock);
-            return -1;
-        }
-        my_dev->partial_write_buff = temp_buff;
+    
+    if (aesd_staging_reserve(staging, count)) {
+        // Allocation failed!
+        mutex_unlock(&file->write_lock);
+        return -ENOMEM;
     }
     
-    // Copy from user space
-    if (copy_from_user(my_dev->partial_write_buff + my_dev->bytes_stored, buf, count)) {
+    // Copy from user space, gathering every segment of the iterator
+    if (!copy_from_iter_full(staging->block->data + staging->used, count, from)) {
         // Copy failed!!
-        mutex_unlock(&my_dev->buff_lock);
-        return -1;
+        mutex_unlock(&file->write_lock);
+        return -EFAULT;
     }
-    my_dev->bytes_stored += count;
     
-    // Check for newlines in the partial write buff, which signify complete commands
-    
-    next_newline = NULL;
-    next_newline = memchr(my_dev->partial_write_buff, '\n', my_dev->bytes_stored);
+    // Check for newlines in what was just written, which signify complete commands.
+    // The bytes staged before it were already searched
+    scan_from = staging->used;
+    staging->used += count;
+    next_newline = memchr(staging->block->data + scan_from, '\n', staging->used - scan_from);
     while (next_newline) {
     
     
         // First, get the position and length of the complete command
-        size_t newline_position = next_newline - my_dev->partial_write_buff;
-        size_t command_length = newline_position + 1;
-        size_t remaining;
-        const char *overwritten_entry;
+        size_t command_length = next_newline + 1 - (staging->block->data + staging->start);
+        size_t unused_offset;
+        struct aesd_buffer_entry *added_entry;
         
-        // Store the command in a new buffer to insert into circular buffer
-        char* command_buffer = kmalloc(command_length, GFP_KERNEL);
-        if (!command_buffer) {
-            // Allocation failed!
-            mutex_unlock(&my_dev->buff_lock);
-            return -1;
-        }
-        memcpy(command_buffer, my_dev->partial_write_buff, command_length);
-    
-        command_entry.buffptr = command_buffer;
+        // Its entry holds a reference to the block the command is kept in
         command_entry.size = command_length;
         
-        // We are responsible for freeing any overwritten entries
-        overwritten_entry = aesd_circular_buffer_add_entry(&my_dev->buff, &command_entry);
-        if (overwritten_entry) {
-            kfree(overwritten_entry);
+        // Make room under the capacity and the byte budget, then add it.
+        // Evicting here rather than letting the add overwrite traces the dropped entry
+        aesd_buff_lock(my_dev);
+        // Before the write section, placing it may allocate
+        aesd_place_command(my_dev, staging, command_length, &command_entry);
+        write_seqcount_begin(&my_dev->buff_seq);
+        aesd_mmap_begin(my_dev);
+        if (my_dev->buff.count == my_dev->buff.capacity) {
+            aesd_evict_oldest(my_dev);
         }
+        aesd_enforce_budget(my_dev, command_length);
+        aesd_circular_buffer_add_entry(&my_dev->buff, &command_entry);
+        added_entry = aesd_circular_buffer_entry_at(&my_dev->buff, my_dev->buff.count - 1, &unused_offset);
+        my_dev->stats.commands++;
+        my_dev->stats.bytes_written += command_length;
+        my_dev->stats.entry_sizes[aesd_size_bucket(command_length)]++;
+        aesd_mmap_append(my_dev, added_entry);
+        aesd_mmap_end(my_dev);
+        write_seqcount_end(&my_dev->buff_seq);
+        trace_aesdchar_write_commit(my_dev->index, added_entry->start, command_length,
+                                    my_dev->buff.count, my_dev->buff.total_size);
+        aesd_buff_unlock(my_dev);
+        added = true;
         
-        remaining = my_dev->bytes_stored - command_length;
-        memmove(my_dev->partial_write_buff, my_dev->partial_write_buff + command_length, remaining);
-        my_dev->bytes_stored = remaining;
+        staging->start += command_length;
         
         // Continue the while loop if we have another newline
-        next_newline = memchr(my_dev->partial_write_buff, '\n', my_dev->bytes_stored);
+        next_newline = memchr(staging->block->data + staging->start, '\n', staging->used - staging->start);
     }
     
-    *f_pos += count;
-    
-    mutex_unlock(&my_dev->buff_lock);
+    iocb->ki_pos += count;
     
-    retval = count;
+    mutex_unlock(&file->write_lock);
+
+    if (added) {
+        wake_up_interruptible_poll(&my_dev->readq, EPOLLIN | EPOLLRDNORM);
+    }
     
-    return retval;
+    return count;
+}
+
+// mmap implementation, mapping the header page and then the data area twice over,
+// see aesd_mmap.h. The pages are inserted up front, so there is nothing to fault in,
+// and the mapping can never be made writable
+int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *my_dev = ((struct aesd_file *)filp->private_data)->dev;
+    char *area = (char *)my_dev->mmap_header;
+    unsigned long data_pages, index, page;
+    int err;
+
+    PDEBUG("mmap %lu pages at offset %lu", vma_pages(vma), vma->vm_pgoff);
+
+    if (!area) {
+        return -ENODEV;
+    }
+    if (vma->vm_flags & VM_WRITE) {
+        return -EPERM;
+    }
+    data_pages = my_dev->mmap_header->data_size >> PAGE_SHIFT;
+    if (vma->vm_pgoff != 0 || vma_pages(vma) > 1 + 2 * data_pages) {
+        return -EINVAL;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_mod(vma, VM_DONTEXPAND | VM_DONTDUMP, VM_MAYWRITE);
+#else
+    vma->vm_flags = (vma->vm_flags | VM_DONTEXPAND | VM_DONTDUMP) & ~VM_MAYWRITE;
+#endif
+
+    for (index = 0; index < vma_pages(vma); index++) {
+        page = index == 0 ? 0 : 1 + (index - 1) % data_pages;
+        err = vm_insert_page(vma, vma->vm_start + index * PAGE_SIZE, vmalloc_to_page(area + page * PAGE_SIZE));
+        if (err) {
+            return err;
+        }
+    }
+    return 0;
 }
 
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
-    .read =     aesd_read,
-    .write =    aesd_write,
+    .read_iter = aesd_read_iter,
+    .write_iter = aesd_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
     .open =     aesd_open,
     .release =  aesd_release,
     .llseek  = aesd_llseek,
     .unlocked_ioctl = aesd_ioctl,
+    .poll =     aesd_poll,
+    .mmap =     aesd_mmap,
+};
+
+// Counters of one device, in /sys/class/aesdchar/<device>/stats
+static ssize_t stats_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    struct aesd_stats_info stats;
+
+    aesd_stats_fill(dev_get_drvdata(device), &stats);
+    return scnprintf(buf, PAGE_SIZE,
+                     "entries %u\nbytes %llu\ncommands %llu\nbytes_written %llu\nevictions %llu\nreads %llu\nbytes_read %llu\n",
+                     stats.entries, stats.total_size, stats.commands, stats.bytes_written, stats.evictions,
+                     stats.reads, stats.bytes_read);
+}
+static DEVICE_ATTR_RO(stats);
+
+static struct attribute *aesd_attrs[] = {
+    &dev_attr_stats.attr,
+    NULL,
 };
+ATTRIBUTE_GROUPS(aesd);
+
+// debugfs files of one device, in /sys/kernel/debug/aesdchar/<device>/
+
+// The counters of the stats attribute
+static int counters_show(struct seq_file *s, void *unused)
+{
+    struct aesd_stats_info stats;
+
+    aesd_stats_fill(s->private, &stats);
+    seq_printf(s, "commands %llu\nbytes_written %llu\nevictions %llu\nreads %llu\nbytes_read %llu\n",
+               stats.commands, stats.bytes_written, stats.evictions, stats.reads, stats.bytes_read);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(counters);
+
+// Helper function to print a size histogram, one "<smallest>-<largest> <count>" line per bucket
+static void aesd_show_sizes(struct seq_file *s, const u64 *counts)
+{
+    unsigned int bucket;
+
+    for (bucket = 0; bucket < AESD_SIZE_BUCKETS - 1; bucket++) {
+        seq_printf(s, "%lu-%lu %llu\n", 1UL << bucket, (2UL << bucket) - 1, counts[bucket]);
+    }
+    seq_printf(s, "%lu- %llu\n", 1UL << bucket, counts[bucket]);
+}
+
+static int entry_sizes_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+    u64 counts[AESD_SIZE_BUCKETS];
+
+    mutex_lock(&dev->buff_lock);
+    memcpy(counts, dev->stats.entry_sizes, sizeof(counts));
+    mutex_unlock(&dev->buff_lock);
+    aesd_show_sizes(s, counts);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(entry_sizes);
+
+static int read_sizes_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+    u64 counts[AESD_SIZE_BUCKETS];
+    unsigned int bucket;
+
+    for (bucket = 0; bucket < AESD_SIZE_BUCKETS; bucket++) {
+        counts[bucket] = atomic64_read(&dev->stats.read_sizes[bucket]);
+    }
+    aesd_show_sizes(s, counts);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(read_sizes);
+
+// Taken without going through aesd_buff_lock(), so looking doesn't count
+static int lock_times_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+    struct aesd_lock_stats lock_stats;
+
+    mutex_lock(&dev->buff_lock);
+    lock_stats = dev->lock_stats;
+    mutex_unlock(&dev->buff_lock);
+    seq_printf(s, "acquired %llu\nwait_ns %llu\nmax_wait_ns %llu\nhold_ns %llu\nmax_hold_ns %llu\n",
+               lock_stats.acquired, lock_stats.wait_ns, lock_stats.max_wait_ns,
+               lock_stats.hold_ns, lock_stats.max_hold_ns);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(lock_times);
+
+// What the device holds now
+static int usage_show(struct seq_file *s, void *unused)
+{
+    struct aesd_dev *dev = s->private;
+    uint32_t entries, capacity;
+    size_t bytes, orphaned;
+
+    mutex_lock(&dev->buff_lock);
+    entries = dev->buff.count;
+    capacity = dev->buff.capacity;
+    bytes = dev->buff.total_size;
+    orphaned = dev->orphan.used - dev->orphan.start;
+    mutex_unlock(&dev->buff_lock);
+    seq_printf(s, "entries %u\ncapacity %u\nbytes %zu\nbyte_budget %lu\norphaned_bytes %zu\nmmap_bytes %llu\n",
+               entries, capacity, bytes, READ_ONCE(aesd_byte_budget), orphaned,
+               dev->mmap_header ? dev->mmap_header->data_size : 0);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(usage);
+
+static void aesd_debugfs_dev(struct aesd_dev *dev)
+{
+    struct dentry *dir = debugfs_create_dir(dev_name(dev->device), aesd_debugfs);
+
+    debugfs_create_file("counters", 0444, dir, dev, &counters_fops);
+    debugfs_create_file("entry_sizes", 0444, dir, dev, &entry_sizes_fops);
+    debugfs_create_file("read_sizes", 0444, dir, dev, &read_sizes_fops);
+    debugfs_create_file("lock_times", 0444, dir, dev, &lock_times_fops);
+    debugfs_create_file("usage", 0444, dir, dev, &usage_fops);
+}
 
 static int aesd_setup_cdev(struct aesd_dev *dev)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + dev->index);
 
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
@@ -327,32 +1342,132 @@ static int aesd_setup_cdev(struct aesd_dev *dev)
     return err;
 }
 
+// Free what a device holds, once nothing can reach it
+static void aesd_free_dev(struct aesd_dev *dev)
+{
+    while (dev->buff.count > 0) {
+        aesd_entry_put(aesd_circular_buffer_remove_oldest(&dev->buff));
+    }
+    kfree(aesd_circular_buffer_resize(&dev->buff, NULL, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED));
+    if (dev->orphan.block) {
+        aesd_block_put(dev->orphan.block);
+    }
+    if (dev->pack.block) {
+        aesd_block_put(dev->pack.block);
+    }
+    vfree(dev->mmap_header);
+    mutex_destroy(&dev->buff_lock);
+}
+
+// Initialize device index and make it live, with a node named aesdchar for the first
+// and aesdchar<index> for the others
+static int aesd_setup_dev(struct aesd_dev *dev, unsigned int index)
+{
+    int result = 0;
+
+    // Initialize the AESD specific portion of the device
+    dev->index = index;
+    aesd_circular_buffer_init(&dev->buff);
+    mutex_init(&dev->buff_lock);
+    seqcount_mutex_init(&dev->buff_seq, &dev->buff_lock);
+    init_waitqueue_head(&dev->readq);
+
+    // Set up before the device goes live, mmap() can't take buff_lock to do it lazily
+    // since writers fault on user memory while holding it
+    if (aesd_mmap_size) {
+        result = aesd_mmap_setup(dev, aesd_mmap_size);
+    }
+    if (!result && aesd_capacity != AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+        result = aesd_resize(dev, aesd_capacity);
+    }
+    if (!result) {
+        result = aesd_setup_cdev(dev);
+    }
+    if (result) {
+        aesd_free_dev(dev);
+        return result;
+    }
+
+    dev->device = device_create(aesd_class, NULL, dev->cdev.dev, dev,
+                                index ? "aesdchar%u" : "aesdchar", index);
+    if (IS_ERR(dev->device)) {
+        result = PTR_ERR(dev->device);
+        cdev_del(&dev->cdev);
+        aesd_free_dev(dev);
+        return result;
+    }
+    aesd_debugfs_dev(dev);
+    return 0;
+}
+
+static void aesd_teardown_dev(struct aesd_dev *dev)
+{
+    device_destroy(aesd_class, dev->cdev.dev);
+    cdev_del(&dev->cdev);
+    aesd_free_dev(dev);
+}
+
 
 
 int aesd_init_module(void)
 {
     dev_t dev = 0;
+    unsigned int index;
     int result;
-    result = alloc_chrdev_region(&dev, aesd_minor, 1,
+
+    if (aesd_nr_devices < 1 || aesd_nr_devices > AESD_MAX_DEVICES) {
+        printk(KERN_WARNING "aesdchar: devices must be 1 to %d\n", AESD_MAX_DEVICES);
+        return -EINVAL;
+    }
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devices,
             "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
         return result;
     }
-    memset(&aesd_device,0,sizeof(struct aesd_dev));
 
-    // Initialize the AESD specific portion of the device
-    aesd_circular_buffer_init(&aesd_device.buff);
-    aesd_device.partial_write_buff = NULL;
-    aesd_device.bytes_stored = 0;
-    mutex_init(&aesd_device.buff_lock);
+    aesd_devices = kcalloc(aesd_nr_devices, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (!aesd_devices) {
+        result = -ENOMEM;
+        goto fail_devices;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+    aesd_class = class_create("aesdchar");
+#else
+    aesd_class = class_create(THIS_MODULE, "aesdchar");
+#endif
+    if (IS_ERR(aesd_class)) {
+        result = PTR_ERR(aesd_class);
+        goto fail_class;
+    }
+    aesd_class->dev_groups = aesd_groups;
+    // Like all of debugfs, optional: the calls do nothing once one has failed
+    aesd_debugfs = debugfs_create_dir("aesdchar", NULL);
 
-    result = aesd_setup_cdev(&aesd_device);
+    for (index = 0; index < aesd_nr_devices; index++) {
+        result = aesd_setup_dev(&aesd_devices[index], index);
+        if (result) {
+            goto fail_setup;
+        }
+    }
+    aesd_device_ready = true;
+    return 0;
 
-    if( result ) {
-        unregister_chrdev_region(dev, 1);
+fail_setup:
+    debugfs_remove_recursive(aesd_debugfs);
+    while (index-- > 0) {
+        aesd_teardown_dev(&aesd_devices[index]);
     }
+    // Blocks freed by the RCU callbacks land in the pool, which would leak their pages otherwise
+    rcu_barrier();
+    aesd_pool_drain();
+    class_destroy(aesd_class);
+fail_class:
+    kfree(aesd_devices);
+fail_devices:
+    unregister_chrdev_region(dev, aesd_nr_devices);
     return result;
 
 }
@@ -360,19 +1475,22 @@ int aesd_init_module(void)
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
+    unsigned int index;
 
-    cdev_del(&aesd_device.cdev);
+    aesd_device_ready = false;
 
     // Cleanup AESD specific poritions here as necessary
-    for (int i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++) {
-        if (aesd_device.buff.entry[i].buffptr) {
-            kfree(aesd_device.buff.entry[i].buffptr);
-        }
+    debugfs_remove_recursive(aesd_debugfs);
+    for (index = 0; index < aesd_nr_devices; index++) {
+        aesd_teardown_dev(&aesd_devices[index]);
     }
-    mutex_destroy(&aesd_device.buff_lock);
-
+    // Wait for the blocks still queued to be freed, their callback goes away with the module
+    rcu_barrier();
+    aesd_pool_drain();
+    class_destroy(aesd_class);
+    kfree(aesd_devices);
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, aesd_nr_devices);
 }
 
 
@@ -0,0 +1,111 @@
+// Pre-opened listening socket support for aesdsocket (socket activation)
+// Author: Eric Percin, 10/18/2026
+// References: https://www.freedesktop.org/software/systemd/man/latest/sd_listen_fds.html
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "activation.h"
+
+
+int activation_from_fd(int fd) {
+    int value;
+    socklen_t len = sizeof(value);
+
+    if (fd < 0) {
+        fprintf(stderr, "Invalid listening descriptor %d\n", fd);
+        return -1;
+    }
+
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &value, &len) == -1) {
+        perror("Call to getsockopt() failed for inherited descriptor");
+        return -1;
+    }
+    if (value != SOCK_STREAM) {
+        fprintf(stderr, "Inherited descriptor %d is not a stream socket\n", fd);
+        return -1;
+    }
+
+    len = sizeof(value);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &value, &len) == -1) {
+        perror("Call to getsockopt() failed for inherited descriptor");
+        return -1;
+    }
+    if (!value) {
+        fprintf(stderr, "Inherited descriptor %d is not listening\n", fd);
+        return -1;
+    }
+
+    // Don't leak the listener into anything we exec
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+        perror("Call to fcntl() failed for inherited descriptor");
+        return -1;
+    }
+
+    return fd;
+}
+
+
+int activation_from_environment(void) {
+    const char *listen_pid = getenv("LISTEN_PID");
+    const char *listen_fds = getenv("LISTEN_FDS");
+    char *end;
+    long pid, count;
+    int listener = -1;
+
+    if (!listen_pid || !listen_fds) {
+        return -1;
+    }
+
+    // The variables are only meant for the process the supervisor started
+    errno = 0;
+    pid = strtol(listen_pid, &end, 10);
+    if (errno || *end != '\0' || pid != (long)getpid()) {
+        return -1;
+    }
+
+    errno = 0;
+    count = strtol(listen_fds, &end, 10);
+    if (errno || *end != '\0' || count <= 0) {
+        return -1;
+    }
+
+    // Only one port is served, so use the first socket and close the rest
+    listener = activation_from_fd(LISTEN_FDS_START);
+    for (long i = 1; i < count; i++) {
+        close(LISTEN_FDS_START + i);
+    }
+
+    // Don't pass the variables on to children
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    return listener;
+}
+
+
+int activation_write_pidfile(const char *path) {
+    char pid_buffer[32];
+    int fd, len;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("Call to open() failed for pidfile");
+        return -1;
+    }
+
+    len = snprintf(pid_buffer, sizeof(pid_buffer), "%d\n", (int)getpid());
+    if (write(fd, pid_buffer, len) != len) {
+        perror("Call to write() failed for pidfile");
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,23 @@
+// Pre-opened listening socket support for aesdsocket (socket activation)
+// Author: Eric Percin, 10/18/2026
+// References: https://www.freedesktop.org/software/systemd/man/latest/sd_listen_fds.html
+
+#ifndef ACTIVATION_H
+#define ACTIVATION_H
+
+// First inherited descriptor under the LISTEN_FDS convention
+#define LISTEN_FDS_START 3
+
+// Check that fd is a listening TCP socket we can accept on.
+// Returns fd on success, or -1 if it can't be used.
+int activation_from_fd(int fd);
+
+// Pick up a listener passed by a supervisor using LISTEN_FDS/LISTEN_PID.
+// Returns the socket, or -1 if none was passed to this process.
+int activation_from_environment(void);
+
+// Write our pid to path so start-stop-daemon can find the daemonized process.
+// Returns 0 on success, -1 on failure.
+int activation_write_pidfile(const char *path);
+
+#endif // ACTIVATION_H
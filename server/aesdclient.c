@@ -0,0 +1,780 @@
+// libaesdclient: client library for aesdsocket
+// Author: Eric Percin, 10/18/2026
+// References: https://man7.org/linux/man-pages/man3/getaddrinfo.3.html
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "aesdclient.h"
+#include "lz4.h"
+
+#define AESD_CLIENT_READ_SIZE 4096
+
+// Internal status of a request lost with its connection, callers only ever see -1
+#define AESD_STATUS_DISCONNECTED -2
+
+enum aesd_reply_kind {
+    AESD_REPLY_OFFSET,      // "OK <offset>\n"
+    AESD_REPLY_DATA         // "DATA <length>\n<bytes>", or "ZDATA\n<frames>" when compressed
+};
+
+// A request waiting for its reply, returned to the caller as an aesd_future
+struct aesd_future {
+    enum aesd_reply_kind kind;
+    bool done;
+    int status;
+    uint64_t offset;
+    char *data;
+    size_t data_length;
+    aesd_write_callback callback;
+    void *arg;
+    struct aesd_conn *conn;
+    struct aesd_future *next;
+};
+
+struct aesd_conn {
+    struct aesd_client *client;
+    // Held while sending, so requests go out in the order they are queued
+    pthread_mutex_t send_lock;
+    // Protects the queue; the reader only ever takes this one, so a blocked send can't stall it
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // Only closed under send_lock, so a sender never writes to a reused descriptor
+    int fd;
+    // Set by the reader when the connection failed
+    bool broken;
+    pthread_t reader;
+    bool reader_started;
+    struct aesd_future *head;
+    struct aesd_future *tail;
+};
+
+struct aesd_client {
+    char host[256];
+    char port[8];
+    int pool_size;
+    // Ask for compressed reads on connections opened from now on
+    bool compress;
+    unsigned int next_conn;
+    struct aesd_conn conns[];
+};
+
+
+// Helper function to sleep for ms milliseconds
+static void aesd_sleep_ms(long ms) {
+    struct timespec delay = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+    nanosleep(&delay, NULL);
+}
+
+
+// Helper function to send all of buf
+static int aesd_send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t rc = send(fd, buf, len, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += rc;
+        len -= rc;
+    }
+    return 0;
+}
+
+
+// Helper function to open a TCP connection to the client's server, retrying with backoff
+static int aesd_connect(const struct aesd_client *client) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    long delay_ms = AESD_CLIENT_RETRY_MS;
+
+    for (int attempt = 0; attempt < AESD_CLIENT_CONNECT_ATTEMPTS; attempt++) {
+        struct addrinfo *results, *result;
+        if (attempt > 0) {
+            aesd_sleep_ms(delay_ms);
+            delay_ms *= 2;
+        }
+        if (getaddrinfo(client->host, client->port, &hints, &results) != 0) {
+            continue;
+        }
+        for (result = results; result; result = result->ai_next) {
+            int fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+            if (connect(fd, result->ai_addr, result->ai_addrlen) == 0) {
+                freeaddrinfo(results);
+                return fd;
+            }
+            close(fd);
+        }
+        freeaddrinfo(results);
+    }
+    return -1;
+}
+
+
+// Helper function to read one newline terminated line, a byte at a time so nothing
+// after it is consumed. Returns the line length or -1.
+static ssize_t aesd_read_line(int fd, char *line, size_t len) {
+    size_t used = 0;
+    while (used < len - 1) {
+        ssize_t rc = recv(fd, line + used, 1, 0);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc <= 0) {
+            return -1;
+        }
+        if (line[used++] == '\n') {
+            line[used] = '\0';
+            return used;
+        }
+    }
+    return -1;
+}
+
+
+// Buffered reader over a connection
+struct aesd_reader {
+    int fd;
+    char buf[AESD_CLIENT_READ_SIZE];
+    size_t start;
+    size_t end;
+};
+
+// Helper function to refill the reader buffer. Returns -1 on EOF or error.
+static int aesd_reader_fill(struct aesd_reader *reader) {
+    if (reader->start == reader->end) {
+        reader->start = reader->end = 0;
+    }
+    else if (reader->end == sizeof(reader->buf)) {
+        memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    while (1) {
+        ssize_t rc = recv(reader->fd, reader->buf + reader->end, sizeof(reader->buf) - reader->end, 0);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc <= 0) {
+            return -1;
+        }
+        reader->end += rc;
+        return 0;
+    }
+}
+
+
+// Helper function to copy len bytes out of the reader
+static int aesd_reader_take(struct aesd_reader *reader, char *data, size_t len) {
+    while (len > 0) {
+        if (reader->start == reader->end && aesd_reader_fill(reader) < 0) {
+            return -1;
+        }
+        size_t available = reader->end - reader->start;
+        size_t chunk = available < len ? available : len;
+        memcpy(data, reader->buf + reader->start, chunk);
+        reader->start += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+
+// Helper function to read a reply header line into line. Returns -1 on EOF or error.
+static int aesd_reader_line(struct aesd_reader *reader, char *line, size_t len) {
+    while (1) {
+        char *newline = memchr(reader->buf + reader->start, '\n', reader->end - reader->start);
+        if (newline) {
+            size_t line_length = newline + 1 - (reader->buf + reader->start);
+            if (line_length >= len) {
+                return -1;
+            }
+            memcpy(line, reader->buf + reader->start, line_length);
+            line[line_length] = '\0';
+            reader->start += line_length;
+            return 0;
+        }
+        if (reader->end - reader->start >= len || aesd_reader_fill(reader) < 0) {
+            return -1;
+        }
+    }
+}
+
+
+// Helper function to read the frames of a compressed reply up to "END\n" into a malloc'd
+// buffer. Returns -1 on EOF, error or a malformed frame.
+static int aesd_reader_frames(struct aesd_reader *reader, char **data, size_t *len) {
+    char line[128];
+    char *out = NULL, *packed = NULL;
+    size_t out_length = 0;
+    int rc = -1;
+
+    while (aesd_reader_line(reader, line, sizeof(line)) == 0) {
+        unsigned long long raw_length, packed_length;
+        bool is_lz4;
+
+        if (strcmp(line, "END\n") == 0) {
+            *data = out ? out : malloc(1);
+            *len = out_length;
+            out = NULL;
+            rc = *data ? 0 : -1;
+            break;
+        }
+        if (sscanf(line, "LZ4 %llu %llu", &raw_length, &packed_length) == 2) {
+            is_lz4 = true;
+        }
+        else if (sscanf(line, "RAW %llu", &raw_length) == 1) {
+            is_lz4 = false;
+        }
+        else {
+            break;
+        }
+
+        char *grown = realloc(out, out_length + raw_length + 1);
+        if (!grown) {
+            break;
+        }
+        out = grown;
+        if (!is_lz4) {
+            if (aesd_reader_take(reader, out + out_length, raw_length) < 0) {
+                break;
+            }
+        }
+        else {
+            char *packed_grown = realloc(packed, packed_length ? packed_length : 1);
+            if (!packed_grown) {
+                break;
+            }
+            packed = packed_grown;
+            if (aesd_reader_take(reader, packed, packed_length) < 0 ||
+                    aesd_lz4_decompress(packed, packed_length, out + out_length, raw_length) != (ssize_t)raw_length) {
+                break;
+            }
+        }
+        out_length += raw_length;
+    }
+
+    free(packed);
+    free(out);
+    return rc;
+}
+
+
+// Helper function to complete a request, with conn->lock held. Requests with a callback
+// are returned to be finished by the caller once the lock is dropped.
+static struct aesd_future *aesd_complete(struct aesd_conn *conn, struct aesd_future *future, int status) {
+    future->status = status;
+    future->done = true;
+    if (future->callback) {
+        return future;
+    }
+    pthread_cond_broadcast(&conn->cond);
+    return NULL;
+}
+
+
+// Helper function to run and free a completed callback request
+static void aesd_finish_callback(struct aesd_future *future) {
+    future->callback(future->arg, future->status < 0 ? -1 : 0, future->offset);
+    free(future->data);
+    free(future);
+}
+
+
+// Thread function that matches replies on a connection to its queued requests
+static void *aesd_reader_thread(void *arg) {
+    struct aesd_conn *conn = arg;
+    struct aesd_reader reader = { .fd = conn->fd };
+    char line[128];
+
+    while (aesd_reader_line(&reader, line, sizeof(line)) == 0) {
+        unsigned long long value = 0;
+        char *data = NULL;
+        int status = -1;
+
+        if (sscanf(line, "OK %llu", &value) == 1) {
+            status = 0;
+        }
+        else if (sscanf(line, "DATA %llu", &value) == 1) {
+            data = malloc(value ? value : 1);
+            if (!data || aesd_reader_take(&reader, data, value) < 0) {
+                free(data);
+                break;
+            }
+            status = 0;
+        }
+        else if (strcmp(line, "ZDATA\n") == 0) {
+            size_t data_length;
+            if (aesd_reader_frames(&reader, &data, &data_length) < 0) {
+                break;
+            }
+            value = data_length;
+            status = 0;
+        }
+        else if (strncmp(line, "ERROR", strlen("ERROR")) != 0) {
+            // Not a reply we know, the stream can't be trusted any more
+            break;
+        }
+
+        pthread_mutex_lock(&conn->lock);
+        struct aesd_future *future = conn->head;
+        if (!future) {
+            pthread_mutex_unlock(&conn->lock);
+            free(data);
+            break;
+        }
+        conn->head = future->next;
+        if (data && future->kind == AESD_REPLY_DATA) {
+            future->data = data;
+            future->data_length = value;
+        }
+        else {
+            free(data);
+            future->offset = value;
+        }
+        struct aesd_future *callback_future = aesd_complete(conn, future, status);
+        pthread_mutex_unlock(&conn->lock);
+
+        if (callback_future) {
+            aesd_finish_callback(callback_future);
+        }
+    }
+
+    // Fail everything still waiting, the server may or may not have seen it
+    pthread_mutex_lock(&conn->lock);
+    struct aesd_future *failed = conn->head, *callbacks = NULL;
+    conn->head = conn->tail = NULL;
+    while (failed) {
+        struct aesd_future *next = failed->next;
+        if (aesd_complete(conn, failed, AESD_STATUS_DISCONNECTED)) {
+            failed->next = callbacks;
+            callbacks = failed;
+        }
+        failed = next;
+    }
+    conn->broken = true;
+    pthread_mutex_unlock(&conn->lock);
+
+    while (callbacks) {
+        struct aesd_future *next = callbacks->next;
+        aesd_finish_callback(callbacks);
+        callbacks = next;
+    }
+    return NULL;
+}
+
+
+// Helper function to make sure conn is connected and pipelined, with conn->send_lock held
+static int aesd_conn_ready(struct aesd_conn *conn) {
+    char line[64];
+
+    pthread_mutex_lock(&conn->lock);
+    bool broken = conn->broken;
+    int fd = conn->fd;
+    pthread_mutex_unlock(&conn->lock);
+    if (fd != -1 && !broken) {
+        return 0;
+    }
+
+    // The old reader already gave up the connection, it only has to return
+    if (conn->reader_started) {
+        pthread_join(conn->reader, NULL);
+        conn->reader_started = false;
+    }
+    if (fd != -1) {
+        close(fd);
+        conn->fd = -1;
+    }
+
+    fd = aesd_connect(conn->client);
+    if (fd < 0) {
+        return -1;
+    }
+    if (aesd_send_all(fd, "AESDSOCKET_PIPELINE\n", strlen("AESDSOCKET_PIPELINE\n")) < 0 ||
+            aesd_read_line(fd, line, sizeof(line)) < 0 || strcmp(line, "OK PIPELINE\n") != 0) {
+        // An old server answers with its whole store instead
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+    if (conn->client->compress &&
+            (aesd_send_all(fd, "AESDSOCKET_COMPRESS\n", strlen("AESDSOCKET_COMPRESS\n")) < 0 ||
+             aesd_read_line(fd, line, sizeof(line)) < 0 || strcmp(line, "OK COMPRESS\n") != 0)) {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    conn->fd = fd;
+    conn->broken = false;
+    pthread_mutex_unlock(&conn->lock);
+    if (pthread_create(&conn->reader, NULL, aesd_reader_thread, conn) != 0) {
+        conn->fd = -1;
+        close(fd);
+        return -1;
+    }
+    conn->reader_started = true;
+    return 0;
+}
+
+
+// Helper function to pick the next connection of the pool
+static struct aesd_conn *aesd_pick(struct aesd_client *client) {
+    unsigned int index = __atomic_fetch_add(&client->next_conn, 1, __ATOMIC_RELAXED);
+    return &client->conns[index % client->pool_size];
+}
+
+
+// Helper function to queue futures and send buf on one connection.
+// Returns 0 if sent; on failure the futures were not queued.
+static int aesd_submit(struct aesd_conn *conn, struct aesd_future **futures, size_t count,
+                       const char *buf, size_t len) {
+    pthread_mutex_lock(&conn->send_lock);
+    if (aesd_conn_ready(conn) < 0) {
+        pthread_mutex_unlock(&conn->send_lock);
+        return -1;
+    }
+
+    // Queued before sending, the reply can arrive before send() returns
+    pthread_mutex_lock(&conn->lock);
+    if (conn->broken) {
+        // The reader already failed its queue, nobody would complete these
+        pthread_mutex_unlock(&conn->lock);
+        pthread_mutex_unlock(&conn->send_lock);
+        return -1;
+    }
+    int fd = conn->fd;
+    for (size_t i = 0; i < count; i++) {
+        futures[i]->next = NULL;
+        if (conn->tail && conn->head) {
+            conn->tail->next = futures[i];
+        }
+        else {
+            conn->head = futures[i];
+        }
+        conn->tail = futures[i];
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    // A failed send takes the connection down, the reader then fails the queued futures
+    if (aesd_send_all(fd, buf, len) < 0) {
+        shutdown(fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&conn->send_lock);
+    return 0;
+}
+
+
+// Helper function to check a line and make a newline terminated copy of it in *copy
+static int aesd_line(const char *line, size_t len, char **copy, size_t *copy_length) {
+    if (len > 0 && line[len - 1] == '\n') {
+        len--;
+    }
+    if (memchr(line, '\n', len)) {
+        errno = EINVAL;
+        return -1;
+    }
+    *copy = malloc(len + 1);
+    if (!*copy) {
+        return -1;
+    }
+    memcpy(*copy, line, len);
+    (*copy)[len] = '\n';
+    *copy_length = len + 1;
+    return 0;
+}
+
+
+// Helper function to send one request and return its future, or NULL
+static struct aesd_future *aesd_request(struct aesd_client *client, enum aesd_reply_kind kind,
+                                        const char *line, size_t len,
+                                        aesd_write_callback callback, void *arg) {
+    char *copy;
+    size_t copy_length;
+    struct aesd_future *future;
+
+    if (aesd_line(line, len, &copy, &copy_length) < 0) {
+        return NULL;
+    }
+    future = calloc(1, sizeof(struct aesd_future));
+    if (!future) {
+        free(copy);
+        return NULL;
+    }
+    future->kind = kind;
+    future->callback = callback;
+    future->arg = arg;
+    future->conn = aesd_pick(client);
+
+    // A callback request may already be finished and freed once this returns
+    int rc = aesd_submit(future->conn, &future, 1, copy, copy_length);
+    free(copy);
+    if (rc < 0) {
+        free(future);
+        return NULL;
+    }
+    return future;
+}
+
+
+// Helper function to wait for a future, then free it.
+// Returns 0, -1 for an error reply, or AESD_STATUS_DISCONNECTED.
+static int aesd_wait(struct aesd_future *future, uint64_t *offset, char **data, size_t *len) {
+    struct aesd_conn *conn = future->conn;
+
+    pthread_mutex_lock(&conn->lock);
+    while (!future->done) {
+        pthread_cond_wait(&conn->cond, &conn->lock);
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    int status = future->status;
+    if (status == 0 && offset) {
+        *offset = future->offset;
+    }
+    if (status == 0 && data) {
+        *data = future->data;
+        *len = future->data_length;
+    }
+    else {
+        free(future->data);
+    }
+    free(future);
+    return status;
+}
+
+
+struct aesd_client *aesd_client_open(const char *host, int port, int pool_size) {
+    if (pool_size < 1 || pool_size > AESD_CLIENT_MAX_POOL || strlen(host) >= sizeof(((struct aesd_client *)0)->host)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct aesd_client *client = calloc(1, sizeof(struct aesd_client) + pool_size * sizeof(struct aesd_conn));
+    if (!client) {
+        return NULL;
+    }
+    strcpy(client->host, host);
+    snprintf(client->port, sizeof(client->port), "%d", port);
+    client->pool_size = pool_size;
+    for (int i = 0; i < pool_size; i++) {
+        struct aesd_conn *conn = &client->conns[i];
+        conn->client = client;
+        conn->fd = -1;
+        pthread_mutex_init(&conn->send_lock, NULL);
+        pthread_mutex_init(&conn->lock, NULL);
+        pthread_cond_init(&conn->cond, NULL);
+    }
+    return client;
+}
+
+
+void aesd_client_set_compression(struct aesd_client *client, bool enable) {
+    client->compress = enable;
+}
+
+
+void aesd_client_close(struct aesd_client *client) {
+    if (!client) {
+        return;
+    }
+    for (int i = 0; i < client->pool_size; i++) {
+        struct aesd_conn *conn = &client->conns[i];
+        pthread_mutex_lock(&conn->send_lock);
+        pthread_mutex_lock(&conn->lock);
+        if (conn->fd != -1) {
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&conn->lock);
+        if (conn->reader_started) {
+            pthread_join(conn->reader, NULL);
+        }
+        if (conn->fd != -1) {
+            close(conn->fd);
+        }
+        pthread_mutex_unlock(&conn->send_lock);
+        pthread_mutex_destroy(&conn->send_lock);
+        pthread_mutex_destroy(&conn->lock);
+        pthread_cond_destroy(&conn->cond);
+    }
+    free(client);
+}
+
+
+struct aesd_future *aesd_write_async(struct aesd_client *client, const char *line, size_t len) {
+    return aesd_request(client, AESD_REPLY_OFFSET, line, len, NULL, NULL);
+}
+
+
+int aesd_future_wait(struct aesd_future *future, uint64_t *offset) {
+    if (!future) {
+        return -1;
+    }
+    return aesd_wait(future, offset, NULL, NULL) < 0 ? -1 : 0;
+}
+
+
+int aesd_write_cb(struct aesd_client *client, const char *line, size_t len,
+                  aesd_write_callback callback, void *arg) {
+    return aesd_request(client, AESD_REPLY_OFFSET, line, len, callback, arg) ? 0 : -1;
+}
+
+
+int aesd_write(struct aesd_client *client, const char *line, size_t len, uint64_t *offset) {
+    return aesd_future_wait(aesd_write_async(client, line, len), offset);
+}
+
+
+int aesd_write_batch(struct aesd_client *client, const char *const *lines, const size_t *lengths,
+                     size_t count, uint64_t *offset) {
+    struct aesd_future **futures;
+    char *batch = NULL;
+    size_t batch_length = 0, capacity = 0;
+    int status = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+    futures = calloc(count, sizeof(struct aesd_future *));
+    if (!futures) {
+        return -1;
+    }
+
+    // Pack every line into one buffer so the whole batch goes out in one send
+    for (size_t i = 0; i < count; i++) {
+        char *copy;
+        size_t copy_length;
+        if (aesd_line(lines[i], lengths[i], &copy, &copy_length) < 0) {
+            status = -1;
+            break;
+        }
+        if (batch_length + copy_length > capacity) {
+            size_t new_capacity = capacity ? capacity : AESD_CLIENT_READ_SIZE;
+            while (new_capacity < batch_length + copy_length) {
+                new_capacity *= 2;
+            }
+            char *bigger_batch = realloc(batch, new_capacity);
+            if (!bigger_batch) {
+                free(copy);
+                status = -1;
+                break;
+            }
+            batch = bigger_batch;
+            capacity = new_capacity;
+        }
+        memcpy(batch + batch_length, copy, copy_length);
+        batch_length += copy_length;
+        free(copy);
+
+        futures[i] = calloc(1, sizeof(struct aesd_future));
+        if (!futures[i]) {
+            status = -1;
+            break;
+        }
+        futures[i]->kind = AESD_REPLY_OFFSET;
+    }
+
+    // The whole batch rides on one connection so its lines commit in order
+    struct aesd_conn *conn = aesd_pick(client);
+    for (size_t i = 0; i < count && status == 0; i++) {
+        futures[i]->conn = conn;
+    }
+    if (status == 0 && aesd_submit(conn, futures, count, batch, batch_length) < 0) {
+        status = -1;
+    }
+    if (status < 0) {
+        for (size_t i = 0; i < count; i++) {
+            free(futures[i]);
+        }
+    }
+    else {
+        for (size_t i = 0; i < count; i++) {
+            if (aesd_wait(futures[i], offset, NULL, NULL) < 0) {
+                status = -1;
+            }
+        }
+    }
+    free(batch);
+    free(futures);
+    return status;
+}
+
+
+// Helper function for the DATA requests, which are safe to retry once after a reconnect
+static int aesd_read_command(struct aesd_client *client, const char *command, char **data, size_t *len) {
+    int status = AESD_STATUS_DISCONNECTED;
+    for (int attempt = 0; attempt < 2 && status == AESD_STATUS_DISCONNECTED; attempt++) {
+        struct aesd_future *future = aesd_request(client, AESD_REPLY_DATA, command, strlen(command), NULL, NULL);
+        status = future ? aesd_wait(future, NULL, data, len) : AESD_STATUS_DISCONNECTED;
+    }
+    return status < 0 ? -1 : 0;
+}
+
+
+int aesd_read(struct aesd_client *client, char **data, size_t *len) {
+    return aesd_read_command(client, "AESDSOCKET_READ\n", data, len);
+}
+
+
+int aesd_read_from(struct aesd_client *client, uint32_t write_cmd, uint32_t write_cmd_offset,
+                   char **data, size_t *len) {
+    char command[64];
+    snprintf(command, sizeof(command), "AESDCHAR_IOCSEEKTO:%u,%u\n", write_cmd, write_cmd_offset);
+    return aesd_read_command(client, command, data, len);
+}
+
+
+int aesd_tail(struct aesd_client *client, aesd_tail_callback callback, void *arg) {
+    char buf[AESD_CLIENT_READ_SIZE];
+    char line[128];
+    // Stream offset of the next byte to deliver, the server starts from its oldest byte after 0
+    uint64_t position = 0;
+
+    while (1) {
+        int fd = aesd_connect(client);
+        if (fd < 0) {
+            return -1;
+        }
+        int length = snprintf(line, sizeof(line), "AESDSOCKET_TAIL:%" PRIu64 "\n", position);
+        if (aesd_send_all(fd, line, length) < 0 || aesd_read_line(fd, line, sizeof(line)) < 0) {
+            close(fd);
+            aesd_sleep_ms(AESD_CLIENT_RETRY_MS);
+            continue;
+        }
+
+        // The server skips what we already have, or tells us where it had to start instead
+        // when bytes past position were evicted, or come from a store that started over
+        if (sscanf(line, "OK TAIL %" SCNu64, &position) != 1) {
+            close(fd);
+            return -1;
+        }
+
+        ssize_t rc;
+        while ((rc = recv(fd, buf, sizeof(buf), 0)) > 0 || (rc < 0 && errno == EINTR)) {
+            if (rc < 0) {
+                continue;
+            }
+            position += rc;
+            if (callback(arg, buf, rc)) {
+                close(fd);
+                return 0;
+            }
+        }
+        close(fd);
+        aesd_sleep_ms(AESD_CLIENT_RETRY_MS);
+    }
+}
@@ -0,0 +1,81 @@
+// libaesdclient: client library for aesdsocket
+// Author: Eric Percin, 10/18/2026
+//
+// Keeps a pool of pipelined connections (see PIPELINE_COMMAND in aesdsocket.h) so
+// producers don't pay a connect per line. Writes can be submitted without waiting,
+// each one resolving a future or calling a callback with the offset of the end of the
+// line in the server's commit stream. Replies on a connection arrive in the order the
+// requests were sent. A connection that drops is reconnected on its next use; requests
+// that were in flight on it fail with -1, since the server may or may not have
+// committed them.
+//
+// Every line must end with exactly one newline, which is added if missing.
+// The functions are safe to call from several threads at once. Callbacks run on the
+// connection's reader thread and must not block on the same client.
+
+#ifndef AESDCLIENT_H
+#define AESDCLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define AESD_CLIENT_DEFAULT_PORT 9000
+#define AESD_CLIENT_MAX_POOL 64
+#define AESD_CLIENT_CONNECT_ATTEMPTS 3
+#define AESD_CLIENT_RETRY_MS 100
+
+struct aesd_client;
+struct aesd_future;
+
+// Called once per write with status 0 and the commit offset, or -1 on failure
+typedef void (*aesd_write_callback)(void *arg, int status, uint64_t offset);
+
+// Called with each piece of a tail stream, return nonzero to stop tailing
+typedef int (*aesd_tail_callback)(void *arg, const char *data, size_t len);
+
+// Create a client for host:port with pool_size connections, opened lazily.
+// Returns NULL on failure.
+struct aesd_client *aesd_client_open(const char *host, int port, int pool_size);
+
+// Ask for reads to be sent LZ4 compressed (see compress.h), decoded transparently.
+// Call before the first request, it only applies to connections opened afterwards.
+void aesd_client_set_compression(struct aesd_client *client, bool enable);
+
+// Close all connections, failing anything still in flight, and free the client
+void aesd_client_close(struct aesd_client *client);
+
+// Submit a write without waiting for it. Returns NULL if it couldn't be sent.
+struct aesd_future *aesd_write_async(struct aesd_client *client, const char *line, size_t len);
+
+// Wait for a write and free the future. Returns 0 with *offset set (if not NULL) or -1.
+int aesd_future_wait(struct aesd_future *future, uint64_t *offset);
+
+// Submit a write that calls callback when done. Returns 0 if it was sent, -1 if not
+// (in which case callback is not called).
+int aesd_write_cb(struct aesd_client *client, const char *line, size_t len,
+                  aesd_write_callback callback, void *arg);
+
+// Write one line and wait for it. Returns 0 with *offset set (if not NULL) or -1.
+int aesd_write(struct aesd_client *client, const char *line, size_t len, uint64_t *offset);
+
+// Write count lines in a single send on one connection and wait for all of them.
+// Returns 0 with *offset set to the end of the last line (if not NULL), or -1 if any failed.
+int aesd_write_batch(struct aesd_client *client, const char *const *lines, const size_t *lengths,
+                     size_t count, uint64_t *offset);
+
+// Read the whole store into a malloc'd buffer. Returns 0 or -1.
+int aesd_read(struct aesd_client *client, char **data, size_t *len);
+
+// Read the store from byte write_cmd_offset of write command write_cmd, like
+// AESDCHAR_IOCSEEKTO. Only supported by servers using the char device. Returns 0 or -1.
+int aesd_read_from(struct aesd_client *client, uint32_t write_cmd, uint32_t write_cmd_offset,
+                   char **data, size_t *len);
+
+// Stream the store and then new commits to callback on a dedicated connection until
+// callback returns nonzero. After a disconnect the stream is resumed from the stream offset
+// it left off at. Bytes the server no longer holds by then are skipped over.
+// Returns 0 when stopped by callback, -1 if the server can't be reached or refuses to tail.
+int aesd_tail(struct aesd_client *client, aesd_tail_callback callback, void *arg);
+
+#endif // AESDCLIENT_H
@@ -20,37 +20,57 @@
 #include <stdlib.h>
 #include <time.h>
 #include <signal.h>
+#include <getopt.h>
+#include <poll.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/stat.h>
 #include "../aesd-char-driver/aesd_ioctl.h"
+#include "aesdsocket.h"
+#include "handoff.h"
+#include "activation.h"
+#include "prefork.h"
+#include "stats.h"
+#include "replication.h"
+#include "search.h"
+#include "ratelimit.h"
+#include "timerwheel.h"
+#include "commit.h"
+#include "readcache.h"
+#include "compress.h"
+#include "placement.h"
 
 
 
-#ifdef USE_AESD_CHAR_DEVICE
-    #define DATA_FILE_PATH "/dev/aesdchar"
-#else
-    #define DATA_FILE_PATH "/var/tmp/aesdsocketdata"
-#endif
-
-#define INITIAL_BUFFER_SIZE 512
-
-//#define DEBUG
-#ifdef DEBUG
-    #define DEBUG_PRINT(...) printf(__VA_ARGS__)
-#else
-    #define DEBUG_PRINT(...) 
-#endif
-
-
 // Global variables to be closed in singal handler
 int g_my_socket = -1;
 int g_my_file_write = -1;
+int g_handoff_socket = -1;
+const char *g_pidfile_path = NULL;
+const char *g_data_file_path = DATA_FILE_PATH;
+int g_port = 9000;
+char g_handoff_path[108] = HANDOFF_SOCKET_PATH;
 volatile int g_exit_flag = 0;
-pthread_mutex_t g_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+bool g_handed_off = false;
+// Set once the listener was handed to a new instance. Pipelined and tail connections
+// close between requests so their clients reconnect to it, and this instance can exit
+volatile int g_draining = 0;
+pthread_mutex_t g_local_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t *g_write_mutex = &g_local_write_mutex;   // points into shared memory in prefork mode
 timer_t g_timer;
+bool g_timer_created = false;
+bool g_is_worker = false;
+// Set in the prefork master, which shares the listener with its workers but never accepts on it
+bool g_is_master = false;
+// Set when the listener came from systemd or a parent process, which still hold it
+bool g_listener_inherited = false;
 
 // Structure for an entry within the singly linked thread list
 struct thread_entry {
     pthread_t thread_id;
     int my_client;
+    uint32_t client_ip;     // network byte order, for the client's rate limits
+    struct conn_timer timer;
     bool is_done;
     SLIST_ENTRY(thread_entry) next_slist_entry; 
     
@@ -64,39 +84,512 @@ void cleanup() {
     if (g_my_file_write != -1) {
         close(g_my_file_write);
     }
+    // Only closed, an inherited listener keeps listening for whoever passed it to us
+    if (g_my_socket != -1) {
+        int my_socket = g_my_socket;
+        g_my_socket = -1;
+        close(my_socket);
+    }
+    if (g_handoff_socket != -1) {
+        close(g_handoff_socket);
+        // After a handoff the path belongs to the instance that replaced us
+        if (!g_handed_off) {
+            unlink(g_handoff_path);
+        }
+    }
+    // After a handoff the pidfile holds the new instance's pid
+    if (g_pidfile_path && !g_handed_off) {
+        unlink(g_pidfile_path);
+    }
 #ifndef USE_AESD_CHAR_DEVICE
-    remove(DATA_FILE_PATH);
+    // The data file lives on in the instance we handed off to
+    if (!g_handed_off) {
+        remove(g_data_file_path);
+    }
 #endif
-    timer_delete(g_timer);
-    pthread_mutex_destroy(&g_write_mutex);
+    if (g_timer_created) {
+        timer_delete(g_timer);
+    }
+    pthread_mutex_destroy(&g_local_write_mutex);
+    closelog();
+}
+
+
+// Helper function for prefork workers, which share everything above with the master
+void worker_cleanup() {
+    if (g_my_file_write != -1) {
+        close(g_my_file_write);
+    }
     closelog();
 }
 
 
 // Signal handlerer for sigint, sigterm
 void signal_handler(int signo) {
-    if (g_my_socket != -1) {
+    (void)signo;
+    // Prefork workers and their master share one listener, shutting it down would stop it for every process.
+    // So does whoever passed us an inherited listener. All of them see g_exit_flag within a poll() timeout instead
+    if (g_my_socket != -1 && !g_is_worker && !g_is_master && !g_listener_inherited) {
         shutdown(g_my_socket, SHUT_RDWR); 
     }
     g_exit_flag = 1;
 }
 
 
+// Signal handler for sigusr2, sent to prefork workers after the listener was handed off.
+// The listener now belongs to the new instance too, so it must not be shut down.
+void drain_handler(int signo) {
+    (void)signo;
+    g_handed_off = true;
+    g_draining = 1;
+    g_exit_flag = 1;
+}
+
+
+// Helper functions for the write lock, which may be shared with other processes
+void write_lock(void) {
+    // A prefork worker died holding the lock, the log itself is still consistent
+    if (pthread_mutex_lock(g_write_mutex) == EOWNERDEAD) {
+        pthread_mutex_consistent(g_write_mutex);
+    }
+}
+
+void write_unlock(void) {
+    pthread_mutex_unlock(g_write_mutex);
+}
+
+
+// Helper function to read the whole store into a malloc'd buffer. Returns 0 or -1.
+int store_read(char **buf, size_t *len) {
+    uint64_t offset;
+
+    if (g_shared_log && !USING_AESD_CHAR_DEVICE && shared_log_current(g_shared_log)) {
+        size_t used = __atomic_load_n(&g_shared_log->used, __ATOMIC_ACQUIRE);
+        *buf = malloc(used ? used : 1);
+        if (!*buf) {
+            perror("Call to malloc() failed");
+            return -1;
+        }
+        memcpy(*buf, g_shared_log->data, used);
+        *len = used;
+        return 0;
+    }
+    return repl_snapshot(buf, len, &offset);
+}
+
+
+// Helper function to run a search command and send the matching lines to the client
+int handle_search(int my_client, const char *command, size_t command_length) {
+    struct search_query query;
+    char *reply = NULL;
+    size_t reply_length = 0;
+    int rc;
+
+    if (search_parse(command, command_length, &query) < 0) {
+        const char *error_reply = "ERROR: expected AESDSOCKET_SEARCH:<flags>:<pattern>\n";
+        send(my_client, error_reply, strlen(error_reply), MSG_NOSIGNAL);
+        return -1;
+    }
+
+    if (search_index_query(&query, &reply, &reply_length) == 0) {
+        rc = 0;
+    }
+    else if (g_shared_log && !USING_AESD_CHAR_DEVICE && shared_log_current(g_shared_log)) {
+        // Committed bytes of the shared log never change, scan them in place
+        size_t used = __atomic_load_n(&g_shared_log->used, __ATOMIC_ACQUIRE);
+        rc = search_store(g_shared_log->data, used, &query, &reply, &reply_length);
+    }
+    else {
+        // In file mode the write lock isn't held for the read, so commits go on during a long scan
+        char *store;
+        size_t store_length;
+        rc = store_read(&store, &store_length);
+        if (rc == 0) {
+            rc = search_store(store, store_length, &query, &reply, &reply_length);
+            free(store);
+        }
+    }
+
+    if (rc < 0) {
+        const char *error_reply = "ERROR: search failed\n";
+        send(my_client, error_reply, strlen(error_reply), MSG_NOSIGNAL);
+        return -1;
+    }
+
+    ssize_t sent = ratelimit_send(my_client, reply, reply_length);
+    free(reply);
+    if (sent < 0) {
+        return -1;
+    }
+    STATS_ADD(bytes_sent, sent);
+    return 0;
+}
+
+
+// Helper function to change the rate limits, only allowed from the local machine
+int handle_limit(int my_client, const char *command, size_t command_length) {
+    struct sockaddr_in peer_addr;
+    socklen_t peer_addr_len = sizeof(peer_addr);
+    struct ratelimit_config config;
+    char reply[256];
+
+    if (getpeername(my_client, (struct sockaddr *)&peer_addr, &peer_addr_len) < 0 ||
+            peer_addr.sin_family != AF_INET || (ntohl(peer_addr.sin_addr.s_addr) >> 24) != 127) {
+        const char *error_reply = "ERROR: limits can only be changed from localhost\n";
+        send(my_client, error_reply, strlen(error_reply), MSG_NOSIGNAL);
+        return -1;
+    }
+
+    if (ratelimit_parse(command, command_length, &config) < 0) {
+        const char *error_reply = "ERROR: expected AESDSOCKET_LIMIT:ingest=N,reply=N,burst=N,quantum=N\n";
+        send(my_client, error_reply, strlen(error_reply), MSG_NOSIGNAL);
+        return -1;
+    }
+    ratelimit_configure(&config);
+    ratelimit_get_config(&config);
+    syslog(LOG_INFO, "Rate limits changed: ingest %llu reply %llu burst %llu quantum %llu",
+           (unsigned long long)config.ingest_rate, (unsigned long long)config.reply_rate,
+           (unsigned long long)config.burst, (unsigned long long)config.quantum);
+
+    int reply_length = snprintf(reply, sizeof(reply), "ingest=%llu,reply=%llu,burst=%llu,quantum=%llu\n",
+                                (unsigned long long)config.ingest_rate, (unsigned long long)config.reply_rate,
+                                (unsigned long long)config.burst, (unsigned long long)config.quantum);
+    if (send(my_client, reply, reply_length, MSG_NOSIGNAL) < 0) {
+        perror("Call to send() failed");
+        return -1;
+    }
+    STATS_ADD(bytes_sent, reply_length);
+    return 0;
+}
+
+
+// Helper function to commit one line to the store in this client's fair turn.
+// On success *offset is the end of the line in the commit stream. Returns 0 or -1.
+int store_commit(int my_file_write, const char *buf, size_t len, uint64_t *offset) {
+    int rc = 0;
+
+    // The commit thread batches lines in arrival order, which replaces the fair turn:
+    // waiting for a turn would only ever leave one line in its queue
+    if (commit_running()) {
+        return commit_submit(buf, len, offset);
+    }
+
+    // Wait for this client's turn so a busy client can't hog the lock
+    fair_acquire(len);
+    write_lock();
+
+    if (write(my_file_write, buf, len) != (ssize_t)len) {
+        perror("Call to write() failed");
+        rc = -1;
+    }
+    // Into the shared log as well in prefork file mode, which replies come from
+    else if (g_shared_log && !USING_AESD_CHAR_DEVICE) {
+        *offset = shared_log_mirror(g_shared_log, buf, len);
+    }
+    else {
+        // Still under the lock so the replication stream and index have the store's order
+        repl_commit(buf, len);
+        search_index_append(buf, len);
+        *offset = repl_commit_offset();
+    }
+
+    write_unlock();
+    fair_release();
+    return rc;
+}
+
+
+// Helper function to send a pipelined "DATA <length>\n" reply followed by its bytes
+int send_data_frame(int my_client, const char *buf, size_t len) {
+    char header[64];
+    int header_length = snprintf(header, sizeof(header), "DATA %zu\n", len);
+
+    if (send(my_client, header, header_length, MSG_NOSIGNAL) < 0) {
+        perror("Call to send() failed");
+        return -1;
+    }
+    if (ratelimit_send(my_client, buf, len) < 0) {
+        return -1;
+    }
+    STATS_ADD(bytes_sent, header_length + len);
+    return 0;
+}
+
+
+// Helper function to send the whole store to a client, compressed or not.
+// Returns the bytes sent or -1.
+ssize_t send_store(int my_client, bool compressed) {
+    ssize_t bytes_sent;
+
+    // In prefork file mode the shared log mirrors the store, while it has room
+    if (g_shared_log && !USING_AESD_CHAR_DEVICE && shared_log_current(g_shared_log)) {
+        size_t used = __atomic_load_n(&g_shared_log->used, __ATOMIC_ACQUIRE);
+        bytes_sent = compressed ? compress_send_buffer(my_client, g_shared_log->data, used, 0, true)
+                                : shared_log_send(g_shared_log, my_client);
+    }
+    else {
+        // Positional reads on the shared descriptor, no open/close per reply
+        struct readcache_entry *reader = readcache_acquire();
+        if (!reader) {
+            return -1;
+        }
+
+        if (compressed) {
+            bytes_sent = compress_send_fd(my_client, reader->fd, reader->dev, reader->ino, !USING_AESD_CHAR_DEVICE);
+        }
+        else {
+            char reader_buf[READCACHE_CHUNK];
+            ssize_t reader_bytes_read;
+            off_t reader_offset = 0;
+            bytes_sent = 0;
+            while ((reader_bytes_read = pread(reader->fd, reader_buf, sizeof(reader_buf), reader_offset)) > 0) {
+                if (ratelimit_send(my_client, reader_buf, reader_bytes_read) < 0) {
+                    break;
+                }
+                reader_offset += reader_bytes_read;
+                bytes_sent += reader_bytes_read;
+            }
+            if (reader_bytes_read < 0) {
+                perror("Call to read() failed");
+                bytes_sent = -1;
+            }
+        }
+        readcache_release(reader);
+    }
+
+    if (bytes_sent > 0) {
+        STATS_ADD(bytes_sent, bytes_sent);
+    }
+    return bytes_sent;
+}
+
+
+// Helper function to read everything from write command write_cmd, offset write_cmd_offset,
+// into a malloc'd buffer. One AESDCHAR_IOCREADAT where the driver has it, which also leaves the
+// position of the shared descriptor alone, else a seek followed by reads to the end.
+// Returns 0, or -1 if the seek was invalid or reading failed.
+int device_read_from(int fd, uint32_t write_cmd, uint32_t write_cmd_offset, char **buf, size_t *len) {
+    struct aesd_stats_info info;
+    struct aesd_seekto seekto;
+    char *data = NULL;
+    size_t data_length = 0;
+    size_t capacity;
+    ssize_t bytes_read = 0;
+
+    if (ioctl(fd, AESDCHAR_IOCSTATS, &info) == 0) {
+        struct aesd_read_at read_at;
+        // Sized for what the device holds now, larger and again if writes land in between
+        capacity = info.total_size + 1;
+        for (;;) {
+            char *bigger_data = realloc(data, capacity);
+            if (!bigger_data) {
+                perror("Call to realloc() failed");
+                free(data);
+                return -1;
+            }
+            data = bigger_data;
+            memset(&read_at, 0, sizeof(read_at));
+            read_at.write_cmd = write_cmd;
+            read_at.write_cmd_offset = write_cmd_offset;
+            read_at.buf = (uintptr_t)data;
+            read_at.len = capacity;
+            if (ioctl(fd, AESDCHAR_IOCREADAT, &read_at) < 0) {
+                free(data);
+                return -1;
+            }
+            if (read_at.copied < capacity) {
+                break;
+            }
+            capacity *= 2;
+        }
+        *buf = data;
+        *len = read_at.copied;
+        return 0;
+    }
+
+    seekto.write_cmd = write_cmd;
+    seekto.write_cmd_offset = write_cmd_offset;
+    if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) < 0) {
+        return -1;
+    }
+    capacity = INITIAL_BUFFER_SIZE;
+    data = malloc(capacity);
+    while (data) {
+        if (data_length == capacity) {
+            char *bigger_data = realloc(data, capacity * 2);
+            if (!bigger_data) {
+                break;
+            }
+            data = bigger_data;
+            capacity *= 2;
+        }
+        bytes_read = read(fd, data + data_length, capacity - data_length);
+        if (bytes_read <= 0) {
+            break;
+        }
+        data_length += bytes_read;
+    }
+    if (!data || bytes_read != 0) {
+        perror("Call to read() failed after seek");
+        free(data);
+        return -1;
+    }
+    *buf = data;
+    *len = data_length;
+    return 0;
+}
+
+
+// Helper function for the stream offset of the end of the store at startup. Counting every byte
+// the store ever held keeps offsets the same across a handoff, and for the char device, which
+// may have evicted some, matches its own stream offsets
+uint64_t store_stream_end(void) {
+#ifdef USE_AESD_CHAR_DEVICE
+    struct aesd_stats_info info;
+    int fd = open(g_data_file_path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    int rc = ioctl(fd, AESDCHAR_IOCSTATS, &info);
+    close(fd);
+    return rc == 0 ? info.bytes_written : 0;
+#else
+    struct stat store_stat;
+    return stat(g_data_file_path, &store_stat) == 0 ? (uint64_t)store_stat.st_size : 0;
+#endif
+}
+
+
+// Helper function to answer one line of a pipelined connection.
+// Returns 0, or -1 if the connection should be dropped.
+int handle_pipelined_line(int my_client, int my_file_write, const char *line, size_t len, bool *compressed) {
+    const char *seek_prefix = "AESDCHAR_IOCSEEKTO:";
+    char reply[128];
+    int reply_length;
+    char *data = NULL;
+    size_t data_length = 0;
+
+    STATS_ADD(commands, 1);
+
+    if (len == strlen(COMPRESS_COMMAND) && memcmp(line, COMPRESS_COMMAND, len) == 0) {
+        *compressed = true;
+        reply_length = snprintf(reply, sizeof(reply), "OK COMPRESS\n");
+    }
+    else if (*compressed && len == strlen(PIPELINE_READ_COMMAND) && memcmp(line, PIPELINE_READ_COMMAND, len) == 0) {
+        if (send(my_client, "ZDATA\n", strlen("ZDATA\n"), MSG_NOSIGNAL) < 0 || send_store(my_client, true) < 0) {
+            return -1;
+        }
+        return 0;
+    }
+    else if (len == strlen(PIPELINE_READ_COMMAND) && memcmp(line, PIPELINE_READ_COMMAND, len) == 0) {
+        if (store_read(&data, &data_length) < 0) {
+            reply_length = snprintf(reply, sizeof(reply), "ERROR read failed\n");
+        }
+        else {
+            int rc = send_data_frame(my_client, data, data_length);
+            free(data);
+            return rc;
+        }
+    }
+    else if (len == strlen(PIPELINE_STATS_COMMAND) && memcmp(line, PIPELINE_STATS_COMMAND, len) == 0) {
+        char stats_buffer[4096];
+        size_t stats_length = stats_format(stats_buffer, sizeof(stats_buffer));
+        stats_length += repl_format_stats(stats_buffer + stats_length, sizeof(stats_buffer) - stats_length);
+        stats_length += placement_format(stats_buffer + stats_length, sizeof(stats_buffer) - stats_length);
+        return send_data_frame(my_client, stats_buffer, stats_length);
+    }
+    else if (strncmp(line, seek_prefix, strlen(seek_prefix)) == 0) {
+        struct aesd_seekto seekto;
+        if (sscanf(line + strlen(seek_prefix), "%u,%u", &seekto.write_cmd, &seekto.write_cmd_offset) != 2) {
+            reply_length = snprintf(reply, sizeof(reply), "ERROR expected AESDCHAR_IOCSEEKTO:X,Y\n");
+        }
+        else if (my_file_write == -1 ||
+                 device_read_from(my_file_write, seekto.write_cmd, seekto.write_cmd_offset, &data, &data_length) < 0) {
+            reply_length = snprintf(reply, sizeof(reply), "ERROR seek failed\n");
+        }
+        else {
+            int rc = send_data_frame(my_client, data, data_length);
+            free(data);
+            return rc;
+        }
+    }
+    // Streams and multi-line replies need a connection of their own
+    else if (strncmp(line, "AESDSOCKET_TAIL", strlen("AESDSOCKET_TAIL")) == 0 ||
+             strncmp(line, SEARCH_PREFIX, strlen(SEARCH_PREFIX)) == 0 ||
+             strncmp(line, RATELIMIT_PREFIX, strlen(RATELIMIT_PREFIX)) == 0) {
+        reply_length = snprintf(reply, sizeof(reply), "ERROR not available on a pipelined connection\n");
+    }
+    else if (g_repl_role == REPL_FOLLOWER) {
+        reply_length = snprintf(reply, sizeof(reply), "ERROR read-only replica\n");
+    }
+    else {
+        uint64_t offset;
+        if (store_commit(my_file_write, line, len, &offset) < 0) {
+            reply_length = snprintf(reply, sizeof(reply), "ERROR write failed\n");
+        }
+        else {
+            reply_length = snprintf(reply, sizeof(reply), "OK %llu\n", (unsigned long long)offset);
+        }
+    }
+
+    if (strncmp(reply, "ERROR", strlen("ERROR")) == 0) {
+        STATS_ADD(errors, 1);
+    }
+    if (send(my_client, reply, reply_length, MSG_NOSIGNAL) < 0) {
+        perror("Call to send() failed");
+        return -1;
+    }
+    STATS_ADD(bytes_sent, reply_length);
+    return 0;
+}
+
+
+// Helper function to answer every complete line in buffer and keep the incomplete rest.
+// Returns 0, or -1 if the connection should be dropped.
+int handle_pipelined(int my_client, int my_file_write, char *buffer, size_t *length, bool *compressed) {
+    char *start = buffer;
+    char *newline;
+
+    while ((newline = memchr(start, '\n', buffer + *length - start)) != NULL) {
+        if (handle_pipelined_line(my_client, my_file_write, start, newline + 1 - start, compressed) < 0) {
+            return -1;
+        }
+        start = newline + 1;
+    }
+    *length -= start - buffer;
+    memmove(buffer, start, *length);
+    return 0;
+}
+
+
 // Helper function to read data from client, write it to a file, then send entire file contents back to client
-void handle_connection(int my_client, int g_my_file_write) {
+void handle_connection(int my_client, int g_my_file_write, struct conn_timer *timer) {
     char *packet_buffer = NULL, *bigger_packet_buffer = NULL;
-    size_t packet_length = 0;
-    int my_file_read = -1;
+    size_t packet_length = 0, packet_capacity = 0;
     const char *seek_prefix = "AESDCHAR_IOCSEEKTO:";
+    const char *stats_command = "AESDSOCKET_STATS\n";
+    const char *read_command = "AESDSOCKET_READ\n";
+    const char *tail_command = "AESDSOCKET_TAIL\n";
+    const char *tail_resume_prefix = "AESDSOCKET_TAIL:";
+    const char *read_only_reply = "ERROR: read-only replica\n";
+    bool opened_file_write = false;
+    bool pipelined = false;
+    bool compressed = false;
 
     if (g_my_file_write == -1) {
-        g_my_file_write = open(DATA_FILE_PATH, O_RDWR | O_CREAT, 0666);
+        // O_APPEND so every connection adds to the end of the file instead of writing at offset 0
+        g_my_file_write = open(g_data_file_path, O_RDWR | O_CREAT | O_APPEND, 0666);
+        opened_file_write = true;
         if (g_my_file_write < 0) {
             perror("Call to open() failed");
             return;
         }
     }
 
+    // Wake up now and then so an idle (e.g. pipelined) connection doesn't hold up shutdown
+    struct timeval receive_timeout = { .tv_sec = 1, .tv_usec = 0 };
+    setsockopt(my_client, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout));
+
     while (!g_exit_flag) {
         if (packet_buffer == NULL) {
             packet_buffer = malloc(INITIAL_BUFFER_SIZE);
@@ -104,50 +597,185 @@ void handle_connection(int my_client, int g_my_file_write) {
                 perror("Call to malloc() failed");
                 break;
             }
+            packet_capacity = INITIAL_BUFFER_SIZE;
+        }
+
+        // No room left for the rest of the line--extend the buffer to continue
+        if (packet_length == packet_capacity) {
+            bigger_packet_buffer = realloc(packet_buffer, packet_capacity * 2);
+            if (!bigger_packet_buffer) {
+                perror("Call to realloc() failed");
+                break;
+            }
+            packet_buffer = bigger_packet_buffer;
+            packet_capacity *= 2;
         }
 
         DEBUG_PRINT("Starting with client %d\n",my_client);
 
-        ssize_t bytes_received = recv(my_client, packet_buffer + packet_length, INITIAL_BUFFER_SIZE, 0);
-        if (bytes_received <= 0) {
-            perror("Call to recv() failed");
-            break;
+        // A line left over after a negotiation line is handled before reading more
+        if (!memchr(packet_buffer, '\n', packet_length)) {
+            // Only ask for what fits in the buffer, it grows above when full
+            ssize_t bytes_received = recv(my_client, packet_buffer + packet_length, packet_capacity - packet_length, 0);
+            if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                // Nothing is half sent, the client sees the close and reconnects to the new instance
+                if (pipelined && g_draining && packet_length == 0) {
+                    break;
+                }
+                continue;
+            }
+            if (bytes_received <= 0) {
+                perror("Call to recv() failed");
+                break;
+            }
+            packet_length += bytes_received;
+            STATS_ADD(bytes_received, bytes_received);
+            ratelimit_ingest(bytes_received);
+        }
+
+        if (pipelined) {
+            if (handle_pipelined(my_client, g_my_file_write, packet_buffer, &packet_length, &compressed) < 0) {
+                break;
+            }
+            if (g_draining && packet_length == 0) {
+                break;
+            }
+            conn_timer_activity(timer, packet_length > 0);
+            continue;
         }
-        packet_length += bytes_received;
 
         char *newline = memchr(packet_buffer, '\n', packet_length);
+        conn_timer_activity(timer, newline == NULL);
         if (newline) {
-        
-        
+            // Send full-store replies compressed from now on
+            if (newline + 1 - packet_buffer == (ssize_t)strlen(COMPRESS_COMMAND) &&
+                    memcmp(packet_buffer, COMPRESS_COMMAND, strlen(COMPRESS_COMMAND)) == 0) {
+                const char *compress_reply = "OK COMPRESS\n";
+                compressed = true;
+                if (send(my_client, compress_reply, strlen(compress_reply), MSG_NOSIGNAL) < 0) {
+                    perror("Call to send() failed");
+                    break;
+                }
+                packet_length -= strlen(COMPRESS_COMMAND);
+                memmove(packet_buffer, packet_buffer + strlen(COMPRESS_COMMAND), packet_length);
+                continue;
+            }
+
+            // Keep the connection open and answer each line with a short framed reply from now on
+            if (newline + 1 - packet_buffer == (ssize_t)strlen(PIPELINE_COMMAND) &&
+                    memcmp(packet_buffer, PIPELINE_COMMAND, strlen(PIPELINE_COMMAND)) == 0) {
+                const char *pipeline_reply = "OK PIPELINE\n";
+                pipelined = true;
+                if (send(my_client, pipeline_reply, strlen(pipeline_reply), MSG_NOSIGNAL) < 0) {
+                    perror("Call to send() failed");
+                    break;
+                }
+                packet_length -= strlen(PIPELINE_COMMAND);
+                memmove(packet_buffer, packet_buffer + strlen(PIPELINE_COMMAND), packet_length);
+                if (handle_pipelined(my_client, g_my_file_write, packet_buffer, &packet_length, &compressed) < 0) {
+                    break;
+                }
+                conn_timer_activity(timer, packet_length > 0);
+                continue;
+            }
+
+            STATS_ADD(commands, 1);
+            // Only the lifetime limit applies to sending the reply, tail streams can run for hours
+            conn_timer_replying(timer);
+
+            // Report counters (aggregated across prefork workers) instead of storing the line
+            if (packet_length == strlen(stats_command) && memcmp(packet_buffer, stats_command, packet_length) == 0) {
+                char stats_buffer[4096];
+                size_t stats_length = stats_format(stats_buffer, sizeof(stats_buffer));
+                stats_length += repl_format_stats(stats_buffer + stats_length, sizeof(stats_buffer) - stats_length);
+                stats_length += placement_format(stats_buffer + stats_length, sizeof(stats_buffer) - stats_length);
+                if (send(my_client, stats_buffer, stats_length, MSG_NOSIGNAL) < 0) {
+                    perror("Call to send() failed");
+                    STATS_ADD(errors, 1);
+                }
+                else {
+                    STATS_ADD(bytes_sent, stats_length);
+                }
+                break;
+            }
+
+            // Stream the store and then every new commit until the client hangs up.
+            // The backlog is per process, so prefork workers can't see each other's commits.
+            // AESDSOCKET_TAIL:<offset> resumes a stream from a stream offset, after an "OK TAIL" line
+            bool tail_resume = strncmp(packet_buffer, tail_resume_prefix, strlen(tail_resume_prefix)) == 0;
+            if (tail_resume || (packet_length == strlen(tail_command) && memcmp(packet_buffer, tail_command, packet_length) == 0)) {
+                char tail_line[64];
+                uint64_t tail_from = 0;
+                size_t tail_line_length = newline - packet_buffer;
+                if (tail_resume && tail_line_length < sizeof(tail_line)) {
+                    memcpy(tail_line, packet_buffer, tail_line_length);
+                    tail_line[tail_line_length] = '\0';
+                }
+                if (g_shared_log) {
+                    const char *prefork_reply = "ERROR: tail not available in prefork mode\n";
+                    send(my_client, prefork_reply, strlen(prefork_reply), MSG_NOSIGNAL);
+                    STATS_ADD(errors, 1);
+                }
+                else if (tail_resume && (tail_line_length >= sizeof(tail_line) ||
+                         sscanf(tail_line + strlen(tail_resume_prefix), "%" SCNu64, &tail_from) != 1)) {
+                    const char *error_reply = "ERROR: expected AESDSOCKET_TAIL:<offset>\n";
+                    send(my_client, error_reply, strlen(error_reply), MSG_NOSIGNAL);
+                    STATS_ADD(errors, 1);
+                }
+                else if (repl_tail(my_client, tail_resume, tail_from) < 0) {
+                    STATS_ADD(errors, 1);
+                }
+                break;
+            }
+
+            if (strncmp(packet_buffer, RATELIMIT_PREFIX, strlen(RATELIMIT_PREFIX)) == 0) {
+                if (handle_limit(my_client, packet_buffer + strlen(RATELIMIT_PREFIX),
+                                 packet_length - strlen(RATELIMIT_PREFIX)) < 0) {
+                    STATS_ADD(errors, 1);
+                }
+                break;
+            }
+
+            // Reply with only the matching lines instead of the whole store
+            if (strncmp(packet_buffer, SEARCH_PREFIX, strlen(SEARCH_PREFIX)) == 0) {
+                if (handle_search(my_client, packet_buffer + strlen(SEARCH_PREFIX),
+                                  packet_length - strlen(SEARCH_PREFIX)) < 0) {
+                    STATS_ADD(errors, 1);
+                }
+                break;
+            }
+
+            // Reply with the store without adding to it, the only way to read from a follower
+            bool read_only = packet_length == strlen(read_command) && memcmp(packet_buffer, read_command, packet_length) == 0;
+            if (!read_only && g_repl_role == REPL_FOLLOWER && strncmp(packet_buffer, seek_prefix, strlen(seek_prefix)) != 0) {
+                send(my_client, read_only_reply, strlen(read_only_reply), MSG_NOSIGNAL);
+                STATS_ADD(errors, 1);
+                break;
+            }
+
             // Check if the command starts with the ioctl seek prefix, and handle special processing
             if (strncmp(packet_buffer, seek_prefix, strlen(seek_prefix)) == 0) {
                 unsigned int write_cmd, write_cmd_offset;
                 // Expected format "AESDCHAR_IOCSEEKTO:X,Y\n", X = command index and Y = offset
                 int parse_counter = sscanf(packet_buffer + strlen(seek_prefix), "%u,%u", &write_cmd, &write_cmd_offset);
                 if (parse_counter != 2) {
-                    perror("Issue detected with ioctl parameters");
+                    // The line stays buffered, so carrying on would handle it again forever
+                    const char *error_reply = "ERROR: expected AESDCHAR_IOCSEEKTO:X,Y\n";
+                    send(my_client, error_reply, strlen(error_reply), MSG_NOSIGNAL);
+                    STATS_ADD(errors, 1);
+                    break;
                 }
                 else {
-                    struct aesd_seekto seekto;
-                    seekto.write_cmd = write_cmd;
-                    seekto.write_cmd_offset = write_cmd_offset;                
-                    if (ioctl(g_my_file_write, AESDCHAR_IOCSEEKTO, &seekto) < 0) {
+                    char *reader_data;
+                    size_t reader_length;
+                    if (device_read_from(g_my_file_write, write_cmd, write_cmd_offset, &reader_data, &reader_length) < 0) {
                         perror("Call to ioctl() failed");
                         break;
                     }
-
-                    char reader_buf[INITIAL_BUFFER_SIZE];
-                    ssize_t reader_bytes_read;
-                    while ((reader_bytes_read = read(g_my_file_write, reader_buf, sizeof(reader_buf))) > 0) {
-                        if (send(my_client, reader_buf, reader_bytes_read, 0) < 0) {
-                            perror("Call to send() failed");
-                            break;
-                        }
-                    }
-                    if (reader_bytes_read < 0) {
-                        perror("Call to read() failed");
-                        break;
+                    if (ratelimit_send(my_client, reader_data, reader_length) >= 0) {
+                        STATS_ADD(bytes_sent, reader_length);
                     }
+                    free(reader_data);
                     free(packet_buffer);
                     packet_buffer = NULL;
                     packet_length = 0;
@@ -155,166 +783,481 @@ void handle_connection(int my_client, int g_my_file_write) {
                 }
             }
             
-            // Standard write command
-            else {
-                pthread_mutex_lock(&g_write_mutex); // Lock before the write
-            
-                if (write(g_my_file_write, packet_buffer, packet_length) != (ssize_t)packet_length) {
-                    perror("Call to write() failed");
-                    pthread_mutex_unlock(&g_write_mutex);
+            // Standard write command, mirrored into the shared log in prefork file mode
+            else if (g_shared_log && !USING_AESD_CHAR_DEVICE) {
+                int rc = 0;
+                uint64_t offset;
+                if (!read_only) {
+                    rc = store_commit(g_my_file_write, packet_buffer, packet_length, &offset);
+                }
+                if (rc < 0) {
+                    STATS_ADD(errors, 1);
                     break;
                 }
-                
-                pthread_mutex_unlock(&g_write_mutex); // Unlock after the write
 
-                my_file_read = open(DATA_FILE_PATH, O_RDONLY);
-                if (my_file_read < 0) {
-                    perror("Call to open() failed for reading");
+                if (send_store(my_client, compressed) < 0) {
+                    STATS_ADD(errors, 1);
                     break;
                 }
 
-                char reader_buf[INITIAL_BUFFER_SIZE];
-                ssize_t reader_bytes_read;
-                while ((reader_bytes_read = read(my_file_read, reader_buf, sizeof(reader_buf))) > 0) {
-                    if (send(my_client, reader_buf, reader_bytes_read, 0) < 0) {
-                        perror("Call to send() failed");
-                        close(my_file_read);
-                        my_file_read = -1;
-                        break;
-                    }
+                free(packet_buffer);
+                packet_buffer = NULL;
+                packet_length = 0;
+                break;
+            }
+
+            // Standard write command
+            else {
+                uint64_t offset;
+                if (!read_only && store_commit(g_my_file_write, packet_buffer, packet_length, &offset) < 0) {
+                    break;
                 }
-                
-                close(my_file_read);
-                if (reader_bytes_read < 0) {
-                    perror("Call to read() failed");
+
+                if (send_store(my_client, compressed) < 0) {
                     break;
                 }
 
-                free(packet_buffer);
-                packet_buffer = NULL;
-                packet_length = 0;
-                break;
-            }
-        
-        // No newline--extend the buffer to continue
-        } else {
-            bigger_packet_buffer = realloc(packet_buffer, packet_length * 2);
-            if (!bigger_packet_buffer) {
-                perror("Call to realloc() failed");
-                break;
+                free(packet_buffer);
+                packet_buffer = NULL;
+                packet_length = 0;
+                break;
+            }
+        }
+    }
+    
+    DEBUG_PRINT("Completed with client %d\n",my_client);
+
+    if (packet_buffer) {
+        free(packet_buffer);
+    }
+    if (opened_file_write) {
+        close(g_my_file_write);
+    }
+}
+
+
+// Wrapper function for each thread to run to handle a connection
+void *thread_connection_wrapper(void *arg) {
+    struct thread_entry *my_entry = (struct thread_entry *)arg;
+    ratelimit_set_client(my_entry->client_ip);
+    handle_connection(my_entry->my_client, g_my_file_write, &my_entry->timer);
+    // Off the wheel before the fd is closed, so a late timeout can't hit a reused fd
+    conn_timer_remove(&my_entry->timer);
+    close(my_entry->my_client);
+    my_entry->my_client = -1;
+    my_entry->is_done = true;
+    return NULL;
+}
+
+#ifndef USE_AESD_CHAR_DEVICE
+void insert_timestamp(union sigval value) {
+    (void)value;
+    char timestamp_buffer[128];
+    time_t now = time(NULL);
+    struct tm *tm_now = localtime(&now);
+
+    // RFC 2822 compliant strftime format (https://man7.org/linux/man-pages/man3/strftime.3.html)
+    strftime(timestamp_buffer, sizeof(timestamp_buffer), "timestamp: %a %d %b %Y %H:%M:%S\n", tm_now);
+
+    // Acquire the lock to write the timestamp
+    write_lock();
+
+    int fd =  open(g_data_file_path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (fd == -1) {
+        perror("Call to open() failed for timestamp");
+    } 
+    else {
+        if (write(fd, timestamp_buffer, strlen(timestamp_buffer)) == -1) {
+            perror("Call to write() failed for timestamp");
+        }
+        else if (g_shared_log) {
+            shared_log_mirror(g_shared_log, timestamp_buffer, strlen(timestamp_buffer));
+        }
+        else {
+            repl_commit(timestamp_buffer, strlen(timestamp_buffer));
+            search_index_append(timestamp_buffer, strlen(timestamp_buffer));
+        }
+        close(fd);
+    }
+
+    write_unlock();
+}
+
+
+void timer_init(void)
+{
+    // Create the timer, run in its own thread rather than a signal handler since
+    // insert_timestamp takes locks and feeds the replication backlog
+    struct sigevent my_sigevent = {
+        .sigev_notify = SIGEV_THREAD,
+        .sigev_notify_function = insert_timestamp
+    };
+    if (timer_create(CLOCK_REALTIME, &my_sigevent, &g_timer) == -1) {
+        perror("Call to timer_create() failed");
+        return;
+    }
+    g_timer_created = true;
+
+    // Set to go off every 10 seconds
+    struct itimerspec my_timerspec = {
+        .it_value.tv_sec = 10,
+        .it_value.tv_nsec = 0,
+        .it_interval.tv_sec = 10,
+        .it_interval.tv_nsec = 0
+    };
+    if (timer_settime(g_timer, 0, &my_timerspec, NULL) == -1) {
+        perror("Call to timer_settime() failed");
+        return;
+    }
+}
+#endif
+
+// Accept clients on g_my_socket and handle each one in its own thread until told to exit
+void serve_clients(void) {
+    int my_client;
+    struct sockaddr_in my_client_addr;
+
+    struct thread_head head;
+    SLIST_INIT(&head);
+
+    // The main thread accepts, it keeps the process name
+    placement_apply_self(PLACEMENT_ACCEPT, NULL);
+
+    // Threads don't survive fork, so each prefork worker turns its own wheel
+    // and runs its own commit thread
+    timer_wheel_start();
+    if (g_commit_thread_enabled) {
+        commit_start();
+    }
+
+    // Prefork workers race to accept the same client, the losers must not block in accept()
+    int listener_flags = fcntl(g_my_socket, F_GETFL);
+    if (listener_flags != -1) {
+        fcntl(g_my_socket, F_SETFL, listener_flags | O_NONBLOCK);
+    }
+
+    // Infinite loop to repeatedly accept and handle clients
+    while (!g_exit_flag) {
+        socklen_t client_addr_len = sizeof(my_client_addr);
+
+        // Wait for either a client or a replacement instance asking for our listener
+        struct pollfd my_pollfds[2] = {
+            { .fd = g_my_socket, .events = POLLIN },
+            { .fd = g_handoff_socket, .events = POLLIN }
+        };
+        // Time out now and then so a drain request is noticed even without clients
+        if (poll(my_pollfds, 2, 1000) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Call to poll() failed");
+            break;
+        }
+
+        if (my_pollfds[1].revents & POLLIN) {
+            if (handoff_send_listener(g_handoff_socket, g_my_socket) == 0) {
+                syslog(LOG_INFO, "Handed listening socket to new instance, draining");
+                printf("Handed listening socket to new instance, draining\n");
+                g_handed_off = true;
+                g_draining = 1;
+                // Don't let the signal handler shut down the socket the new instance now owns
+                int handed_socket = g_my_socket;
+                g_my_socket = -1;
+                close(handed_socket);
+                break;
+            }
+            continue;
+        }
+
+        if (!(my_pollfds[0].revents & (POLLIN | POLLERR | POLLHUP))) {
+            continue;
+        }
+        
+        struct thread_entry *current_entry = malloc(sizeof(struct thread_entry));
+        if (!current_entry) {
+            perror("Call to malloc() failed for linked list entry creation");
+            break;
+        }
+        
+        current_entry->is_done = false;
+        
+        my_client = accept(g_my_socket, (struct sockaddr *)&my_client_addr, &client_addr_len);
+        if (my_client == -1) {
+            free(current_entry);
+            if (g_exit_flag) {
+                break;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("Call to accept() failed");
+            break;
+        }
+        current_entry->my_client = my_client;
+        current_entry->client_ip = my_client_addr.sin_addr.s_addr;
+        conn_timer_add(&current_entry->timer, current_entry->my_client);
+        STATS_ADD(connections, 1);
+        DEBUG_PRINT("Current entry client: %d\n",my_client);
+        my_client = -1;
+
+        syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(my_client_addr.sin_addr));
+        printf("Accepted connection from %s\n", inet_ntoa(my_client_addr.sin_addr));
+
+        SLIST_INSERT_HEAD(&head, current_entry, next_slist_entry);
+        
+        // Create a new thread in the linked list
+        if (placement_thread_create(&current_entry->thread_id, PLACEMENT_WORKER, "aesd-conn",
+                                    thread_connection_wrapper, current_entry) != 0){
+            perror("Call to pthread_create() failed");
+            SLIST_REMOVE(&head, current_entry, thread_entry, next_slist_entry);
+            conn_timer_remove(&current_entry->timer);
+            close(current_entry->my_client);
+            free(current_entry);
+            continue;
+        }
+
+        syslog(LOG_INFO, "Closed connection from %s", inet_ntoa(my_client_addr.sin_addr));
+        printf("Closed connection from %s\n", inet_ntoa(my_client_addr.sin_addr));
+                
+        // Join any completed threads by traversing the list and free any associated memory 
+        struct thread_entry *indexed_entry, *temp;
+        SLIST_FOREACH_SAFE(indexed_entry, &head, next_slist_entry, temp) {
+            if (indexed_entry->is_done) {
+                pthread_join(indexed_entry->thread_id, NULL);
+                SLIST_REMOVE(&head, indexed_entry, thread_entry, next_slist_entry);
+                free(indexed_entry);
             }
-            packet_buffer = bigger_packet_buffer;
         }
     }
-    
-    DEBUG_PRINT("Completed with client %d\n",my_client);
 
-    if (packet_buffer) {
-        free(packet_buffer);
+    if (!g_handed_off && !g_is_worker) {
+        syslog(LOG_INFO, "Caught signal, exiting");
+        printf("Caught signal, exiting\n");
     }
-    if (my_file_read != -1) {
-        close(my_file_read);
+   
+    // Make sure all threads are joined and all memory is freed
+    struct thread_entry *indexed_entry, *temp;
+    SLIST_FOREACH_SAFE(indexed_entry, &head, next_slist_entry, temp) {
+        if (indexed_entry->thread_id != 0) {
+            pthread_join(indexed_entry->thread_id, NULL);
+        }
+        if (indexed_entry->my_client != -1) {
+            close(indexed_entry->my_client);
+        }
+        SLIST_REMOVE(&head, indexed_entry, thread_entry, next_slist_entry);
+        free(indexed_entry);
     }
-}
-
 
-// Wrapper function for each thread to run to handle a connection
-void *thread_connection_wrapper(void *arg) {
-    struct thread_entry *my_entry = (struct thread_entry *)arg;
-    handle_connection(my_entry->my_client, g_my_file_write);
-    my_entry->is_done = true;
-    close(my_entry->my_client);
-    return NULL;
+    commit_stop();
+    timer_wheel_stop();
 }
 
-#ifndef USE_AESD_CHAR_DEVICE
-void insert_timestamp(int signum) {
-    char timestamp_buffer[128];
-    time_t now = time(NULL);
-    struct tm *tm_now = localtime(&now);
-
-    // RFC 2822 compliant strftime format (https://man7.org/linux/man-pages/man3/strftime.3.html)
-    strftime(timestamp_buffer, sizeof(timestamp_buffer), "timestamp: %a %d %b %Y %H:%M:%S\n", tm_now);
 
-    // Acquire the lock to write the timestamp
-    pthread_mutex_lock(&g_write_mutex);
+// Entry point of each prefork worker process
+void worker_main(int index) {
+    g_is_worker = true;
+    signal(SIGUSR2, drain_handler);
+    syslog(LOG_INFO, "Prefork worker %d started", index);
 
-    int fd =  open(DATA_FILE_PATH, O_WRONLY | O_CREAT | O_APPEND, 0666);
-    if (fd == -1) {
-        perror("Call to open() failed for timestamp");
-    } 
-    else {
-        if (write(fd, timestamp_buffer, strlen(timestamp_buffer)) == -1) {
-            perror("Call to write() failed for timestamp");
-        }
-        close(fd);
+    // The handoff socket is the master's to answer
+    if (g_handoff_socket != -1) {
+        close(g_handoff_socket);
+        g_handoff_socket = -1;
     }
 
-    pthread_mutex_unlock(&g_write_mutex);
+    serve_clients();
+    worker_cleanup();
 }
 
 
-void timer_init(void)
-{
-    // Set the signal handler
-    struct sigaction my_sigaction = {
-        .sa_handler = insert_timestamp,
-        .sa_flags = SA_RESTART // Otherwise will cause accept() will fail and program to exit
-    };
-    if (sigaction(SIGALRM, &my_sigaction, NULL) == -1) {
-        perror("Call to sigaction() failed");
-        return;
+// Helper function to create, bind and listen on the TCP socket for g_port
+int open_listener(void) {
+    int rc, listener;
+    struct sockaddr_in my_server_addr;
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener == -1) {
+        perror("Call to socket() failed");
+        return -1;
     }
 
-    // Create the timer
-    struct sigevent my_sigevent = {
-        .sigev_notify = SIGEV_SIGNAL,
-        .sigev_signo = SIGALRM
-    };
-    if (timer_create(CLOCK_REALTIME, &my_sigevent, &g_timer) == -1) {
-        perror("Call to timer_create() failed");
-        return;
+    rc = setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    if (rc == -1) {
+        perror("Call to setsockopt() failed");
+        close(listener);
+        return -1;
     }
 
-    // Set to go off every 10 seconds
-    struct itimerspec my_timerspec = {
-        .it_value.tv_sec = 10,
-        .it_value.tv_nsec = 0,
-        .it_interval.tv_sec = 10,
-        .it_interval.tv_nsec = 0
-    };
-    if (timer_settime(g_timer, 0, &my_timerspec, NULL) == -1) {
-        perror("Call to timer_settime() failed");
-        return;
+    my_server_addr.sin_family = AF_INET;
+    my_server_addr.sin_addr.s_addr = INADDR_ANY;
+    my_server_addr.sin_port = htons(g_port);
+
+    rc = bind(listener, (struct sockaddr *)&my_server_addr, sizeof(my_server_addr));
+    if (rc == -1) {
+        perror("Call to bind() failed");
+        close(listener);
+        return -1;
+    }
+
+    rc = listen(listener, SOMAXCONN);
+    if (rc == -1) {
+        perror("Call to listen() failed");
+        close(listener);
+        return -1;
     }
+
+    return listener;
 }
-#endif
+
 
 int main(int argc, char *argv[]) {
 
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
 
-    // Handle potential -d argument
-    bool create_daemon = false; 
-    if (argc == 2 && strcmp(argv[1], "-d") == 0) {
-        create_daemon = true;
+    // Handle potential -d (daemon), -t (take over from a running instance),
+    // -f (pre-opened listening fd), -p (pidfile), -w (prefork worker count),
+    // -r (replication leader port), -F (follow a leader at host:port),
+    // -P (TCP port), -D (data file, to run several instances on one box)
+    // -S (keep a search index), -i (ingest bytes/s per client),
+    // -o (reply bytes/s per client), -I/-R/-L (idle, read and lifetime
+    // timeouts in seconds), -c (commit through a single writer thread),
+    // -s (thread stack size in KiB) and -a (pin a thread role to CPUs) arguments
+    bool create_daemon = false;
+    bool takeover = false;
+    int inherited_fd = -1;
+    int worker_count = 0;
+    int replication_port = 0;
+    const char *follow_leader = NULL;
+    bool search_index = false;
+    struct ratelimit_config limits;
+    unsigned int idle_timeout = TIMER_DEFAULT_IDLE_SEC;
+    unsigned int read_timeout = TIMER_DEFAULT_READ_SEC;
+    unsigned int lifetime_timeout = TIMER_DEFAULT_LIFETIME_SEC;
+    ratelimit_get_config(&limits);
+    placement_init();
+    static const struct option long_options[] = {
+        { "daemon",   no_argument,       NULL, 'd' },
+        { "takeover", no_argument,       NULL, 't' },
+        { "fd",       required_argument, NULL, 'f' },
+        { "pidfile",  required_argument, NULL, 'p' },
+        { "workers",  required_argument, NULL, 'w' },
+        { "replication-port", required_argument, NULL, 'r' },
+        { "follow",   required_argument, NULL, 'F' },
+        { "port",     required_argument, NULL, 'P' },
+        { "data-file", required_argument, NULL, 'D' },
+        { "search-index", no_argument,    NULL, 'S' },
+        { "ingest-rate", required_argument, NULL, 'i' },
+        { "reply-rate", required_argument, NULL, 'o' },
+        { "idle-timeout", required_argument, NULL, 'I' },
+        { "read-timeout", required_argument, NULL, 'R' },
+        { "lifetime", required_argument,   NULL, 'L' },
+        { "commit-thread", no_argument,    NULL, 'c' },
+        { "stack-size", required_argument, NULL, 's' },
+        { "cpus",     required_argument,   NULL, 'a' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "dtf:p:w:r:F:P:D:Si:o:I:R:L:cs:a:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'd':
+            create_daemon = true;
+            break;
+        case 't':
+            takeover = true;
+            break;
+        case 'f':
+            inherited_fd = atoi(optarg);
+            break;
+        case 'p':
+            g_pidfile_path = optarg;
+            break;
+        case 'w':
+            worker_count = atoi(optarg);
+            if (worker_count < 0 || worker_count > PREFORK_MAX_WORKERS) {
+                fprintf(stderr, "Worker count must be between 0 and %d\n", PREFORK_MAX_WORKERS);
+                return -1;
+            }
+            break;
+        case 'r':
+            replication_port = atoi(optarg);
+            break;
+        case 'F':
+            follow_leader = optarg;
+            break;
+        case 'P':
+            g_port = atoi(optarg);
+            if (g_port <= 0 || g_port > 65535) {
+                fprintf(stderr, "Invalid port %s\n", optarg);
+                return -1;
+            }
+            // Instances on other ports get their own handoff socket
+            if (g_port != 9000) {
+                snprintf(g_handoff_path, sizeof(g_handoff_path), "/var/run/aesdsocket-%d.handoff", g_port);
+            }
+            break;
+        case 'D':
+            g_data_file_path = optarg;
+            break;
+        case 'S':
+            search_index = true;
+            break;
+        case 'i':
+            limits.ingest_rate = strtoull(optarg, NULL, 10);
+            break;
+        case 'o':
+            limits.reply_rate = strtoull(optarg, NULL, 10);
+            break;
+        case 'I':
+            idle_timeout = strtoul(optarg, NULL, 10);
+            break;
+        case 'R':
+            read_timeout = strtoul(optarg, NULL, 10);
+            break;
+        case 'L':
+            lifetime_timeout = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            g_commit_thread_enabled = true;
+            break;
+        case 's':
+            if (placement_set_stack_size(strtoull(optarg, NULL, 10) * 1024) < 0) {
+                return -1;
+            }
+            break;
+        case 'a':
+            if (placement_parse(optarg) < 0) {
+                return -1;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d] [-t] [-f fd] [-p pidfile] [-w workers] [-r replication_port | -F leader_host:port] [-P port] [-D data_file] [-S] [-i ingest_rate] [-o reply_rate] [-I idle_sec] [-R read_sec] [-L lifetime_sec] [-c] [-s stack_kib] [-a role=cpus]...\n", argv[0]);
+            return -1;
+        }
+    }
+    if ((replication_port > 0 || follow_leader) && worker_count > 0) {
+        fprintf(stderr, "Replication is not supported in prefork mode\n");
+        return -1;
+    }
+    // Index offsets are file offsets, the device drops old entries and the shared log isn't a file
+    if (search_index && (USING_AESD_CHAR_DEVICE || worker_count > 0)) {
+        fprintf(stderr, "The search index needs the file store without prefork workers\n");
+        return -1;
+    }
+    if (replication_port > 0 && follow_leader) {
+        fprintf(stderr, "An instance is either a replication leader or a follower\n");
+        return -1;
     }
     
     
-#ifdef USE_AESD_CHAR_DEVICE
-    printf("aesdsocket configured to use /dev/aesdchar\n");
-#else
-    printf("aesdsocket configured to use /var/tmp/aesdsocketdata\n");
-#endif
+    printf("aesdsocket configured to use %s\n", g_data_file_path);
+    ratelimit_configure(&limits);
+    timer_wheel_configure(idle_timeout, read_timeout, lifetime_timeout);
     
-    printf("Starting TCP server on port 9000...\n");
-
-    int rc, my_client;
-    struct sockaddr_in my_server_addr, my_client_addr;
+    printf("Starting TCP server on port %d...\n", g_port);
 
 /*
-    g_my_file_write = open(DATA_FILE_PATH, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    g_my_file_write = open(g_data_file_path, O_WRONLY | O_CREAT | O_APPEND, 0666);
     if (g_my_file_write < 0) {
         perror("Call to open() failed for writing");
         cleanup();
@@ -324,36 +1267,41 @@ int main(int argc, char *argv[]) {
     g_my_file_write = -1;
 
 
-    g_my_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (g_my_socket == -1) {
-        perror("Call to socket() failed");
-        cleanup();
-        return -1;
+    // A supervisor that keeps the port open for us takes priority over binding it ourselves
+    if (inherited_fd != -1) {
+        g_my_socket = activation_from_fd(inherited_fd);
+        if (g_my_socket == -1) {
+            cleanup();
+            return -1;
+        }
+        printf("Using pre-opened listening socket %d\n", g_my_socket);
+        g_listener_inherited = true;
     }
-
-    rc = setsockopt(g_my_socket, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
-    if (rc == -1) {
-        perror("Call to setsockopt() failed");
-        cleanup();
-        return -1;
+    else {
+        g_my_socket = activation_from_environment();
+        if (g_my_socket != -1) {
+            printf("Using listening socket passed through LISTEN_FDS\n");
+            g_listener_inherited = true;
+        }
     }
 
-    my_server_addr.sin_family = AF_INET;
-    my_server_addr.sin_addr.s_addr = INADDR_ANY;
-    my_server_addr.sin_port = htons(9000);
-
-    rc = bind(g_my_socket, (struct sockaddr *)&my_server_addr, sizeof(my_server_addr));
-    if (rc == -1) {
-        perror("Call to bind() failed");
-        cleanup();
-        return -1;
+    // Take over the listener of a running instance so there is no gap where connections are refused
+    if (g_my_socket == -1 && takeover) {
+        g_my_socket = handoff_receive_listener(g_handoff_path);
+        if (g_my_socket == -1) {
+            printf("No running instance to take over from, binding port %d\n", g_port);
+        }
+        else {
+            printf("Took over listening socket from running instance\n");
+        }
     }
 
-    rc = listen(g_my_socket, SOMAXCONN);
-    if (rc == -1) {
-        perror("Call to listen() failed");
-        cleanup();
-        return -1;
+    if (g_my_socket == -1) {
+        g_my_socket = open_listener();
+        if (g_my_socket == -1) {
+            cleanup();
+            return -1;
+        }
     }
     
     
@@ -393,93 +1341,89 @@ int main(int argc, char *argv[]) {
         dup2(devnull, STDERR_FILENO);
         close(devnull);
     }
+
+    // Record the pid that is actually serving, after any fork
+    if (g_pidfile_path && activation_write_pidfile(g_pidfile_path) < 0) {
+        g_pidfile_path = NULL;
+    }
     
 
-    printf("Listening on port 9000...\n");
+    printf("Listening on port %d...\n", g_port);
     openlog("aesdsocket", LOG_PID, LOG_USER);
 
+    if (stats_init() < 0) {
+        cleanup();
+        return -1;
+    }
 
-    struct thread_head head;
-    SLIST_INIT(&head);
+    // Prefork workers can't tail or replicate, the stream offsets they report come from the shared log
+    if (worker_count == 0) {
+        repl_reset(store_stream_end());
+    }
 
-#ifndef USE_AESD_CHAR_DEVICE
-    timer_init();
-#endif
+    if (search_index && search_index_init(g_data_file_path) < 0) {
+        cleanup();
+        return -1;
+    }
 
+    // Replication streams from this process's backlog, which prefork workers don't share
+    if (replication_port > 0 && repl_start_leader(replication_port) < 0) {
+        cleanup();
+        return -1;
+    }
+    if (follow_leader && repl_start_follower(follow_leader) < 0) {
+        cleanup();
+        return -1;
+    }
 
-    // Infinite loop to repeatedly accept and handle clients
-    while (!g_exit_flag) {
-        socklen_t client_addr_len = sizeof(my_client_addr);
-        
-        struct thread_entry *current_entry = malloc(sizeof(struct thread_entry));
-        if (!current_entry) {
-            perror("Call to malloc() failed for linked list entry creation");
-            break;
-        }
-        
-        current_entry->is_done = false;
-        
-        my_client = accept(g_my_socket, (struct sockaddr *)&my_client_addr, &client_addr_len);
-        if (my_client == -1) {
-            free(current_entry);
-            if (g_exit_flag) {
-                break;
-            }
-            perror("Call to accept() failed");
-            break;
-        }
-        current_entry->my_client = my_client;
-        DEBUG_PRINT("Current entry client: %d\n",my_client);
-        my_client = -1;
+    // Not fatal: we just can't be upgraded without a gap
+    g_handoff_socket = handoff_listen(g_handoff_path);
+    if (g_handoff_socket == -1) {
+        syslog(LOG_WARNING, "Hot restart handoff unavailable on %s", g_handoff_path);
+    }
 
-        syslog(LOG_INFO, "Accepted connection from %s", inet_ntoa(my_client_addr.sin_addr));
-        printf("Accepted connection from %s\n", inet_ntoa(my_client_addr.sin_addr));
 
-        SLIST_INSERT_HEAD(&head, current_entry, next_slist_entry);
-        
-        // Create a new thread in the linked list
-        if (pthread_create(&current_entry->thread_id, NULL, thread_connection_wrapper, current_entry) != 0){
-            perror("Call to pthread_create() failed");
-            SLIST_REMOVE(&head, current_entry, thread_entry, next_slist_entry);
-            free(current_entry);
-            continue;
+    // Prefork: the master only supervises, workers accept on the shared listener
+    if (worker_count > 0) {
+        g_shared_log = shared_log_create(PREFORK_LOG_SIZE);
+        if (!g_shared_log) {
+            cleanup();
+            return -1;
         }
-
-        syslog(LOG_INFO, "Closed connection from %s", inet_ntoa(my_client_addr.sin_addr));
-        printf("Closed connection from %s\n", inet_ntoa(my_client_addr.sin_addr));
-                
-        // Join any completed threads by traversing the list and free any associated memory 
-        struct thread_entry *indexed_entry, *temp;
-        SLIST_FOREACH_SAFE(indexed_entry, &head, next_slist_entry, temp) {
-            if (indexed_entry->is_done) {
-                pthread_join(indexed_entry->thread_id, NULL);
-                SLIST_REMOVE(&head, indexed_entry, thread_entry, next_slist_entry);
-                free(indexed_entry);
-            }
+        g_write_mutex = &g_shared_log->lock;
+#ifndef USE_AESD_CHAR_DEVICE
+        // After a handoff the file already holds the store
+        if (shared_log_load(g_shared_log, g_data_file_path) < 0) {
+            cleanup();
+            return -1;
         }
+        timer_init();
+#endif
+        g_is_master = true;
+        prefork_run(worker_count, g_handoff_socket, worker_main);
     }
-
-    syslog(LOG_INFO, "Caught signal, exiting");
-    printf("Caught signal, exiting\n");
-   
-    // Make sure all threads are joined and all memory is freed
-    struct thread_entry *indexed_entry, *temp;
-    SLIST_FOREACH_SAFE(indexed_entry, &head, next_slist_entry, temp) {
-        if (indexed_entry->thread_id != 0) {
-            pthread_join(indexed_entry->thread_id, NULL);
-        }
-        if (indexed_entry->my_client != -1) {
-            close(indexed_entry->my_client);
+    else {
+#ifndef USE_AESD_CHAR_DEVICE
+        // A follower gets its timestamps from the leader
+        if (g_repl_role != REPL_FOLLOWER) {
+            timer_init();
         }
-        SLIST_REMOVE(&head, indexed_entry, thread_entry, next_slist_entry);
-        free(indexed_entry);
+#endif
+        serve_clients();
     }
-        
+
+    repl_stop();
+    search_index_free();
+    ratelimit_free();
+    readcache_free();
+    compress_cache_free();
+
     cleanup();
     
     return 0;
 }
 
 
+
         
 
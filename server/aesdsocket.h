@@ -0,0 +1,45 @@
+// Definitions shared between the aesdsocket modules
+// Author: Eric Percin, 10/18/2026
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#ifdef USE_AESD_CHAR_DEVICE
+    #define DATA_FILE_PATH "/dev/aesdchar"
+    #define USING_AESD_CHAR_DEVICE 1
+#else
+    #define DATA_FILE_PATH "/var/tmp/aesdsocketdata"
+    #define USING_AESD_CHAR_DEVICE 0
+#endif
+
+#define INITIAL_BUFFER_SIZE 512
+
+// Sent as the first line, keeps the connection open for any number of lines.
+// Every line then gets "OK <offset>\n", "DATA <length>\n<bytes>" or "ERROR <reason>\n".
+#define PIPELINE_COMMAND "AESDSOCKET_PIPELINE\n"
+#define PIPELINE_READ_COMMAND "AESDSOCKET_READ\n"
+#define PIPELINE_STATS_COMMAND "AESDSOCKET_STATS\n"
+
+//#define DEBUG
+#ifdef DEBUG
+    #define DEBUG_PRINT(...) printf(__VA_ARGS__)
+#else
+    #define DEBUG_PRINT(...) 
+#endif
+
+// Globals owned by aesdsocket.c
+extern int g_my_socket;
+extern const char *g_data_file_path;
+extern volatile int g_exit_flag;
+extern bool g_handed_off;
+extern volatile int g_draining;
+extern pthread_mutex_t *g_write_mutex;
+
+// Take and release the store write lock, which may be shared with other processes
+void write_lock(void);
+void write_unlock(void);
+
+#endif // AESDSOCKET_H
@@ -0,0 +1,238 @@
+// Single-writer commit thread for aesdsocket
+// Author: Eric Percin, 10/18/2026
+// References: https://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-node-based-queue
+//             https://man7.org/linux/man-pages/man2/writev.2.html
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/uio.h>
+#include "aesdsocket.h"
+#include "commit.h"
+#include "prefork.h"
+#include "replication.h"
+#include "search.h"
+#include "stats.h"
+#include "placement.h"
+
+// A line waiting to be committed, lives on the submitting thread's stack
+struct commit_request {
+    const char *buf;
+    size_t len;
+    uint64_t offset;
+    int status;
+    sem_t done;
+    struct commit_request *next;
+};
+
+bool g_commit_thread_enabled = false;
+
+// Producers push at g_queue_head, the commit thread pops at g_queue_tail
+static struct commit_request g_queue_stub;
+static struct commit_request *g_queue_head = &g_queue_stub;
+static struct commit_request *g_queue_tail = &g_queue_stub;
+// Lines pushed but not yet popped, the commit thread sleeps on g_commit_wake when it reaches 0
+static size_t g_queue_pending = 0;
+static sem_t g_commit_wake;
+
+static pthread_t g_commit_thread;
+static bool g_commit_running = false;
+static volatile bool g_commit_stop = false;
+static int g_commit_fd = -1;
+
+
+// Helper function to push a request, safe from any number of threads
+static void commit_push(struct commit_request *request) {
+    __atomic_store_n(&request->next, NULL, __ATOMIC_RELAXED);
+    struct commit_request *prev = __atomic_exchange_n(&g_queue_head, request, __ATOMIC_ACQ_REL);
+    // Between the exchange and this store the queue is briefly unlinked, commit_pop copes
+    __atomic_store_n(&prev->next, request, __ATOMIC_RELEASE);
+}
+
+
+// Helper function to pop the oldest request, only called from the commit thread.
+// Returns NULL when empty or when a push is halfway done.
+static struct commit_request *commit_pop(void) {
+    struct commit_request *tail = g_queue_tail;
+    struct commit_request *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &g_queue_stub) {
+        if (!next) {
+            return NULL;
+        }
+        g_queue_tail = next;
+        tail = next;
+        next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        g_queue_tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&g_queue_head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    // tail is the last request, put the stub behind it so it can be handed out
+    commit_push(&g_queue_stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        g_queue_tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+
+// Helper function to commit a batch under one hold of the write lock
+static void commit_batch(struct commit_request **batch, int count) {
+    struct iovec iov[COMMIT_BATCH_MAX];
+
+    write_lock();
+
+    // The driver stores each segment of a writev() as its own entry, like separate writes
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = (void *)batch[i]->buf;
+        iov[i].iov_len = batch[i]->len;
+    }
+    ssize_t written = writev(g_commit_fd, iov, count);
+    if (written < 0) {
+        perror("Call to writev() failed");
+        written = 0;
+    }
+
+    // Lines that made it into the store go into the replication stream and index in order,
+    // after a short write the rest of the batch fails
+    size_t done = 0;
+    for (int i = 0; i < count; i++) {
+        if (done + batch[i]->len > (size_t)written) {
+            batch[i]->status = -1;
+            written = done;
+            continue;
+        }
+        // Prefork workers mirror the store into the shared log, which replies come from
+        if (g_shared_log && !USING_AESD_CHAR_DEVICE) {
+            batch[i]->offset = shared_log_mirror(g_shared_log, batch[i]->buf, batch[i]->len);
+        }
+        else {
+            repl_commit(batch[i]->buf, batch[i]->len);
+            search_index_append(batch[i]->buf, batch[i]->len);
+            batch[i]->offset = repl_commit_offset();
+        }
+        batch[i]->status = 0;
+        done += batch[i]->len;
+    }
+
+    write_unlock();
+}
+
+
+// Thread function that drains the queue and commits what it finds in batches
+static void *commit_thread(void *arg) {
+    (void)arg;
+    struct commit_request *batch[COMMIT_BATCH_MAX];
+
+    while (1) {
+        int count = 0;
+        while (count < COMMIT_BATCH_MAX) {
+            struct commit_request *request = commit_pop();
+            if (!request) {
+                break;
+            }
+            batch[count++] = request;
+        }
+
+        if (count > 0) {
+            commit_batch(batch, count);
+            STATS_ADD(commit_batches, 1);
+            for (int i = 0; i < count; i++) {
+                sem_post(&batch[i]->done);
+            }
+        }
+
+        // Only sleep once everything pushed so far has been popped
+        size_t pending = __atomic_sub_fetch(&g_queue_pending, count, __ATOMIC_ACQ_REL);
+        if (pending > 0) {
+            if (count == 0) {
+                // A line was counted but its push isn't visible yet, it will be in a moment
+                sched_yield();
+            }
+            continue;
+        }
+        if (g_commit_stop) {
+            break;
+        }
+        while (sem_wait(&g_commit_wake) < 0 && errno == EINTR) {
+        }
+    }
+    return NULL;
+}
+
+
+int commit_start(void) {
+    g_commit_fd = open(g_data_file_path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (g_commit_fd < 0) {
+        perror("Call to open() failed for commit thread");
+        return -1;
+    }
+
+    sem_init(&g_commit_wake, 0, 0);
+    g_commit_stop = false;
+    if (placement_thread_create(&g_commit_thread, PLACEMENT_COMMIT, "aesd-commit", commit_thread, NULL) != 0) {
+        perror("Call to pthread_create() failed for commit thread");
+        if (g_commit_fd != -1) {
+            close(g_commit_fd);
+            g_commit_fd = -1;
+        }
+        sem_destroy(&g_commit_wake);
+        return -1;
+    }
+    __atomic_store_n(&g_commit_running, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+void commit_stop(void) {
+    if (!g_commit_running) {
+        return;
+    }
+    __atomic_store_n(&g_commit_running, false, __ATOMIC_RELEASE);
+    g_commit_stop = true;
+    sem_post(&g_commit_wake);
+    pthread_join(g_commit_thread, NULL);
+    sem_destroy(&g_commit_wake);
+    if (g_commit_fd != -1) {
+        close(g_commit_fd);
+        g_commit_fd = -1;
+    }
+}
+
+
+bool commit_running(void) {
+    return __atomic_load_n(&g_commit_running, __ATOMIC_ACQUIRE);
+}
+
+
+int commit_submit(const char *buf, size_t len, uint64_t *offset) {
+    struct commit_request request = { .buf = buf, .len = len, .status = -1 };
+
+    sem_init(&request.done, 0, 0);
+    // Counted before the push, so the commit thread never pops more than is counted
+    if (__atomic_fetch_add(&g_queue_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        // The first line into an empty queue wakes the commit thread
+        sem_post(&g_commit_wake);
+    }
+    commit_push(&request);
+    while (sem_wait(&request.done) < 0 && errno == EINTR) {
+    }
+    sem_destroy(&request.done);
+
+    if (request.status == 0) {
+        *offset = request.offset;
+    }
+    return request.status;
+}
@@ -0,0 +1,37 @@
+// Single-writer commit thread for aesdsocket
+// Author: Eric Percin, 10/18/2026
+//
+// With the commit thread enabled, connection threads don't write to the store
+// themselves. They push their line onto a lock-free multi-producer/single-consumer
+// queue and sleep until the commit thread has written it. The commit thread owns
+// the store fd, drains whatever has queued up, writes it as one batch (a single
+// writev() for the file store) under one hold of the write lock, assigns each line
+// its offset in the commit stream and wakes its waiter.
+
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Most lines written in one batch
+#define COMMIT_BATCH_MAX 64
+
+// Set from the command line before commit_start()
+extern bool g_commit_thread_enabled;
+
+// Open the store and start the commit thread of this process. Returns 0 or -1.
+int commit_start(void);
+
+// Stop the commit thread once every submitted line is committed
+void commit_stop(void);
+
+// True while the commit thread of this process is running
+bool commit_running(void);
+
+// Queue len bytes and wait until they are committed.
+// Returns 0 with *offset set to the end of the line in the commit stream, or -1.
+int commit_submit(const char *buf, size_t len, uint64_t *offset);
+
+#endif // COMMIT_H
@@ -0,0 +1,226 @@
+// Compressed full-store replies for aesdsocket
+// Author: Eric Percin, 10/18/2026
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "compress.h"
+#include "lz4.h"
+#include "ratelimit.h"
+
+#define COMPRESS_HEADER_MAX 64
+
+// One frame, ready to send, shared by the cache and the replies sending it
+struct compress_chunk {
+    dev_t dev;
+    ino_t ino;
+    size_t index;
+    int refs;
+    size_t length;
+    char frame[];
+};
+
+static pthread_mutex_t g_compress_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct compress_chunk *g_cache[COMPRESS_CACHE_SLOTS];
+// Bumped by a reset, so a chunk built from the old contents isn't cached afterwards
+static uint64_t g_cache_generation = 0;
+
+
+// Helper function to drop a reference, with g_compress_lock held
+static void compress_chunk_unref(struct compress_chunk *chunk) {
+    if (--chunk->refs == 0) {
+        free(chunk);
+    }
+}
+
+
+// Helper function to build the frame for len bytes of raw, holding one reference
+static struct compress_chunk *compress_chunk_build(const char *raw, size_t len) {
+    struct compress_chunk *chunk = malloc(sizeof(struct compress_chunk) + COMPRESS_HEADER_MAX + AESD_LZ4_BOUND(len));
+    if (!chunk) {
+        perror("Call to malloc() failed for compressed chunk");
+        return NULL;
+    }
+    chunk->refs = 1;
+
+    // Compress past the longest header, then close the gap once the header is known
+    char *payload = chunk->frame + COMPRESS_HEADER_MAX;
+    size_t compressed_length = aesd_lz4_compress(raw, len, payload, AESD_LZ4_BOUND(len));
+    int header_length;
+    if (compressed_length == 0 || compressed_length >= len) {
+        header_length = snprintf(chunk->frame, COMPRESS_HEADER_MAX, "RAW %zu\n", len);
+        memcpy(chunk->frame + header_length, raw, len);
+        chunk->length = header_length + len;
+    }
+    else {
+        header_length = snprintf(chunk->frame, COMPRESS_HEADER_MAX, "LZ4 %zu %zu\n", len, compressed_length);
+        memmove(chunk->frame + header_length, payload, compressed_length);
+        chunk->length = header_length + compressed_length;
+    }
+    return chunk;
+}
+
+
+static size_t compress_slot(dev_t dev, ino_t ino, size_t index) {
+    return (index + (size_t)ino * 31 + (size_t)dev * 17) % COMPRESS_CACHE_SLOTS;
+}
+
+
+// Helper function to look up a cached chunk, returning it with a reference held
+static struct compress_chunk *compress_cache_get(dev_t dev, ino_t ino, size_t index) {
+    pthread_mutex_lock(&g_compress_lock);
+    struct compress_chunk *chunk = g_cache[compress_slot(dev, ino, index)];
+    if (chunk && chunk->dev == dev && chunk->ino == ino && chunk->index == index) {
+        chunk->refs++;
+    }
+    else {
+        chunk = NULL;
+    }
+    pthread_mutex_unlock(&g_compress_lock);
+    return chunk;
+}
+
+
+// Helper function to cache chunk, replacing whatever was in its slot
+static void compress_cache_put(struct compress_chunk *chunk, dev_t dev, ino_t ino, size_t index, uint64_t generation) {
+    pthread_mutex_lock(&g_compress_lock);
+    if (generation == g_cache_generation) {
+        size_t slot = compress_slot(dev, ino, index);
+        chunk->dev = dev;
+        chunk->ino = ino;
+        chunk->index = index;
+        chunk->refs++;
+        if (g_cache[slot]) {
+            compress_chunk_unref(g_cache[slot]);
+        }
+        g_cache[slot] = chunk;
+    }
+    pthread_mutex_unlock(&g_compress_lock);
+}
+
+
+static void compress_chunk_release(struct compress_chunk *chunk) {
+    pthread_mutex_lock(&g_compress_lock);
+    compress_chunk_unref(chunk);
+    pthread_mutex_unlock(&g_compress_lock);
+}
+
+
+// Helper function to read chunk index of fd, returns the bytes read or -1
+static ssize_t compress_read_chunk(int fd, size_t index, char *raw) {
+    size_t used = 0;
+    while (used < COMPRESS_CHUNK) {
+        ssize_t bytes_read = pread(fd, raw + used, COMPRESS_CHUNK - used, (off_t)index * COMPRESS_CHUNK + used);
+        if (bytes_read < 0) {
+            perror("Call to pread() failed for compressed reply");
+            return -1;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        used += bytes_read;
+    }
+    return used;
+}
+
+
+// Helper function for both sources: memory when buf is set, otherwise fd
+static ssize_t compress_send(int client, int fd, const char *buf, size_t len, dev_t dev, ino_t ino, bool cacheable) {
+    char *raw = NULL;
+    ssize_t sent = 0;
+
+    if (!buf) {
+        raw = malloc(COMPRESS_CHUNK);
+        if (!raw) {
+            perror("Call to malloc() failed for compressed reply");
+            return -1;
+        }
+    }
+
+    for (size_t index = 0; ; index++) {
+        struct compress_chunk *chunk = cacheable ? compress_cache_get(dev, ino, index) : NULL;
+        ssize_t raw_length = COMPRESS_CHUNK;
+
+        if (!chunk) {
+            pthread_mutex_lock(&g_compress_lock);
+            uint64_t generation = g_cache_generation;
+            pthread_mutex_unlock(&g_compress_lock);
+
+            const char *source;
+            if (buf) {
+                size_t start = index * COMPRESS_CHUNK;
+                source = buf + start;
+                raw_length = start >= len ? 0 : (len - start < COMPRESS_CHUNK ? len - start : COMPRESS_CHUNK);
+            }
+            else {
+                source = raw;
+                raw_length = compress_read_chunk(fd, index, raw);
+                if (raw_length < 0) {
+                    sent = -1;
+                    break;
+                }
+            }
+            if (raw_length == 0) {
+                break;
+            }
+
+            chunk = compress_chunk_build(source, raw_length);
+            if (!chunk) {
+                sent = -1;
+                break;
+            }
+            // Only a full chunk is final, the last one still grows
+            if (cacheable && raw_length == COMPRESS_CHUNK) {
+                compress_cache_put(chunk, dev, ino, index, generation);
+            }
+        }
+
+        ssize_t rc = ratelimit_send(client, chunk->frame, chunk->length);
+        compress_chunk_release(chunk);
+        if (rc < 0) {
+            sent = -1;
+            break;
+        }
+        sent += rc;
+        if (raw_length < COMPRESS_CHUNK) {
+            break;
+        }
+    }
+
+    free(raw);
+    if (sent < 0 || ratelimit_send(client, "END\n", strlen("END\n")) < 0) {
+        return -1;
+    }
+    return sent + strlen("END\n");
+}
+
+
+ssize_t compress_send_fd(int client, int fd, dev_t dev, ino_t ino, bool cacheable) {
+    return compress_send(client, fd, NULL, 0, dev, ino, cacheable);
+}
+
+
+ssize_t compress_send_buffer(int client, const char *buf, size_t len, ino_t key, bool cacheable) {
+    return compress_send(client, -1, buf, len, 0, key, cacheable);
+}
+
+
+void compress_cache_reset(void) {
+    pthread_mutex_lock(&g_compress_lock);
+    g_cache_generation++;
+    for (int i = 0; i < COMPRESS_CACHE_SLOTS; i++) {
+        if (g_cache[i]) {
+            compress_chunk_unref(g_cache[i]);
+            g_cache[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&g_compress_lock);
+}
+
+
+void compress_cache_free(void) {
+    compress_cache_reset();
+}
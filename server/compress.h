@@ -0,0 +1,39 @@
+// Compressed full-store replies for aesdsocket
+// Author: Eric Percin, 10/18/2026
+//
+// A client opts in per connection by sending COMPRESS_COMMAND, answered with
+// "OK COMPRESS\n". From then on full-store replies are sent as a series of frames,
+// one per COMPRESS_CHUNK of the store:
+//   "LZ4 <raw length> <compressed length>\n" followed by an LZ4 block (see lz4.h)
+//   "RAW <length>\n" followed by the bytes, when compressing didn't help
+// and then "END\n". On a pipelined connection the frames of a READ follow "ZDATA\n".
+//
+// The file store and the shared log only ever grow, so every full chunk is final.
+// Compressed full chunks are cached and reused for every client; only the
+// last, partial chunk is compressed per reply. The char device drops old entries,
+// so its replies are never cached.
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define COMPRESS_COMMAND "AESDSOCKET_COMPRESS\n"
+#define COMPRESS_CHUNK (64 * 1024)
+#define COMPRESS_CACHE_SLOTS 256
+
+// Send everything readable from fd, starting at offset 0, as frames followed by "END\n".
+// dev and ino identify the file for the cache. Returns the bytes sent, or -1.
+ssize_t compress_send_fd(int client, int fd, dev_t dev, ino_t ino, bool cacheable);
+
+// Same for len bytes of memory, cached under key when cacheable
+ssize_t compress_send_buffer(int client, const char *buf, size_t len, ino_t key, bool cacheable);
+
+// Forget all cached chunks, the store was truncated. The caller holds the write lock.
+void compress_cache_reset(void);
+
+void compress_cache_free(void);
+
+#endif // COMPRESS_H
@@ -0,0 +1,150 @@
+// Listening socket handoff for aesdsocket hot restarts
+// Author: Eric Percin, 10/18/2026
+// References: https://man7.org/linux/man-pages/man7/unix.7.html
+//             https://man7.org/linux/man-pages/man3/cmsg.3.html
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "handoff.h"
+
+
+// Helper function to fill in a unix socket address, returns -1 if the path is too long
+static int handoff_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Handoff socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+
+int handoff_listen(const char *path) {
+    struct sockaddr_un addr;
+    int handoff_socket;
+
+    if (handoff_addr(path, &addr) < 0) {
+        return -1;
+    }
+
+    handoff_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (handoff_socket == -1) {
+        perror("Call to socket() failed for handoff");
+        return -1;
+    }
+
+    // A stale path is left behind by the instance we took over from (or by a crash)
+    unlink(path);
+
+    if (bind(handoff_socket, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("Call to bind() failed for handoff");
+        close(handoff_socket);
+        return -1;
+    }
+
+    if (listen(handoff_socket, 1) == -1) {
+        perror("Call to listen() failed for handoff");
+        close(handoff_socket);
+        return -1;
+    }
+
+    return handoff_socket;
+}
+
+
+int handoff_send_listener(int handoff_socket, int listen_socket) {
+    char tag = 'L';
+    struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf)
+    };
+    struct cmsghdr *cmsg;
+    int peer;
+
+    peer = accept(handoff_socket, NULL, NULL);
+    if (peer == -1) {
+        perror("Call to accept() failed for handoff");
+        return -1;
+    }
+
+    memset(control.buf, 0, sizeof(control.buf));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listen_socket, sizeof(int));
+
+    if (sendmsg(peer, &msg, 0) != 1) {
+        perror("Call to sendmsg() failed for handoff");
+        close(peer);
+        return -1;
+    }
+
+    close(peer);
+    return 0;
+}
+
+
+int handoff_receive_listener(const char *path) {
+    struct sockaddr_un addr;
+    char tag;
+    struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf)
+    };
+    struct cmsghdr *cmsg;
+    int peer, listen_socket = -1;
+
+    if (handoff_addr(path, &addr) < 0) {
+        return -1;
+    }
+
+    peer = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (peer == -1) {
+        perror("Call to socket() failed for handoff");
+        return -1;
+    }
+
+    // Nobody listening just means there is no running instance to take over from
+    if (connect(peer, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(peer);
+        return -1;
+    }
+
+    if (recvmsg(peer, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        perror("Call to recvmsg() failed for handoff");
+        close(peer);
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (tag == 'L' && cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(&listen_socket, CMSG_DATA(cmsg), sizeof(int));
+    }
+    else {
+        fprintf(stderr, "Handoff peer did not send a listening socket\n");
+    }
+
+    close(peer);
+    return listen_socket;
+}
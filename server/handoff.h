@@ -0,0 +1,24 @@
+// Listening socket handoff for aesdsocket hot restarts
+// Author: Eric Percin, 10/18/2026
+// References: https://man7.org/linux/man-pages/man7/unix.7.html
+//             https://man7.org/linux/man-pages/man3/cmsg.3.html
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+// Unix socket a running instance listens on for a replacement instance
+#define HANDOFF_SOCKET_PATH "/var/run/aesdsocket.handoff"
+
+// Create the unix listening socket used to hand our listener to a new instance.
+// Returns the socket, or -1 on failure.
+int handoff_listen(const char *path);
+
+// Accept one pending handoff request on handoff_socket and pass listen_socket
+// to the peer using SCM_RIGHTS. Returns 0 on success, -1 on failure.
+int handoff_send_listener(int handoff_socket, int listen_socket);
+
+// Connect to a running instance at path and receive its listening socket.
+// Returns the received socket, or -1 if no instance handed one over.
+int handoff_receive_listener(const char *path);
+
+#endif // HANDOFF_H
@@ -0,0 +1,191 @@
+// Built-in LZ4 block codec for compressed aesdsocket replies
+// Author: Eric Percin, 10/18/2026
+// References: https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+
+#include <stdint.h>
+#include <string.h>
+#include "lz4.h"
+
+#define LZ4_MIN_MATCH 4
+// The last 5 bytes are always literals and the last match starts at least 12 bytes from the end
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_LIMIT 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12
+
+
+static uint32_t lz4_read32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+
+static uint32_t lz4_hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+
+// Helper function to write a length that didn't fit in its token nibble
+static uint8_t *lz4_write_length(uint8_t *op, const uint8_t *end, size_t length) {
+    while (length >= 255) {
+        if (op >= end) {
+            return NULL;
+        }
+        *op++ = 255;
+        length -= 255;
+    }
+    if (op >= end) {
+        return NULL;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+
+// Helper function to emit one sequence: literals followed by a match, or just the
+// final literals when match_length is 0
+static uint8_t *lz4_write_sequence(uint8_t *op, const uint8_t *end, const uint8_t *literals,
+                                   size_t literal_length, size_t offset, size_t match_length) {
+    if (op >= end) {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    size_t match_code = match_length ? match_length - LZ4_MIN_MATCH : 0;
+
+    *token = (uint8_t)((literal_length < 15 ? literal_length : 15) << 4);
+    if (literal_length >= 15 && !(op = lz4_write_length(op, end, literal_length - 15))) {
+        return NULL;
+    }
+    if ((size_t)(end - op) < literal_length) {
+        return NULL;
+    }
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+
+    if (!match_length) {
+        return op;
+    }
+    if (end - op < 2) {
+        return NULL;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    *token |= match_code < 15 ? match_code : 15;
+    if (match_code >= 15 && !(op = lz4_write_length(op, end, match_code - 15))) {
+        return NULL;
+    }
+    return op;
+}
+
+
+size_t aesd_lz4_compress(const char *src, size_t len, char *dst, size_t capacity) {
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *op = (uint8_t *)dst;
+    const uint8_t *end = op + capacity;
+    uint32_t table[1 << LZ4_HASH_BITS];
+    size_t ip = 0, anchor = 0;
+
+    memset(table, 0, sizeof(table));
+
+    if (len > LZ4_MATCH_LIMIT) {
+        size_t match_start_limit = len - LZ4_MATCH_LIMIT;
+        size_t match_end_limit = len - LZ4_LAST_LITERALS;
+
+        while (ip < match_start_limit) {
+            uint32_t sequence = lz4_read32(in + ip);
+            uint32_t hash = lz4_hash(sequence);
+            size_t candidate = table[hash];
+            table[hash] = ip;
+
+            // Every candidate is checked, so stale or zeroed table entries are harmless
+            if (candidate >= ip || ip - candidate > LZ4_MAX_OFFSET || lz4_read32(in + candidate) != sequence) {
+                ip++;
+                continue;
+            }
+
+            size_t match_length = LZ4_MIN_MATCH;
+            while (ip + match_length < match_end_limit && in[candidate + match_length] == in[ip + match_length]) {
+                match_length++;
+            }
+
+            op = lz4_write_sequence(op, end, in + anchor, ip - anchor, ip - candidate, match_length);
+            if (!op) {
+                return 0;
+            }
+            ip += match_length;
+            anchor = ip;
+        }
+    }
+
+    op = lz4_write_sequence(op, end, in + anchor, len - anchor, 0, 0);
+    if (!op) {
+        return 0;
+    }
+    return op - (uint8_t *)dst;
+}
+
+
+// Helper function to read a length that didn't fit in its token nibble
+static int lz4_read_length(const uint8_t **ip, const uint8_t *end, size_t *length) {
+    uint8_t byte;
+    do {
+        if (*ip >= end) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+
+ssize_t aesd_lz4_decompress(const char *src, size_t len, char *dst, size_t capacity) {
+    const uint8_t *ip = (const uint8_t *)src;
+    const uint8_t *in_end = ip + len;
+    uint8_t *op = (uint8_t *)dst;
+    uint8_t *out_end = op + capacity;
+
+    while (ip < in_end) {
+        uint8_t token = *ip++;
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && lz4_read_length(&ip, in_end, &literal_length) < 0) {
+            return -1;
+        }
+        if ((size_t)(in_end - ip) < literal_length || (size_t)(out_end - op) < literal_length) {
+            return -1;
+        }
+        memcpy(op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+
+        // The last sequence has no match
+        if (ip == in_end) {
+            break;
+        }
+
+        if (in_end - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst)) {
+            return -1;
+        }
+        size_t match_length = token & 15;
+        if (match_length == 15 && lz4_read_length(&ip, in_end, &match_length) < 0) {
+            return -1;
+        }
+        match_length += LZ4_MIN_MATCH;
+        if ((size_t)(out_end - op) < match_length) {
+            return -1;
+        }
+        // Byte by byte, the match may overlap what it is producing
+        const uint8_t *match = op - offset;
+        for (size_t i = 0; i < match_length; i++) {
+            op[i] = match[i];
+        }
+        op += match_length;
+    }
+    return op - (uint8_t *)dst;
+}
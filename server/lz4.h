@@ -0,0 +1,26 @@
+// Built-in LZ4 block codec for compressed aesdsocket replies
+// Author: Eric Percin, 10/18/2026
+// References: https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+//
+// Produces standard LZ4 blocks, so clients can decode them with any LZ4 library
+// (LZ4_decompress_safe) as well as with aesd_lz4_decompress below. The compressor
+// is a simple greedy one: fast, no dependencies, good enough for line oriented logs.
+
+#ifndef AESD_LZ4_H
+#define AESD_LZ4_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Largest block aesd_lz4_compress can produce for len input bytes
+#define AESD_LZ4_BOUND(len) ((len) + (len) / 255 + 16)
+
+// Compress len bytes of src into dst. Returns the compressed length,
+// or 0 if it doesn't fit in capacity.
+size_t aesd_lz4_compress(const char *src, size_t len, char *dst, size_t capacity);
+
+// Decompress a block of len bytes into dst. Returns the decompressed length,
+// or -1 if the block is malformed or doesn't fit in capacity.
+ssize_t aesd_lz4_decompress(const char *src, size_t len, char *dst, size_t capacity);
+
+#endif // AESD_LZ4_H
@@ -0,0 +1,311 @@
+// Thread stack size, CPU placement and names for aesdsocket
+// Author: Eric Percin, 10/18/2026
+// References: https://man7.org/linux/man-pages/man3/pthread_attr_setaffinity_np.3.html
+//             https://man7.org/linux/man-pages/man3/pthread_setname_np.3.html
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include "placement.h"
+
+struct placement_slot {
+    bool pinned;
+    char spec[64];
+    cpu_set_t cpus;
+    // Affinity seen by the last thread of this role to start
+    cpu_set_t effective;
+    bool observed;
+    int threads;
+};
+
+static const char *g_role_names[PLACEMENT_ROLES] = { "worker", "accept", "commit", "timer" };
+
+static pthread_mutex_t g_placement_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct placement_slot g_roles[PLACEMENT_ROLES];
+static cpu_set_t g_process_cpus;
+// Affinity is only ever set once a role is pinned, otherwise threads are left alone
+static bool g_any_pinned = false;
+static size_t g_stack_size = 0;
+
+// What a new thread needs before running its start routine
+struct placement_start {
+    enum placement_role role;
+    char name[PLACEMENT_NAME_MAX];
+    void *(*start_routine)(void *);
+    void *arg;
+};
+
+
+void placement_init(void) {
+    CPU_ZERO(&g_process_cpus);
+    if (sched_getaffinity(0, sizeof(g_process_cpus), &g_process_cpus) < 0) {
+        perror("Call to sched_getaffinity() failed");
+    }
+}
+
+
+int placement_set_stack_size(size_t bytes) {
+    long minimum = sysconf(_SC_THREAD_STACK_MIN);
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (bytes != 0 && minimum > 0 && bytes < (size_t)minimum) {
+        fprintf(stderr, "Thread stack size must be at least %ld bytes\n", minimum);
+        return -1;
+    }
+    if (page > 0) {
+        bytes = (bytes + page - 1) / page * page;
+    }
+    g_stack_size = bytes;
+    return 0;
+}
+
+
+// Helper function to parse a CPU list like "0-3,6" into cpus
+static int placement_parse_list(const char *list, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    while (*list && *list != '\n') {
+        char *end;
+        unsigned long first = strtoul(list, &end, 10);
+        unsigned long last = first;
+        if (end == list) {
+            return -1;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            last = strtoul(list, &end, 10);
+            if (end == list) {
+                return -1;
+            }
+        }
+        if (first > last || last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (unsigned long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        list = end;
+        if (*list == ',') {
+            list++;
+        }
+        else if (*list && *list != '\n') {
+            return -1;
+        }
+    }
+    return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+
+// Helper function to read the CPU list of a NUMA node into cpus
+static int placement_parse_node(const char *node, cpu_set_t *cpus) {
+    char path[128];
+    char list[1024];
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%s/cpulist", node);
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("Call to fopen() failed for NUMA node");
+        return -1;
+    }
+    bool read_ok = fgets(list, sizeof(list), file) != NULL;
+    fclose(file);
+    return read_ok ? placement_parse_list(list, cpus) : -1;
+}
+
+
+int placement_parse(const char *spec) {
+    const char *equals = strchr(spec, '=');
+    int role;
+
+    for (role = 0; role < PLACEMENT_ROLES; role++) {
+        if (equals && (size_t)(equals - spec) == strlen(g_role_names[role]) &&
+                strncmp(spec, g_role_names[role], equals - spec) == 0) {
+            break;
+        }
+    }
+    if (role == PLACEMENT_ROLES) {
+        fprintf(stderr, "CPU placement must be given as worker|accept|commit|timer=cpus\n");
+        return -1;
+    }
+
+    struct placement_slot *slot = &g_roles[role];
+    const char *cpus = equals + 1;
+    int rc = strncmp(cpus, "node", strlen("node")) == 0 ? placement_parse_node(cpus + strlen("node"), &slot->cpus)
+                                                        : placement_parse_list(cpus, &slot->cpus);
+    if (rc < 0) {
+        fprintf(stderr, "Invalid CPU list %s\n", cpus);
+        return -1;
+    }
+    snprintf(slot->spec, sizeof(slot->spec), "%s", cpus);
+    slot->pinned = true;
+    g_any_pinned = true;
+    return 0;
+}
+
+
+// Helper function to return the CPUs threads of role should run on
+static const cpu_set_t *placement_cpus(enum placement_role role) {
+    return g_roles[role].pinned ? &g_roles[role].cpus : &g_process_cpus;
+}
+
+
+// Helper function to name the calling thread and record where it runs
+static void placement_enter(enum placement_role role, const char *name) {
+    cpu_set_t effective;
+
+    if (name) {
+        pthread_setname_np(pthread_self(), name);
+    }
+    bool observed = sched_getaffinity(0, sizeof(effective), &effective) == 0;
+
+    pthread_mutex_lock(&g_placement_lock);
+    g_roles[role].threads++;
+    if (observed) {
+        g_roles[role].effective = effective;
+        g_roles[role].observed = true;
+    }
+    pthread_mutex_unlock(&g_placement_lock);
+}
+
+
+static void *placement_thread_start(void *arg) {
+    struct placement_start start = *(struct placement_start *)arg;
+    free(arg);
+
+    placement_enter(start.role, start.name);
+    void *result = start.start_routine(start.arg);
+
+    pthread_mutex_lock(&g_placement_lock);
+    g_roles[start.role].threads--;
+    pthread_mutex_unlock(&g_placement_lock);
+    return result;
+}
+
+
+int placement_thread_create(pthread_t *thread, enum placement_role role, const char *name,
+                            void *(*start_routine)(void *), void *arg) {
+    pthread_attr_t attr;
+    int rc;
+
+    struct placement_start *start = malloc(sizeof(struct placement_start));
+    if (!start) {
+        return ENOMEM;
+    }
+    start->role = role;
+    snprintf(start->name, sizeof(start->name), "%s", name);
+    start->start_routine = start_routine;
+    start->arg = arg;
+
+    pthread_attr_init(&attr);
+    if (g_stack_size && pthread_attr_setstacksize(&attr, g_stack_size) != 0) {
+        fprintf(stderr, "Thread stack size %zu rejected, using the default\n", g_stack_size);
+    }
+    // Set before the thread runs, so not even its first page lands on the wrong node
+    if (g_any_pinned) {
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), placement_cpus(role));
+    }
+
+    rc = pthread_create(thread, &attr, placement_thread_start, start);
+    if (rc == EINVAL && g_any_pinned) {
+        // None of the requested CPUs is online, run unpinned rather than not at all
+        fprintf(stderr, "CPUs for %s threads unavailable, not pinning %s\n", g_role_names[role], name);
+        pthread_attr_destroy(&attr);
+        pthread_attr_init(&attr);
+        if (g_stack_size) {
+            pthread_attr_setstacksize(&attr, g_stack_size);
+        }
+        rc = pthread_create(thread, &attr, placement_thread_start, start);
+    }
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        free(start);
+    }
+    return rc;
+}
+
+
+void placement_apply_self(enum placement_role role, const char *name) {
+    if (g_any_pinned && pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), placement_cpus(role)) != 0) {
+        fprintf(stderr, "CPUs for %s threads unavailable, not pinning\n", g_role_names[role]);
+    }
+    placement_enter(role, name);
+}
+
+
+// Helper function to append formatted text without overrunning buf
+static void placement_append(char *buf, size_t len, size_t *used, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static void placement_append(char *buf, size_t len, size_t *used, const char *fmt, ...) {
+    va_list args;
+    int rc;
+
+    if (*used >= len) {
+        return;
+    }
+    va_start(args, fmt);
+    rc = vsnprintf(buf + *used, len - *used, fmt, args);
+    va_end(args);
+    if (rc > 0) {
+        *used += ((size_t)rc < len - *used) ? (size_t)rc : len - *used - 1;
+    }
+}
+
+
+// Helper function to write cpus as a CPU list like "0-3,6"
+static void placement_append_cpus(char *buf, size_t len, size_t *used, const cpu_set_t *cpus) {
+    bool first = true;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, cpus)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus)) {
+            last++;
+        }
+        if (last == cpu) {
+            placement_append(buf, len, used, "%s%d", first ? "" : ",", cpu);
+        }
+        else {
+            placement_append(buf, len, used, "%s%d-%d", first ? "" : ",", cpu, last);
+        }
+        first = false;
+        cpu = last;
+    }
+    if (first) {
+        placement_append(buf, len, used, "none");
+    }
+}
+
+
+size_t placement_format(char *buf, size_t len) {
+    size_t used = 0;
+
+    if (len == 0) {
+        return 0;
+    }
+    buf[0] = '\0';
+
+    if (g_stack_size) {
+        placement_append(buf, len, &used, "thread_stack: %zu\n", g_stack_size);
+    }
+    else {
+        placement_append(buf, len, &used, "thread_stack: default\n");
+    }
+
+    pthread_mutex_lock(&g_placement_lock);
+    for (int role = 0; role < PLACEMENT_ROLES; role++) {
+        struct placement_slot *slot = &g_roles[role];
+        placement_append(buf, len, &used, "placement %s: threads %d cpus ", g_role_names[role], slot->threads);
+        placement_append_cpus(buf, len, &used, slot->observed ? &slot->effective : placement_cpus(role));
+        placement_append(buf, len, &used, " requested %s\n", slot->pinned ? slot->spec : "any");
+    }
+    pthread_mutex_unlock(&g_placement_lock);
+
+    return used;
+}
@@ -0,0 +1,54 @@
+// Thread stack size, CPU placement and names for aesdsocket
+// Author: Eric Percin, 10/18/2026
+// References: https://man7.org/linux/man-pages/man3/pthread_attr_setaffinity_np.3.html
+//             https://man7.org/linux/man-pages/man3/pthread_setname_np.3.html
+//             https://www.kernel.org/doc/html/latest/admin-guide/cputopology.html
+//
+// Every thread belongs to a role. Each role can be pinned to its own set of CPUs,
+// given as a list ("0-3,6") or as a NUMA node ("node1", the CPUs listed in
+// /sys/devices/system/node/node1/cpulist). Memory is allocated on first touch, so
+// pinning a role to a node also keeps its stacks and buffers on that node.
+// Roles without a set run on the CPUs the process started with, even when the
+// accept thread that creates them is pinned elsewhere.
+
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+enum placement_role {
+    PLACEMENT_WORKER,       // connection, replication and search threads
+    PLACEMENT_ACCEPT,       // the thread running serve_clients()
+    PLACEMENT_COMMIT,
+    PLACEMENT_TIMER,
+    PLACEMENT_ROLES
+};
+
+// Thread names are limited to 15 characters by the kernel
+#define PLACEMENT_NAME_MAX 16
+
+// Record the CPUs the process may run on. Call once before any thread is created.
+void placement_init(void);
+
+// Set the stack size of threads created from now on, 0 for the system default.
+// Returns 0, or -1 if bytes is below the minimum.
+int placement_set_stack_size(size_t bytes);
+
+// Pin a role given as "role=cpus", e.g. "accept=0" or "worker=node1".
+// Returns 0, or -1 with a message if the role or the CPU list is invalid.
+int placement_parse(const char *spec);
+
+// pthread_create() for a thread of role, named name, with the configured stack and CPUs
+int placement_thread_create(pthread_t *thread, enum placement_role role, const char *name,
+                            void *(*start_routine)(void *), void *arg);
+
+// Apply role and name to the calling thread. A NULL name keeps the current one,
+// which for the main thread is the process name that tools like pgrep match.
+void placement_apply_self(enum placement_role role, const char *name);
+
+// Write the stack size and each role's CPUs and live thread count into buf.
+// Returns the number of bytes written (excluding the terminator).
+size_t placement_format(char *buf, size_t len);
+
+#endif // PLACEMENT_H
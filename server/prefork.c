@@ -0,0 +1,232 @@
+// Prefork multi-process mode for aesdsocket
+// Author: Eric Percin, 10/18/2026
+// References: https://man7.org/linux/man-pages/man3/pthread_mutexattr_setpshared.3.html
+//             https://man7.org/linux/man-pages/man3/pthread_mutexattr_setrobust.3.html
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <syslog.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include "aesdsocket.h"
+#include "handoff.h"
+#include "prefork.h"
+#include "ratelimit.h"
+#include "stats.h"
+
+struct shared_log *g_shared_log = NULL;
+
+
+struct shared_log *shared_log_create(size_t capacity) {
+    pthread_mutexattr_t attr;
+    struct shared_log *log;
+
+    log = mmap(NULL, sizeof(struct shared_log) + capacity, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (log == MAP_FAILED) {
+        perror("Call to mmap() failed for shared log");
+        return NULL;
+    }
+
+    // Robust so a worker dying mid-write can't wedge every other worker
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&log->lock, &attr) != 0) {
+        perror("Call to pthread_mutex_init() failed for shared log");
+        pthread_mutexattr_destroy(&attr);
+        munmap(log, sizeof(struct shared_log) + capacity);
+        return NULL;
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    log->used = 0;
+    log->capacity = capacity;
+    log->full = false;
+    log->stored = 0;
+    return log;
+}
+
+
+int shared_log_load(struct shared_log *log, const char *path) {
+    struct stat file_stat;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        // Nothing stored yet
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (fstat(fd, &file_stat) < 0) {
+        perror("Call to fstat() failed for shared log");
+        close(fd);
+        return -1;
+    }
+
+    log->stored = file_stat.st_size;
+    if (log->stored > log->capacity) {
+        syslog(LOG_INFO, "Store of %" PRIu64 " bytes doesn't fit the shared log, replies read the file", log->stored);
+        log->full = true;
+        close(fd);
+        return 0;
+    }
+    while (log->used < log->stored) {
+        ssize_t bytes_read = pread(fd, log->data + log->used, log->stored - log->used, log->used);
+        if (bytes_read <= 0) {
+            perror("Call to pread() failed for shared log");
+            close(fd);
+            return -1;
+        }
+        log->used += bytes_read;
+    }
+    close(fd);
+    return 0;
+}
+
+
+uint64_t shared_log_mirror(struct shared_log *log, const char *buf, size_t len) {
+    log->stored += len;
+    if (log->full) {
+        return log->stored;
+    }
+    if (len > log->capacity - log->used) {
+        // The file has everything, replies just can't come from memory anymore
+        syslog(LOG_INFO, "Shared log full at %zu bytes, replies read the file", log->used);
+        __atomic_store_n(&log->full, true, __ATOMIC_RELEASE);
+        return log->stored;
+    }
+    memcpy(log->data + log->used, buf, len);
+    // Publish the bytes before the new length so lock-free readers never see garbage
+    __atomic_store_n(&log->used, log->used + len, __ATOMIC_RELEASE);
+    return log->stored;
+}
+
+
+bool shared_log_current(struct shared_log *log) {
+    return !__atomic_load_n(&log->full, __ATOMIC_ACQUIRE);
+}
+
+
+ssize_t shared_log_send(struct shared_log *log, int client) {
+    // Bytes below used never change, so no lock is needed to send them
+    size_t used = __atomic_load_n(&log->used, __ATOMIC_ACQUIRE);
+    return ratelimit_send(client, log->data, used);
+}
+
+
+// Helper function to fork one worker into slot index
+static pid_t prefork_spawn(int index, void (*worker_main)(int index)) {
+    // Otherwise buffered startup messages get printed once per worker
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Call to fork() failed for worker");
+        return -1;
+    }
+    if (pid == 0) {
+        // Don't outlive the master
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() == 1) {
+            exit(0);
+        }
+        stats_use_slot(index + 1);
+        worker_main(index);
+        exit(0);
+    }
+    return pid;
+}
+
+
+// Helper function to log totals across all workers
+static void prefork_log_stats(void) {
+    char stats_buffer[512];
+    stats_format(stats_buffer, sizeof(stats_buffer));
+    // Just the aggregate lines, per-worker lines follow the restarts line
+    char *per_worker = strstr(stats_buffer, "worker ");
+    if (per_worker) {
+        *per_worker = '\0';
+    }
+    for (char *line = strtok(stats_buffer, "\n"); line; line = strtok(NULL, "\n")) {
+        syslog(LOG_INFO, "prefork %s", line);
+    }
+}
+
+
+int prefork_run(int workers, int handoff_socket, void (*worker_main)(int index)) {
+    pid_t pids[PREFORK_MAX_WORKERS];
+    int status;
+    pid_t pid;
+
+    if (workers > PREFORK_MAX_WORKERS) {
+        workers = PREFORK_MAX_WORKERS;
+    }
+
+    for (int i = 0; i < workers; i++) {
+        pids[i] = prefork_spawn(i, worker_main);
+    }
+    syslog(LOG_INFO, "Started %d prefork workers", workers);
+
+    while (!g_exit_flag) {
+        struct pollfd my_pollfd = { .fd = handoff_socket, .events = POLLIN };
+        int rc = poll(&my_pollfd, 1, PREFORK_POLL_MS);
+
+        if (rc > 0 && (my_pollfd.revents & POLLIN)) {
+            if (handoff_send_listener(handoff_socket, g_my_socket) == 0) {
+                syslog(LOG_INFO, "Handed listening socket to new instance, draining workers");
+                g_handed_off = true;
+                int handed_socket = g_my_socket;
+                g_my_socket = -1;
+                close(handed_socket);
+                break;
+            }
+        }
+
+        // Reap and respawn any workers that died
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < workers; i++) {
+                if (pids[i] != pid) {
+                    continue;
+                }
+                syslog(LOG_WARNING, "Worker %d (pid %d) exited with status 0x%x, respawning", i, (int)pid, status);
+                struct aesd_stats *slot = stats_slot(i + 1);
+                if (slot) {
+                    __atomic_fetch_add(&slot->restarts, 1, __ATOMIC_RELAXED);
+                }
+                prefork_log_stats();
+                pids[i] = g_exit_flag ? -1 : prefork_spawn(i, worker_main);
+            }
+        }
+
+        // A failed fork gets retried on the next pass
+        for (int i = 0; i < workers && !g_exit_flag; i++) {
+            if (pids[i] == -1) {
+                pids[i] = prefork_spawn(i, worker_main);
+            }
+        }
+    }
+
+    // Workers drain on SIGUSR2 without touching the listener, which may now belong to a new instance
+    for (int i = 0; i < workers; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], g_handed_off ? SIGUSR2 : SIGTERM);
+        }
+    }
+    for (int i = 0; i < workers; i++) {
+        if (pids[i] > 0) {
+            while (waitpid(pids[i], &status, 0) == -1 && errno == EINTR) {
+            }
+        }
+    }
+
+    prefork_log_stats();
+    return 0;
+}
@@ -0,0 +1,64 @@
+// Prefork multi-process mode for aesdsocket
+// Author: Eric Percin, 10/18/2026
+// References: https://man7.org/linux/man-pages/man3/pthread_mutexattr_setpshared.3.html
+//             https://man7.org/linux/man-pages/man3/pthread_mutexattr_setrobust.3.html
+
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#define PREFORK_MAX_WORKERS 64
+
+// Size of the shared log mirroring the store in file mode, pages are only touched as it fills
+#define PREFORK_LOG_SIZE (64 * 1024 * 1024)
+
+// How often the master checks for dead workers, in milliseconds
+#define PREFORK_POLL_MS 1000
+
+// State shared by all worker processes, mapped before the workers are forked.
+// In file mode the data file is the store, and data[] mirrors it so replies come straight
+// from shared memory, until a write doesn't fit and replies read the file again.
+struct shared_log {
+    // Process-shared, robust replacement for the single-process write mutex
+    pthread_mutex_t lock;
+    // Bytes of data[] in use, only grows while holding lock
+    size_t used;
+    size_t capacity;
+    // Set once the store outgrew data[], which stops mirroring it
+    bool full;
+    // Stream offset of the end of the store, only changes while holding lock
+    uint64_t stored;
+    char data[];
+};
+
+// Set when running prefork mode
+extern struct shared_log *g_shared_log;
+
+// Map the shared log with room for capacity bytes. Returns NULL on failure.
+struct shared_log *shared_log_create(size_t capacity);
+
+// Mirror the store already in the file at path, before the workers are forked.
+// Returns 0 on success, -1 if the file can't be read.
+int shared_log_load(struct shared_log *log, const char *path);
+
+// Mirror len bytes just written to the store. The caller must hold log->lock.
+// Returns the stream offset of the end of the store.
+uint64_t shared_log_mirror(struct shared_log *log, const char *buf, size_t len);
+
+// Whether data[] holds the whole store, so replies can be sent from it
+bool shared_log_current(struct shared_log *log);
+
+// Send the whole log to client straight from shared memory.
+// Returns the number of bytes sent, or -1 on failure.
+ssize_t shared_log_send(struct shared_log *log, int client);
+
+// Fork workers processes each running worker_main(index), and respawn any that die.
+// Returns once g_exit_flag is set or the listener was handed off, after all workers exited.
+int prefork_run(int workers, int handoff_socket, void (*worker_main)(int index));
+
+#endif // PREFORK_H
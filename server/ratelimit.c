@@ -0,0 +1,448 @@
+// Per-client rate limiting and fair commit scheduling for aesdsocket
+// Author: Eric Percin, 10/18/2026
+// References: https://en.wikipedia.org/wiki/Token_bucket
+//             https://en.wikipedia.org/wiki/Deficit_round_robin
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include "aesdsocket.h"
+#include "ratelimit.h"
+#include "stats.h"
+
+// Longest single sleep, so a throttled thread still notices shutdown
+#define RATELIMIT_MAX_SLEEP_NS 100000000ULL
+
+struct token_bucket {
+    double tokens;
+    uint64_t updated_ns;
+};
+
+struct client_limit {
+    uint32_t ip;
+    struct token_bucket ingest;
+    struct token_bucket reply;
+    struct client_limit *next;
+};
+
+// A connection waiting for its turn to commit
+struct fair_waiter {
+    pthread_cond_t cond;
+    bool granted;
+    size_t bytes;
+    struct fair_waiter *next;
+};
+
+// A client IP with connections waiting to commit
+struct fair_tenant {
+    uint32_t ip;
+    struct fair_waiter *head;
+    struct fair_waiter *tail;
+    uint64_t deficit;
+    bool turn_started;
+    struct fair_tenant *next;
+};
+
+static pthread_mutex_t g_limit_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ratelimit_config g_config = {
+    .ingest_rate = 0,
+    .reply_rate = 0,
+    .burst = RATELIMIT_DEFAULT_BURST,
+    .quantum = RATELIMIT_DEFAULT_QUANTUM
+};
+static struct client_limit *g_clients[RATELIMIT_HASH_SIZE];
+static int g_client_count = 0;
+// Shared by everyone once the table is full of clients that are actually over their rate
+static struct client_limit g_overflow_client;
+
+static pthread_mutex_t g_fair_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool g_fair_busy = false;
+static struct fair_tenant *g_tenants = NULL;
+static struct fair_tenant *g_cursor = NULL;
+
+static __thread uint32_t t_client_ip;
+
+
+static uint64_t ratelimit_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+// Helper function to add the tokens earned since the last update
+static void bucket_refill(struct token_bucket *bucket, uint64_t rate, uint64_t now) {
+    if (bucket->updated_ns == 0) {
+        bucket->tokens = g_config.burst;
+    }
+    else if (rate) {
+        bucket->tokens += (double)(now - bucket->updated_ns) * rate / 1e9;
+    }
+    if (!rate || bucket->tokens > g_config.burst) {
+        bucket->tokens = g_config.burst;
+    }
+    bucket->updated_ns = now;
+}
+
+
+// Helper function to take len tokens, returns how long to sleep to pay back any debt
+static uint64_t bucket_take(struct token_bucket *bucket, uint64_t rate, size_t len) {
+    if (!rate) {
+        return 0;
+    }
+    bucket_refill(bucket, rate, ratelimit_now_ns());
+    // Going negative lets a single chunk bigger than the burst through after a wait
+    bucket->tokens -= len;
+    if (bucket->tokens >= 0) {
+        return 0;
+    }
+    return (uint64_t)(-bucket->tokens / rate * 1e9);
+}
+
+
+// Helper function for the table sweep: a full bucket behaves the same as a new one
+static bool bucket_full(struct token_bucket *bucket, uint64_t rate, uint64_t now) {
+    if (!rate || bucket->updated_ns == 0) {
+        return true;
+    }
+    return bucket->tokens + (double)(now - bucket->updated_ns) * rate / 1e9 >= g_config.burst;
+}
+
+
+// Helper function to drop clients whose buckets have refilled
+static void ratelimit_sweep(void) {
+    uint64_t now = ratelimit_now_ns();
+    for (int i = 0; i < RATELIMIT_HASH_SIZE; i++) {
+        struct client_limit **link = &g_clients[i];
+        while (*link) {
+            struct client_limit *client = *link;
+            if (bucket_full(&client->ingest, g_config.ingest_rate, now) &&
+                    bucket_full(&client->reply, g_config.reply_rate, now)) {
+                *link = client->next;
+                free(client);
+                g_client_count--;
+            }
+            else {
+                link = &client->next;
+            }
+        }
+    }
+}
+
+
+// Helper function to find or add the limits for ip, with g_limit_lock held
+static struct client_limit *ratelimit_client(uint32_t ip) {
+    uint32_t slot = (ip * 2654435761u) % RATELIMIT_HASH_SIZE;
+    struct client_limit *client;
+
+    for (client = g_clients[slot]; client; client = client->next) {
+        if (client->ip == ip) {
+            return client;
+        }
+    }
+
+    if (g_client_count >= RATELIMIT_MAX_CLIENTS) {
+        ratelimit_sweep();
+    }
+    if (g_client_count >= RATELIMIT_MAX_CLIENTS) {
+        return &g_overflow_client;
+    }
+
+    client = calloc(1, sizeof(struct client_limit));
+    if (!client) {
+        return &g_overflow_client;
+    }
+    client->ip = ip;
+    client->next = g_clients[slot];
+    g_clients[slot] = client;
+    g_client_count++;
+    return client;
+}
+
+
+// Helper function to sleep off a debt in short steps
+static void ratelimit_sleep(uint64_t wait_ns) {
+    STATS_ADD(throttled, 1);
+    while (wait_ns > 0 && !g_exit_flag) {
+        uint64_t step = wait_ns < RATELIMIT_MAX_SLEEP_NS ? wait_ns : RATELIMIT_MAX_SLEEP_NS;
+        struct timespec delay = { .tv_sec = step / 1000000000ULL, .tv_nsec = step % 1000000000ULL };
+        nanosleep(&delay, NULL);
+        wait_ns -= step;
+    }
+}
+
+
+void ratelimit_configure(const struct ratelimit_config *config) {
+    pthread_mutex_lock(&g_limit_lock);
+    g_config = *config;
+    if (g_config.burst == 0) {
+        g_config.burst = 1;
+    }
+    if (g_config.quantum == 0) {
+        g_config.quantum = 1;
+    }
+    pthread_mutex_unlock(&g_limit_lock);
+}
+
+
+void ratelimit_get_config(struct ratelimit_config *config) {
+    pthread_mutex_lock(&g_limit_lock);
+    *config = g_config;
+    pthread_mutex_unlock(&g_limit_lock);
+}
+
+
+int ratelimit_parse(const char *command, size_t len, struct ratelimit_config *config) {
+    char fields[256];
+    const char *newline = memchr(command, '\n', len);
+
+    if (!newline || (size_t)(newline - command) >= sizeof(fields)) {
+        return -1;
+    }
+    memcpy(fields, command, newline - command);
+    fields[newline - command] = '\0';
+
+    ratelimit_get_config(config);
+    for (char *saveptr, *field = strtok_r(fields, ",", &saveptr); field; field = strtok_r(NULL, ",", &saveptr)) {
+        char *equals = strchr(field, '=');
+        char *end;
+        if (!equals) {
+            return -1;
+        }
+        *equals = '\0';
+        errno = 0;
+        unsigned long long value = strtoull(equals + 1, &end, 10);
+        if (errno || *end != '\0' || end == equals + 1) {
+            return -1;
+        }
+        if (strcmp(field, "ingest") == 0) {
+            config->ingest_rate = value;
+        }
+        else if (strcmp(field, "reply") == 0) {
+            config->reply_rate = value;
+        }
+        else if (strcmp(field, "burst") == 0) {
+            config->burst = value;
+        }
+        else if (strcmp(field, "quantum") == 0) {
+            config->quantum = value;
+        }
+        else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+void ratelimit_set_client(uint32_t client_ip) {
+    t_client_ip = client_ip;
+}
+
+
+void ratelimit_ingest(size_t len) {
+    pthread_mutex_lock(&g_limit_lock);
+    uint64_t wait_ns = 0;
+    if (g_config.ingest_rate) {
+        wait_ns = bucket_take(&ratelimit_client(t_client_ip)->ingest, g_config.ingest_rate, len);
+    }
+    pthread_mutex_unlock(&g_limit_lock);
+
+    // Not reading in the meantime pushes back on the client through TCP flow control
+    if (wait_ns) {
+        ratelimit_sleep(wait_ns);
+    }
+}
+
+
+ssize_t ratelimit_send(int fd, const char *buf, size_t len) {
+    size_t sent = 0;
+
+    while (sent < len) {
+        size_t chunk = len - sent;
+        if (chunk > RATELIMIT_SEND_CHUNK) {
+            chunk = RATELIMIT_SEND_CHUNK;
+        }
+
+        pthread_mutex_lock(&g_limit_lock);
+        uint64_t wait_ns = 0;
+        if (g_config.reply_rate) {
+            wait_ns = bucket_take(&ratelimit_client(t_client_ip)->reply, g_config.reply_rate, chunk);
+        }
+        pthread_mutex_unlock(&g_limit_lock);
+        if (wait_ns) {
+            ratelimit_sleep(wait_ns);
+        }
+
+        while (chunk > 0) {
+            ssize_t rc = send(fd, buf + sent, chunk, MSG_NOSIGNAL);
+            if (rc < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("Call to send() failed");
+                return -1;
+            }
+            sent += rc;
+            chunk -= rc;
+        }
+    }
+    return sent;
+}
+
+
+// Helper function for a round in which no tenant had the credit for its next line. Rather than
+// going round once per quantum, gives every tenant the credit of the rounds that would pass
+// before one of them could go, with g_fair_lock held
+static void fair_skip_rounds(void) {
+    uint64_t rounds = UINT64_MAX;
+
+    for (struct fair_tenant *tenant = g_tenants; tenant; tenant = tenant->next) {
+        uint64_t needed = (tenant->head->bytes - tenant->deficit + g_config.quantum - 1) / g_config.quantum;
+        if (needed < rounds) {
+            rounds = needed;
+        }
+    }
+    // The last of those rounds is left to run normally, starting from the cursor
+    for (struct fair_tenant *tenant = g_tenants; tenant; tenant = tenant->next) {
+        tenant->deficit += (rounds - 1) * g_config.quantum;
+    }
+}
+
+
+// Helper function to pass the turn to the next waiter in deficit round robin order,
+// with g_fair_lock held. Returns false if nobody is waiting.
+static bool fair_grant_next(void) {
+    int tenants = 0, misses = 0;
+
+    for (struct fair_tenant *tenant = g_tenants; tenant; tenant = tenant->next) {
+        tenants++;
+    }
+
+    while (g_tenants) {
+        if (!g_cursor) {
+            g_cursor = g_tenants;
+        }
+        struct fair_tenant *tenant = g_cursor;
+
+        if (!tenant->turn_started) {
+            tenant->deficit += g_config.quantum;
+            tenant->turn_started = true;
+        }
+
+        struct fair_waiter *waiter = tenant->head;
+        if (waiter->bytes <= tenant->deficit) {
+            tenant->deficit -= waiter->bytes;
+            tenant->head = waiter->next;
+            waiter->granted = true;
+            pthread_cond_signal(&waiter->cond);
+
+            // An idle tenant leaves the rotation and its unused deficit with it
+            if (!tenant->head) {
+                struct fair_tenant **link = &g_tenants;
+                while (*link != tenant) {
+                    link = &(*link)->next;
+                }
+                *link = tenant->next;
+                g_cursor = tenant->next;
+                free(tenant);
+            }
+            return true;
+        }
+
+        // Not enough credit this round, move on to the next tenant
+        tenant->turn_started = false;
+        g_cursor = tenant->next;
+        if (++misses == tenants) {
+            fair_skip_rounds();
+            misses = 0;
+        }
+    }
+    return false;
+}
+
+
+void fair_acquire(size_t len) {
+    struct fair_waiter waiter = { .bytes = len };
+    struct fair_tenant *tenant;
+
+    pthread_mutex_lock(&g_fair_lock);
+
+    // Uncontended: go straight in
+    if (!g_fair_busy) {
+        g_fair_busy = true;
+        pthread_mutex_unlock(&g_fair_lock);
+        return;
+    }
+
+    for (tenant = g_tenants; tenant; tenant = tenant->next) {
+        if (tenant->ip == t_client_ip) {
+            break;
+        }
+    }
+    if (!tenant) {
+        tenant = calloc(1, sizeof(struct fair_tenant));
+        if (!tenant) {
+            // Still correct, just not fair: wait for the turn like a mutex would
+            while (g_fair_busy) {
+                pthread_mutex_unlock(&g_fair_lock);
+                sched_yield();
+                pthread_mutex_lock(&g_fair_lock);
+            }
+            g_fair_busy = true;
+            pthread_mutex_unlock(&g_fair_lock);
+            return;
+        }
+        tenant->ip = t_client_ip;
+        struct fair_tenant **link = &g_tenants;
+        while (*link) {
+            link = &(*link)->next;
+        }
+        *link = tenant;
+    }
+
+    pthread_cond_init(&waiter.cond, NULL);
+    if (tenant->tail && tenant->head) {
+        tenant->tail->next = &waiter;
+    }
+    else {
+        tenant->head = &waiter;
+    }
+    tenant->tail = &waiter;
+
+    // fair_release hands the turn over directly, g_fair_busy stays set
+    while (!waiter.granted) {
+        pthread_cond_wait(&waiter.cond, &g_fair_lock);
+    }
+    pthread_cond_destroy(&waiter.cond);
+    pthread_mutex_unlock(&g_fair_lock);
+}
+
+
+void fair_release(void) {
+    pthread_mutex_lock(&g_fair_lock);
+    if (!fair_grant_next()) {
+        g_fair_busy = false;
+    }
+    pthread_mutex_unlock(&g_fair_lock);
+}
+
+
+void ratelimit_free(void) {
+    pthread_mutex_lock(&g_limit_lock);
+    for (int i = 0; i < RATELIMIT_HASH_SIZE; i++) {
+        while (g_clients[i]) {
+            struct client_limit *next = g_clients[i]->next;
+            free(g_clients[i]);
+            g_clients[i] = next;
+        }
+    }
+    g_client_count = 0;
+    pthread_mutex_unlock(&g_limit_lock);
+}
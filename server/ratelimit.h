@@ -0,0 +1,64 @@
+// Per-client rate limiting and fair commit scheduling for aesdsocket
+// Author: Eric Percin, 10/18/2026
+// References: https://en.wikipedia.org/wiki/Token_bucket
+//             https://en.wikipedia.org/wiki/Deficit_round_robin
+//
+// Each client IP gets a token bucket for bytes received and one for bytes sent.
+// Writes are admitted to the store in deficit round robin order across client IPs,
+// so one client with many connections queued can't starve the others.
+// Limits can be changed at runtime from localhost with
+// "AESDSOCKET_LIMIT:ingest=<bytes/s>,reply=<bytes/s>,burst=<bytes>,quantum=<bytes>\n",
+// where any field may be left out and a rate of 0 means unlimited.
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define RATELIMIT_PREFIX "AESDSOCKET_LIMIT:"
+
+#define RATELIMIT_HASH_SIZE 1024
+#define RATELIMIT_MAX_CLIENTS 4096
+#define RATELIMIT_DEFAULT_BURST (64 * 1024)
+#define RATELIMIT_DEFAULT_QUANTUM 4096
+
+// Largest piece of a reply sent between token checks
+#define RATELIMIT_SEND_CHUNK (16 * 1024)
+
+struct ratelimit_config {
+    uint64_t ingest_rate;
+    uint64_t reply_rate;
+    uint64_t burst;
+    uint64_t quantum;
+};
+
+// Apply new limits. Existing buckets keep their tokens, capped at the new burst.
+void ratelimit_configure(const struct ratelimit_config *config);
+
+void ratelimit_get_config(struct ratelimit_config *config);
+
+// Parse the fields after RATELIMIT_PREFIX into config, starting from its current values.
+// Returns 0 on success, -1 if malformed.
+int ratelimit_parse(const char *command, size_t len, struct ratelimit_config *config);
+
+// Set the client IP (network byte order) the calling thread is serving
+void ratelimit_set_client(uint32_t client_ip);
+
+// Account for len bytes received from the current client, sleeping if it is over its rate
+void ratelimit_ingest(size_t len);
+
+// Send all of buf to fd at the current client's reply rate.
+// Returns the number of bytes sent, or -1 on failure.
+ssize_t ratelimit_send(int fd, const char *buf, size_t len);
+
+// Wait for the current client's turn to commit len bytes, then the caller takes the write lock
+void fair_acquire(size_t len);
+
+// Hand the turn to the next waiting client
+void fair_release(void);
+
+void ratelimit_free(void);
+
+#endif // RATELIMIT_H
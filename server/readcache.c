@@ -0,0 +1,103 @@
+// Cached read descriptor for the aesdsocket store
+// Author: Eric Percin, 10/18/2026
+// References: https://man7.org/linux/man-pages/man2/pread.2.html
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "aesdsocket.h"
+#include "readcache.h"
+
+static pthread_mutex_t g_readcache_lock = PTHREAD_MUTEX_INITIALIZER;
+// Descriptor for the file currently at g_data_file_path
+static struct readcache_entry *g_current = NULL;
+// Descriptors for rotated files that some thread is still reading
+static struct readcache_entry *g_retired = NULL;
+
+
+// Helper function to close entry or, if it is still in use, leave it for the last release
+static void readcache_retire(struct readcache_entry *entry) {
+    if (entry->refs == 0) {
+        close(entry->fd);
+        free(entry);
+        return;
+    }
+    entry->next = g_retired;
+    g_retired = entry;
+}
+
+
+struct readcache_entry *readcache_acquire(void) {
+    struct stat path_stat;
+    struct readcache_entry *entry;
+
+    pthread_mutex_lock(&g_readcache_lock);
+
+    // A missing file is recreated by the open below, just like a rotated one
+    bool exists = stat(g_data_file_path, &path_stat) == 0;
+    if (g_current && exists && g_current->dev == path_stat.st_dev && g_current->ino == path_stat.st_ino) {
+        g_current->refs++;
+        pthread_mutex_unlock(&g_readcache_lock);
+        return g_current;
+    }
+
+    entry = calloc(1, sizeof(struct readcache_entry));
+    if (!entry) {
+        perror("Call to calloc() failed for read cache");
+        pthread_mutex_unlock(&g_readcache_lock);
+        return NULL;
+    }
+    // Never create a regular file where the device node should be
+    entry->fd = open(g_data_file_path, USING_AESD_CHAR_DEVICE ? O_RDONLY : O_RDONLY | O_CREAT, 0666);
+    if (entry->fd < 0) {
+        perror("Call to open() failed for reading");
+        free(entry);
+        pthread_mutex_unlock(&g_readcache_lock);
+        return NULL;
+    }
+    // Identify what was actually opened, the path may have moved again since the stat()
+    if (fstat(entry->fd, &path_stat) == 0) {
+        entry->dev = path_stat.st_dev;
+        entry->ino = path_stat.st_ino;
+    }
+
+    if (g_current) {
+        readcache_retire(g_current);
+    }
+    g_current = entry;
+    entry->refs = 1;
+    pthread_mutex_unlock(&g_readcache_lock);
+    return entry;
+}
+
+
+void readcache_release(struct readcache_entry *entry) {
+    pthread_mutex_lock(&g_readcache_lock);
+    entry->refs--;
+    if (entry != g_current && entry->refs == 0) {
+        struct readcache_entry **link = &g_retired;
+        while (*link && *link != entry) {
+            link = &(*link)->next;
+        }
+        if (*link) {
+            *link = entry->next;
+        }
+        close(entry->fd);
+        free(entry);
+    }
+    pthread_mutex_unlock(&g_readcache_lock);
+}
+
+
+void readcache_free(void) {
+    pthread_mutex_lock(&g_readcache_lock);
+    if (g_current) {
+        readcache_retire(g_current);
+        g_current = NULL;
+    }
+    pthread_mutex_unlock(&g_readcache_lock);
+}
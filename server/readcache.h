@@ -0,0 +1,37 @@
+// Cached read descriptor for the aesdsocket store
+// Author: Eric Percin, 10/18/2026
+//
+// Replies used to open and close the store for every command, which on
+// /dev/aesdchar also meant a trip through aesd_open and aesd_release. Each process
+// now keeps one read-only descriptor and replies with pread(), so threads can share
+// it without touching a file position. The driver's read honours the position it is
+// given, so pread() works on the device too. Before every use the path is stat()ed,
+// and a new descriptor is opened if the file was rotated (different inode).
+// Descriptors still in use by other threads are closed once released.
+
+#ifndef READCACHE_H
+#define READCACHE_H
+
+#include <sys/types.h>
+
+// Size of each pread() when streaming the store to a client
+#define READCACHE_CHUNK (16 * 1024)
+
+struct readcache_entry {
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    int refs;
+    struct readcache_entry *next;
+};
+
+// Return the descriptor for the store's current file, or NULL on failure.
+// Must be paired with readcache_release().
+struct readcache_entry *readcache_acquire(void);
+
+void readcache_release(struct readcache_entry *entry);
+
+// Close the cached descriptor, e.g. before exiting
+void readcache_free(void);
+
+#endif // READCACHE_H
@@ -0,0 +1,903 @@
+// Leader/follower replication of the aesdsocket data stream
+// Author: Eric Percin, 10/18/2026
+// References: https://man7.org/linux/man-pages/man3/pthread_cond_timedwait.3p.html
+//             https://man7.org/linux/man-pages/man3/getaddrinfo.3.html
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "aesdsocket.h"
+#include "replication.h"
+#include "ratelimit.h"
+#include "readcache.h"
+#include "compress.h"
+#include "placement.h"
+#include "search.h"
+
+enum repl_role g_repl_role = REPL_NONE;
+
+// Backlog of recently committed bytes, indexed by stream offset modulo its size
+static char *g_backlog = NULL;
+static uint64_t g_backlog_start = 0;
+static uint64_t g_commit_offset = 0;
+static pthread_mutex_t g_repl_lock = PTHREAD_MUTEX_INITIALIZER;
+// TAIL clients streaming from the backlog. Without them or followers nothing reads it
+static int g_repl_tails = 0;
+// Bumped under the write lock whenever a snapshot replaces the store, so lock-free reads can tell
+static uint64_t g_store_generation = 0;
+static pthread_cond_t g_repl_cond = PTHREAD_COND_INITIALIZER;
+
+static volatile int g_repl_stop = 0;
+
+// Leader side: one thread accepting followers and one thread per follower
+struct repl_follower {
+    pthread_t thread_id;
+    int socket;
+    bool in_use;
+    volatile bool is_done;
+};
+static struct repl_follower g_followers[REPL_MAX_FOLLOWERS];
+static int g_repl_listener = -1;
+static pthread_t g_repl_thread;
+static bool g_repl_thread_started = false;
+// Names this leader's stream, followers of a previous run must resync from a snapshot
+static char g_run_id[REPL_RUN_ID_LEN + 1] = "-";
+
+// Follower side: where we follow from and how far behind we are
+static char g_leader_host[256];
+static char g_leader_port[16];
+static int g_leader_socket = -1;
+static volatile bool g_leader_connected = false;
+// Run id of the leader our store was last synced from, "-" before the first sync
+static char g_leader_run_id[REPL_RUN_ID_LEN + 1] = "-";
+static uint64_t g_leader_offset = 0;
+static uint64_t g_caught_up_ms = 0;
+static uint64_t g_resyncs = 0;
+static uint64_t g_reconnects = 0;
+
+// Buffered reader for the line oriented replication protocol
+struct repl_reader {
+    int fd;
+    char buf[4096];
+    size_t start;
+    size_t end;
+};
+
+
+// Helper function for a monotonic timestamp in milliseconds
+static uint64_t repl_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+// Helper function to send all of buf, returns -1 once the peer is gone
+static int repl_send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t rc = send(fd, buf, len, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += rc;
+        len -= rc;
+    }
+    return 0;
+}
+
+
+// Helper function to refill the reader, returns -1 on EOF, error or timeout
+static int repl_reader_fill(struct repl_reader *reader) {
+    if (reader->start == reader->end) {
+        reader->start = reader->end = 0;
+    }
+    if (reader->end == sizeof(reader->buf)) {
+        memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    ssize_t rc = recv(reader->fd, reader->buf + reader->end, sizeof(reader->buf) - reader->end, 0);
+    if (rc <= 0) {
+        return -1;
+    }
+    reader->end += rc;
+    return 0;
+}
+
+
+// Helper function to read one '\n' terminated line (terminator stripped) into line
+static int repl_read_line(struct repl_reader *reader, char *line, size_t len) {
+    while (1) {
+        char *newline = memchr(reader->buf + reader->start, '\n', reader->end - reader->start);
+        if (newline) {
+            size_t line_length = newline - (reader->buf + reader->start);
+            if (line_length >= len) {
+                return -1;
+            }
+            memcpy(line, reader->buf + reader->start, line_length);
+            line[line_length] = '\0';
+            reader->start += line_length + 1;
+            return 0;
+        }
+        if (reader->end - reader->start >= len) {
+            return -1;
+        }
+        if (repl_reader_fill(reader) < 0) {
+            return -1;
+        }
+    }
+}
+
+
+// Helper function to read exactly len bytes into dst
+static int repl_read_exact(struct repl_reader *reader, char *dst, size_t len) {
+    while (len > 0) {
+        if (reader->start == reader->end && repl_reader_fill(reader) < 0) {
+            return -1;
+        }
+        size_t chunk = reader->end - reader->start;
+        if (chunk > len) {
+            chunk = len;
+        }
+        memcpy(dst, reader->buf + reader->start, chunk);
+        reader->start += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+
+void repl_commit(const char *buf, size_t len) {
+    pthread_mutex_lock(&g_repl_lock);
+
+    // Offsets still count, clients are told where their lines landed
+    if (g_repl_role != REPL_LEADER && g_repl_tails == 0) {
+        g_commit_offset += len;
+        g_backlog_start = g_commit_offset;
+        pthread_mutex_unlock(&g_repl_lock);
+        return;
+    }
+
+    if (!g_backlog) {
+        g_backlog = malloc(REPL_BACKLOG_SIZE);
+        if (!g_backlog) {
+            // Without a backlog every follower and tail falls back to snapshots
+            perror("Call to malloc() failed for replication backlog");
+            g_commit_offset += len;
+            g_backlog_start = g_commit_offset;
+            pthread_mutex_unlock(&g_repl_lock);
+            return;
+        }
+    }
+
+    // Only the newest REPL_BACKLOG_SIZE bytes can be kept
+    if (len > REPL_BACKLOG_SIZE) {
+        g_commit_offset += len - REPL_BACKLOG_SIZE;
+        buf += len - REPL_BACKLOG_SIZE;
+        len = REPL_BACKLOG_SIZE;
+    }
+
+    size_t position = g_commit_offset % REPL_BACKLOG_SIZE;
+    size_t first = REPL_BACKLOG_SIZE - position;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(g_backlog + position, buf, first);
+    memcpy(g_backlog, buf + first, len - first);
+
+    g_commit_offset += len;
+    if (g_commit_offset - g_backlog_start > REPL_BACKLOG_SIZE) {
+        g_backlog_start = g_commit_offset - REPL_BACKLOG_SIZE;
+    }
+
+    pthread_cond_broadcast(&g_repl_cond);
+    pthread_mutex_unlock(&g_repl_lock);
+}
+
+
+void repl_reset(uint64_t offset) {
+    pthread_mutex_lock(&g_repl_lock);
+    g_commit_offset = offset;
+    g_backlog_start = offset;
+    pthread_cond_broadcast(&g_repl_cond);
+    pthread_mutex_unlock(&g_repl_lock);
+}
+
+
+uint64_t repl_commit_offset(void) {
+    pthread_mutex_lock(&g_repl_lock);
+    uint64_t offset = g_commit_offset;
+    pthread_mutex_unlock(&g_repl_lock);
+    return offset;
+}
+
+
+ssize_t repl_read_from(uint64_t offset, char *buf, size_t len) {
+    ssize_t copied;
+
+    pthread_mutex_lock(&g_repl_lock);
+
+    if (offset < g_backlog_start || offset > g_commit_offset) {
+        pthread_mutex_unlock(&g_repl_lock);
+        return -1;
+    }
+
+    if (g_commit_offset - offset < len) {
+        len = g_commit_offset - offset;
+    }
+    size_t position = offset % REPL_BACKLOG_SIZE;
+    size_t first = REPL_BACKLOG_SIZE - position;
+    if (first > len) {
+        first = len;
+    }
+    if (len > 0) {
+        memcpy(buf, g_backlog + position, first);
+        memcpy(buf + first, g_backlog, len - first);
+    }
+    copied = len;
+
+    pthread_mutex_unlock(&g_repl_lock);
+    return copied;
+}
+
+
+uint64_t repl_wait(uint64_t offset, int timeout_ms) {
+    struct timespec deadline;
+    uint64_t current;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&g_repl_lock);
+    while (g_commit_offset <= offset && !g_exit_flag && !g_repl_stop) {
+        if (pthread_cond_timedwait(&g_repl_cond, &g_repl_lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    current = g_commit_offset;
+    pthread_mutex_unlock(&g_repl_lock);
+    return current;
+}
+
+
+int repl_snapshot(char **buf, size_t *len, uint64_t *offset) {
+    size_t capacity = INITIAL_BUFFER_SIZE, used = 0;
+    char *snapshot = malloc(capacity);
+    ssize_t bytes_read = 0;
+    struct readcache_entry *reader;
+    size_t store_size = SIZE_MAX;
+#ifndef USE_AESD_CHAR_DEVICE
+    struct stat store_stat;
+    uint64_t generation;
+#endif
+
+    if (!snapshot) {
+        perror("Call to malloc() failed for snapshot");
+        return -1;
+    }
+
+    // The write lock keeps the store and the commit offset in step
+    write_lock();
+
+    reader = readcache_acquire();
+    if (!reader) {
+        write_unlock();
+        free(snapshot);
+        return -1;
+    }
+
+#ifndef USE_AESD_CHAR_DEVICE
+    // Bytes below the current size of the file never change, so only the size and offset need
+    // the lock and writers don't wait for the read. The device evicts from the front, which
+    // moves everything, so it is read whole under the lock
+    if (fstat(reader->fd, &store_stat) < 0) {
+        perror("Call to fstat() failed for snapshot");
+        readcache_release(reader);
+        write_unlock();
+        free(snapshot);
+        return -1;
+    }
+    store_size = store_stat.st_size;
+    *offset = repl_commit_offset();
+    generation = g_store_generation;
+    write_unlock();
+#endif
+
+    while (used < store_size) {
+        if (used == capacity) {
+            char *bigger_snapshot = realloc(snapshot, capacity * 2);
+            if (!bigger_snapshot) {
+                perror("Call to realloc() failed for snapshot");
+                break;
+            }
+            snapshot = bigger_snapshot;
+            capacity *= 2;
+        }
+        size_t wanted = capacity - used;
+        if (wanted > store_size - used) {
+            wanted = store_size - used;
+        }
+        bytes_read = pread(reader->fd, snapshot + used, wanted, used);
+        if (bytes_read <= 0) {
+            break;
+        }
+        used += bytes_read;
+    }
+    readcache_release(reader);
+
+#ifdef USE_AESD_CHAR_DEVICE
+    *offset = repl_commit_offset();
+    write_unlock();
+#else
+    // A follower replaced its store with a snapshot while this one was read, read it again
+    write_lock();
+    bool replaced = generation != g_store_generation;
+    write_unlock();
+    if (replaced) {
+        free(snapshot);
+        return repl_snapshot(buf, len, offset);
+    }
+#endif
+
+    if (bytes_read < 0) {
+        perror("Call to read() failed for snapshot");
+        free(snapshot);
+        return -1;
+    }
+
+    *buf = snapshot;
+    *len = used;
+    return 0;
+}
+
+
+// Helper function for repl_tail(), streaming once the backlog is being kept for it
+static int repl_tail_stream(int client, bool resume, uint64_t from) {
+    char tail_buf[4096];
+    char *snapshot;
+    size_t snapshot_length, skip = 0;
+    uint64_t position;
+    int rc = 0;
+
+    if (repl_snapshot(&snapshot, &snapshot_length, &position) < 0) {
+        return -1;
+    }
+    if (resume) {
+        // The snapshot ends at the commit offset, the char device only keeps its newest entries
+        uint64_t snapshot_start = position > snapshot_length ? position - snapshot_length : 0;
+        if (from > snapshot_start && from <= position) {
+            skip = from - snapshot_start;
+        }
+        char header[64];
+        int header_length = snprintf(header, sizeof(header), "OK TAIL %" PRIu64 "\n", snapshot_start + skip);
+        rc = repl_send_all(client, header, header_length);
+    }
+    if (rc == 0) {
+        rc = ratelimit_send(client, snapshot + skip, snapshot_length - skip) < 0 ? -1 : 0;
+    }
+    free(snapshot);
+    if (rc < 0) {
+        return 0;
+    }
+
+    // Once draining, the client reconnects to the instance that took over our listener
+    while (!g_exit_flag && !g_draining) {
+        ssize_t bytes_copied = repl_read_from(position, tail_buf, sizeof(tail_buf));
+        if (bytes_copied < 0) {
+            syslog(LOG_WARNING, "Tail client fell out of the replication backlog");
+            return -1;
+        }
+        if (bytes_copied > 0) {
+            if (ratelimit_send(client, tail_buf, bytes_copied) < 0) {
+                return 0;
+            }
+            position += bytes_copied;
+            continue;
+        }
+
+        repl_wait(position, REPL_HEARTBEAT_MS);
+
+        // Stop once the client hung up
+        char peek;
+        ssize_t peeked = recv(client, &peek, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (peeked == 0 || (peeked < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+
+int repl_tail(int client, bool resume, uint64_t from) {
+    // Counted before the snapshot, so every commit after it is in the backlog
+    pthread_mutex_lock(&g_repl_lock);
+    g_repl_tails++;
+    pthread_mutex_unlock(&g_repl_lock);
+
+    int rc = repl_tail_stream(client, resume, from);
+
+    pthread_mutex_lock(&g_repl_lock);
+    g_repl_tails--;
+    pthread_mutex_unlock(&g_repl_lock);
+    return rc;
+}
+
+
+// Thread serving one follower: resync, then stream commits and heartbeats
+static void *repl_follower_session(void *arg) {
+    struct repl_follower *follower = arg;
+    struct repl_reader reader = { .fd = follower->socket };
+    char header[128], stream_buf[16384];
+    char run_id[REPL_RUN_ID_LEN + 1];
+    uint64_t position;
+
+    // Don't let a follower that never says SYNC hold the slot forever
+    struct timeval timeout = { .tv_sec = 5 };
+    setsockopt(follower->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (repl_read_line(&reader, header, sizeof(header)) < 0 ||
+            sscanf(header, "SYNC %16s %" SCNu64, run_id, &position) != 2) {
+        syslog(LOG_WARNING, "Replication follower sent a bad SYNC request");
+        follower->is_done = true;
+        return NULL;
+    }
+
+    // Continue from the backlog when the follower has our history up to an offset we still have,
+    // otherwise send everything. Offsets from another run name different bytes
+    if (strcmp(run_id, g_run_id) != 0 || repl_read_from(position, stream_buf, 0) < 0) {
+        char *snapshot;
+        size_t snapshot_length;
+        if (repl_snapshot(&snapshot, &snapshot_length, &position) < 0) {
+            follower->is_done = true;
+            return NULL;
+        }
+        int header_length = snprintf(header, sizeof(header), "SNAPSHOT %s %" PRIu64 " %zu\n",
+                                     g_run_id, position, snapshot_length);
+        int rc = repl_send_all(follower->socket, header, header_length);
+        if (rc == 0) {
+            rc = repl_send_all(follower->socket, snapshot, snapshot_length);
+        }
+        free(snapshot);
+        if (rc < 0) {
+            follower->is_done = true;
+            return NULL;
+        }
+        syslog(LOG_INFO, "Replication follower resynced from snapshot at offset %" PRIu64, position);
+    }
+    else {
+        int header_length = snprintf(header, sizeof(header), "CONTINUE %s %" PRIu64 "\n", g_run_id, position);
+        if (repl_send_all(follower->socket, header, header_length) < 0) {
+            follower->is_done = true;
+            return NULL;
+        }
+        syslog(LOG_INFO, "Replication follower continuing from offset %" PRIu64, position);
+    }
+
+    while (!g_exit_flag && !g_repl_stop) {
+        ssize_t bytes_copied = repl_read_from(position, stream_buf, sizeof(stream_buf));
+        if (bytes_copied < 0) {
+            // Fell out of the backlog, the follower reconnects and gets a snapshot
+            syslog(LOG_WARNING, "Replication follower fell out of the backlog at offset %" PRIu64, position);
+            break;
+        }
+        if (bytes_copied > 0) {
+            int header_length = snprintf(header, sizeof(header), "DATA %" PRIu64 " %zd\n", position, bytes_copied);
+            if (repl_send_all(follower->socket, header, header_length) < 0 ||
+                    repl_send_all(follower->socket, stream_buf, bytes_copied) < 0) {
+                break;
+            }
+            position += bytes_copied;
+            continue;
+        }
+
+        if (repl_wait(position, REPL_HEARTBEAT_MS) <= position) {
+            int header_length = snprintf(header, sizeof(header), "HEARTBEAT %" PRIu64 "\n", position);
+            if (repl_send_all(follower->socket, header, header_length) < 0) {
+                break;
+            }
+        }
+    }
+
+    follower->is_done = true;
+    return NULL;
+}
+
+
+// Helper function to join finished follower sessions, with stop set it shuts down and joins all of them
+static void repl_reap_followers(bool stop) {
+    for (int i = 0; i < REPL_MAX_FOLLOWERS; i++) {
+        struct repl_follower *follower = &g_followers[i];
+        if (!follower->in_use || (!stop && !follower->is_done)) {
+            continue;
+        }
+        if (stop) {
+            shutdown(follower->socket, SHUT_RDWR);
+        }
+        pthread_join(follower->thread_id, NULL);
+        close(follower->socket);
+        follower->in_use = false;
+    }
+}
+
+
+// Thread accepting followers on the replication port
+static void *repl_leader_thread(void *arg) {
+    (void)arg;
+    while (!g_exit_flag && !g_repl_stop) {
+        struct pollfd my_pollfd = { .fd = g_repl_listener, .events = POLLIN };
+        int rc = poll(&my_pollfd, 1, REPL_HEARTBEAT_MS);
+
+        repl_reap_followers(false);
+        if (rc <= 0 || !(my_pollfd.revents & POLLIN)) {
+            continue;
+        }
+
+        int follower_socket = accept(g_repl_listener, NULL, NULL);
+        if (follower_socket == -1) {
+            continue;
+        }
+
+        struct repl_follower *follower = NULL;
+        for (int i = 0; i < REPL_MAX_FOLLOWERS; i++) {
+            if (!g_followers[i].in_use) {
+                follower = &g_followers[i];
+                break;
+            }
+        }
+        if (!follower) {
+            syslog(LOG_WARNING, "Too many replication followers, rejecting one");
+            close(follower_socket);
+            continue;
+        }
+
+        follower->socket = follower_socket;
+        follower->is_done = false;
+        if (placement_thread_create(&follower->thread_id, PLACEMENT_WORKER, "aesd-repl-feed", repl_follower_session, follower) != 0) {
+            perror("Call to pthread_create() failed for replication follower");
+            close(follower_socket);
+            continue;
+        }
+        follower->in_use = true;
+    }
+
+    repl_reap_followers(true);
+    return NULL;
+}
+
+
+// Helper function to pick a run id for this leader, random so a restart never reuses one
+static void repl_new_run_id(void) {
+    uint64_t random_id;
+
+    if (getrandom(&random_id, sizeof(random_id), 0) != sizeof(random_id)) {
+        perror("Call to getrandom() failed for replication run id");
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        random_id = ((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec) ^ ((uint64_t)getpid() << 32);
+    }
+    snprintf(g_run_id, sizeof(g_run_id), "%016" PRIx64, random_id);
+}
+
+
+int repl_start_leader(int port) {
+    struct sockaddr_in my_repl_addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = INADDR_ANY,
+        .sin_port = htons(port)
+    };
+
+    repl_new_run_id();
+
+    g_repl_listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (g_repl_listener == -1) {
+        perror("Call to socket() failed for replication");
+        return -1;
+    }
+    setsockopt(g_repl_listener, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    if (bind(g_repl_listener, (struct sockaddr *)&my_repl_addr, sizeof(my_repl_addr)) == -1) {
+        perror("Call to bind() failed for replication");
+        close(g_repl_listener);
+        g_repl_listener = -1;
+        return -1;
+    }
+    if (listen(g_repl_listener, REPL_MAX_FOLLOWERS) == -1) {
+        perror("Call to listen() failed for replication");
+        close(g_repl_listener);
+        g_repl_listener = -1;
+        return -1;
+    }
+
+    g_repl_role = REPL_LEADER;
+    if (placement_thread_create(&g_repl_thread, PLACEMENT_WORKER, "aesd-repl-lead", repl_leader_thread, NULL) != 0) {
+        perror("Call to pthread_create() failed for replication");
+        close(g_repl_listener);
+        g_repl_listener = -1;
+        return -1;
+    }
+    g_repl_thread_started = true;
+    syslog(LOG_INFO, "Replication leader listening on port %d, run id %s", port, g_run_id);
+    return 0;
+}
+
+
+// Helper function to connect to the leader, returns the socket or -1
+static int repl_connect_leader(void) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *results, *result;
+    int leader_socket = -1;
+
+    if (getaddrinfo(g_leader_host, g_leader_port, &hints, &results) != 0) {
+        return -1;
+    }
+    for (result = results; result; result = result->ai_next) {
+        leader_socket = socket(result->ai_family, result->ai_socktype | SOCK_CLOEXEC, result->ai_protocol);
+        if (leader_socket == -1) {
+            continue;
+        }
+        if (connect(leader_socket, result->ai_addr, result->ai_addrlen) == 0) {
+            break;
+        }
+        close(leader_socket);
+        leader_socket = -1;
+    }
+    freeaddrinfo(results);
+    return leader_socket;
+}
+
+
+// Helper function to apply bytes from the leader to the local store and backlog
+static int repl_apply(int store_fd, const char *buf, size_t len, bool reset, uint64_t offset) {
+    int rc = 0;
+
+    write_lock();
+    if (reset) {
+        // The snapshot replaces everything, written after what the store holds it would repeat it
+#ifdef USE_AESD_CHAR_DEVICE
+        if (ioctl(store_fd, AESDCHAR_IOCCLEAR) < 0) {
+            perror("Call to ioctl() failed, can't resync the device from a snapshot");
+            write_unlock();
+            return -1;
+        }
+#else
+        if (ftruncate(store_fd, 0) < 0) {
+            perror("Call to ftruncate() failed for snapshot");
+        }
+#endif
+        search_index_reset();
+        compress_cache_reset();
+        repl_reset(offset);
+        g_store_generation++;
+    }
+    if (len > 0 && write(store_fd, buf, len) != (ssize_t)len) {
+        perror("Call to write() failed for replication");
+        rc = -1;
+    }
+    else {
+        search_index_append(buf, len);
+        // A snapshot already ends at offset, only stream data moves it on
+        if (!reset) {
+            repl_commit(buf, len);
+        }
+    }
+    write_unlock();
+    return rc;
+}
+
+
+// Helper function to follow one connection to the leader until it breaks
+static void repl_follow_session(int store_fd) {
+    struct repl_reader reader = { .fd = g_leader_socket };
+    char header[128];
+    char run_id[REPL_RUN_ID_LEN + 1];
+    uint64_t offset;
+    size_t length;
+    char *frame = NULL;
+
+    // Missing heartbeats mean the leader is gone
+    struct timeval timeout = { .tv_sec = 3 * REPL_HEARTBEAT_MS / 1000 };
+    setsockopt(g_leader_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    int header_length = snprintf(header, sizeof(header), "SYNC %s %" PRIu64 "\n",
+                                 g_leader_run_id, repl_commit_offset());
+    if (repl_send_all(g_leader_socket, header, header_length) < 0) {
+        return;
+    }
+
+    while (!g_exit_flag && !g_repl_stop) {
+        if (repl_read_line(&reader, header, sizeof(header)) < 0) {
+            break;
+        }
+
+        if (sscanf(header, "HEARTBEAT %" SCNu64, &offset) == 1 ||
+                sscanf(header, "CONTINUE %16s %" SCNu64, run_id, &offset) == 2) {
+            __atomic_store_n(&g_leader_offset, offset, __ATOMIC_RELAXED);
+            g_leader_connected = true;
+        }
+        else if (sscanf(header, "SNAPSHOT %16s %" SCNu64 " %zu", run_id, &offset, &length) == 3 ||
+                 sscanf(header, "DATA %" SCNu64 " %zu", &offset, &length) == 2) {
+            bool snapshot = header[0] == 'S';
+            if (!snapshot && offset != repl_commit_offset()) {
+                syslog(LOG_ERR, "Replication stream gap at offset %" PRIu64, offset);
+                break;
+            }
+            frame = malloc(length ? length : 1);
+            if (!frame) {
+                perror("Call to malloc() failed for replication");
+                break;
+            }
+            if (repl_read_exact(&reader, frame, length) < 0 ||
+                    repl_apply(store_fd, frame, length, snapshot, offset) < 0) {
+                break;
+            }
+            free(frame);
+            frame = NULL;
+            if (snapshot) {
+                // Only now does the store hold this run's history
+                snprintf(g_leader_run_id, sizeof(g_leader_run_id), "%s", run_id);
+                g_resyncs++;
+                syslog(LOG_INFO, "Replication resynced from leader %s snapshot at offset %" PRIu64, run_id, offset);
+            }
+            else {
+                offset += length;
+            }
+            if (__atomic_load_n(&g_leader_offset, __ATOMIC_RELAXED) < offset) {
+                __atomic_store_n(&g_leader_offset, offset, __ATOMIC_RELAXED);
+            }
+            g_leader_connected = true;
+        }
+        else {
+            syslog(LOG_ERR, "Unexpected replication header: %s", header);
+            break;
+        }
+
+        if (repl_commit_offset() >= __atomic_load_n(&g_leader_offset, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&g_caught_up_ms, repl_now_ms(), __ATOMIC_RELAXED);
+        }
+    }
+
+    free(frame);
+}
+
+
+// Thread keeping a connection to the leader, reconnecting and catching up after failures
+static void *repl_follower_thread(void *arg) {
+    (void)arg;
+#ifdef USE_AESD_CHAR_DEVICE
+    int store_fd = open(g_data_file_path, O_WRONLY);
+#else
+    int store_fd = open(g_data_file_path, O_WRONLY | O_CREAT | O_APPEND, 0666);
+#endif
+    if (store_fd < 0) {
+        perror("Call to open() failed for replication");
+        return NULL;
+    }
+
+    while (!g_exit_flag && !g_repl_stop) {
+        int leader_socket = repl_connect_leader();
+        if (leader_socket != -1) {
+            g_leader_socket = leader_socket;
+            syslog(LOG_INFO, "Connected to replication leader %s:%s", g_leader_host, g_leader_port);
+            repl_follow_session(store_fd);
+            g_leader_connected = false;
+            g_leader_socket = -1;
+            close(leader_socket);
+            if (g_exit_flag || g_repl_stop) {
+                break;
+            }
+            syslog(LOG_WARNING, "Lost replication leader, reconnecting");
+        }
+        g_reconnects++;
+        usleep(REPL_RECONNECT_MS * 1000);
+    }
+
+    close(store_fd);
+    return NULL;
+}
+
+
+int repl_start_follower(const char *leader) {
+    const char *colon = strrchr(leader, ':');
+    if (!colon || colon == leader || (size_t)(colon - leader) >= sizeof(g_leader_host) ||
+            strlen(colon + 1) >= sizeof(g_leader_port)) {
+        fprintf(stderr, "Leader must be given as host:port\n");
+        return -1;
+    }
+    memcpy(g_leader_host, leader, colon - leader);
+    g_leader_host[colon - leader] = '\0';
+    strcpy(g_leader_port, colon + 1);
+
+    g_repl_role = REPL_FOLLOWER;
+    if (placement_thread_create(&g_repl_thread, PLACEMENT_WORKER, "aesd-follower", repl_follower_thread, NULL) != 0) {
+        perror("Call to pthread_create() failed for replication");
+        return -1;
+    }
+    g_repl_thread_started = true;
+    return 0;
+}
+
+
+void repl_stop(void) {
+    g_repl_stop = 1;
+
+    pthread_mutex_lock(&g_repl_lock);
+    pthread_cond_broadcast(&g_repl_cond);
+    pthread_mutex_unlock(&g_repl_lock);
+
+    if (g_leader_socket != -1) {
+        shutdown(g_leader_socket, SHUT_RDWR);
+    }
+    if (g_repl_thread_started) {
+        pthread_join(g_repl_thread, NULL);
+        g_repl_thread_started = false;
+    }
+    if (g_repl_listener != -1) {
+        close(g_repl_listener);
+        g_repl_listener = -1;
+    }
+
+    free(g_backlog);
+    g_backlog = NULL;
+}
+
+
+size_t repl_format_stats(char *buf, size_t len) {
+    uint64_t commit_offset = repl_commit_offset();
+    int rc = 0;
+
+    if (g_repl_role == REPL_LEADER) {
+        int followers = 0;
+        for (int i = 0; i < REPL_MAX_FOLLOWERS; i++) {
+            if (g_followers[i].in_use && !g_followers[i].is_done) {
+                followers++;
+            }
+        }
+        rc = snprintf(buf, len, "replication_role: leader\nreplication_commit_offset: %" PRIu64
+                      "\nreplication_followers: %d\n", commit_offset, followers);
+    }
+    else if (g_repl_role == REPL_FOLLOWER) {
+        uint64_t leader_offset = __atomic_load_n(&g_leader_offset, __ATOMIC_RELAXED);
+        uint64_t lag_bytes = leader_offset > commit_offset ? leader_offset - commit_offset : 0;
+        uint64_t lag_ms = 0;
+        if (lag_bytes || !g_leader_connected) {
+            uint64_t caught_up_ms = __atomic_load_n(&g_caught_up_ms, __ATOMIC_RELAXED);
+            lag_ms = caught_up_ms ? repl_now_ms() - caught_up_ms : 0;
+        }
+        rc = snprintf(buf, len, "replication_role: follower\nreplication_leader: %s:%s\n"
+                      "replication_connected: %d\nreplication_leader_offset: %" PRIu64
+                      "\nreplication_applied_offset: %" PRIu64 "\nreplication_lag_bytes: %" PRIu64
+                      "\nreplication_lag_ms: %" PRIu64 "\nreplication_resyncs: %" PRIu64
+                      "\nreplication_reconnects: %" PRIu64 "\n",
+                      g_leader_host, g_leader_port, g_leader_connected ? 1 : 0, leader_offset,
+                      commit_offset, lag_bytes, lag_ms, g_resyncs, g_reconnects);
+    }
+
+    if (rc < 0) {
+        return 0;
+    }
+    return (size_t)rc < len ? (size_t)rc : (len ? len - 1 : 0);
+}
@@ -0,0 +1,80 @@
+// Leader/follower replication of the aesdsocket data stream
+// Author: Eric Percin, 10/18/2026
+//
+// Every committed line is also kept in an in-memory backlog addressed by a
+// monotonically increasing stream offset. Offsets restart at 0 with the leader,
+// so each leader run has a random run id naming its stream. A follower connects
+// to the leader's replication port and sends "SYNC <run_id> <offset>\n" with the
+// run id it last synced from, or "-" if none. If the run id is the leader's and
+// it still has that offset it answers "CONTINUE <run_id> <offset>\n", otherwise
+// it sends "SNAPSHOT <run_id> <offset> <length>\n" followed by its whole store.
+// After that it streams "DATA <offset> <length>\n" frames followed by the bytes,
+// and "HEARTBEAT <offset>\n" with its commit offset while idle.
+
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define REPL_BACKLOG_SIZE (1024 * 1024)
+#define REPL_HEARTBEAT_MS 1000
+#define REPL_RECONNECT_MS 1000
+#define REPL_MAX_FOLLOWERS 16
+#define REPL_RUN_ID_LEN 16
+
+enum repl_role {
+    REPL_NONE,
+    REPL_LEADER,
+    REPL_FOLLOWER
+};
+
+extern enum repl_role g_repl_role;
+
+// Advance the commit offset past len committed bytes and wake any waiters. The bytes are only
+// kept in the backlog on a leader or while TAIL clients stream from it.
+// The caller must hold the write lock so offsets match the store order.
+void repl_commit(const char *buf, size_t len);
+
+// Current end of the committed stream
+uint64_t repl_commit_offset(void);
+
+// Restart the committed stream at offset with nothing in the backlog, at startup for a store
+// that already holds offset bytes, or when a follower replaces its store with a snapshot
+void repl_reset(uint64_t offset);
+
+// Copy committed bytes starting at offset into buf. Returns the number of bytes copied,
+// 0 if nothing past offset is committed yet, or -1 if offset already left the backlog.
+ssize_t repl_read_from(uint64_t offset, char *buf, size_t len);
+
+// Wait up to timeout_ms for data past offset. Returns the commit offset.
+uint64_t repl_wait(uint64_t offset, int timeout_ms);
+
+// Read the whole store into a malloc'd buffer together with the matching commit offset.
+// In file mode the write lock is only held to take the size and offset, not for the read.
+// Returns 0 on success, -1 on failure.
+int repl_snapshot(char **buf, size_t *len, uint64_t *offset);
+
+// Send the current store, then stream new commits to client until it disconnects.
+// With resume set, first sends "OK TAIL <offset>\n" with the stream offset of the first byte
+// that follows, skipping what the client already has before stream offset from. A from past
+// the end of the stream is from an earlier history and gets everything.
+// Returns 0 when the client went away, -1 on failure.
+int repl_tail(int client, bool resume, uint64_t from);
+
+// Serve followers on port. Returns 0 on success, -1 on failure.
+int repl_start_leader(int port);
+
+// Follow the leader at "host:port", applying its stream to the local store.
+// Returns 0 on success, -1 on failure.
+int repl_start_follower(const char *leader);
+
+// Stop replication threads
+void repl_stop(void);
+
+// Append replication state (role, offsets, lag) to buf. Returns the bytes written.
+size_t repl_format_stats(char *buf, size_t len);
+
+#endif // REPLICATION_H
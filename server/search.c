@@ -0,0 +1,600 @@
+// Server-side search over the lines of the aesdsocket store
+// Author: Eric Percin, 10/18/2026
+// References: https://man7.org/linux/man-pages/man3/memmem.3.html
+//             https://man7.org/linux/man-pages/man3/regexec.3.html
+//             https://swtch.com/~rsc/regexp/regexp4.html (trigram index)
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <regex.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "aesdsocket.h"
+#include "search.h"
+#include "placement.h"
+
+// Growable reply buffer
+struct search_output {
+    char *buf;
+    size_t len;
+    size_t capacity;
+};
+
+// One slice of the store, starting and ending on line boundaries, scanned by one thread
+struct search_chunk {
+    pthread_t thread_id;
+    const char *store;
+    size_t start;
+    size_t end;
+    const struct search_query *query;
+    const regex_t *regex;
+    struct search_output output;
+    int rc;
+};
+
+// Trigram posting list: ids of the lines containing the trigram, in ascending order
+struct ngram_posting {
+    uint32_t key;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *lines;
+    struct ngram_posting *next;
+};
+
+// Location of an indexed line in the store, length includes the newline
+struct index_line {
+    uint64_t offset;
+    uint32_t length;
+};
+
+static pthread_rwlock_t g_index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static bool g_index_enabled = false;
+static int g_index_fd = -1;
+static struct ngram_posting **g_buckets = NULL;
+static struct index_line *g_lines = NULL;
+static uint32_t g_line_count = 0;
+static uint32_t g_line_capacity = 0;
+// Store offset where the line currently held in g_partial starts
+static uint64_t g_line_offset = 0;
+static char *g_partial = NULL;
+static size_t g_partial_length = 0;
+static size_t g_partial_capacity = 0;
+
+
+// Helper function to append to a reply, returns -1 if out of memory
+static int output_append(struct search_output *output, const char *buf, size_t len) {
+    // Nothing to copy, and output->buf may still be NULL
+    if (len == 0) {
+        return 0;
+    }
+    if (output->len + len > output->capacity) {
+        size_t capacity = output->capacity ? output->capacity : INITIAL_BUFFER_SIZE;
+        while (capacity < output->len + len) {
+            capacity *= 2;
+        }
+        char *bigger_buf = realloc(output->buf, capacity);
+        if (!bigger_buf) {
+            perror("Call to realloc() failed for search");
+            return -1;
+        }
+        output->buf = bigger_buf;
+        output->capacity = capacity;
+    }
+    memcpy(output->buf + output->len, buf, len);
+    output->len += len;
+    return 0;
+}
+
+
+// Helper function to add one matching line (with or without its newline) to a reply
+static int output_line(struct search_output *output, const struct search_query *query,
+                       uint64_t offset, const char *line, size_t len) {
+    if (query->with_offsets) {
+        char offset_buf[32];
+        int offset_length = snprintf(offset_buf, sizeof(offset_buf), "%" PRIu64 ":", offset);
+        if (output_append(output, offset_buf, offset_length) < 0) {
+            return -1;
+        }
+    }
+    if (output_append(output, line, len) < 0) {
+        return -1;
+    }
+    // The store's last line may not be terminated yet
+    if (len == 0 || line[len - 1] != '\n') {
+        return output_append(output, "\n", 1);
+    }
+    return 0;
+}
+
+
+int search_parse(const char *command, size_t len, struct search_query *query) {
+    const char *colon = memchr(command, ':', len);
+    const char *newline = memchr(command, '\n', len);
+
+    if (!colon || !newline || colon > newline) {
+        return -1;
+    }
+
+    query->regex = false;
+    query->with_offsets = false;
+    for (const char *flag = command; flag < colon; flag++) {
+        if (*flag == 'r') {
+            query->regex = true;
+        }
+        else if (*flag == 'o') {
+            query->with_offsets = true;
+        }
+        else {
+            return -1;
+        }
+    }
+
+    query->pattern = colon + 1;
+    query->pattern_length = newline - (colon + 1);
+    return 0;
+}
+
+
+// Helper function to scan one chunk for a substring. memmem and memchr are the
+// SIMD implementations in glibc, so each line is only visited where a match starts.
+static int search_chunk_substring(struct search_chunk *chunk) {
+    const char *position = chunk->store + chunk->start;
+    const char *end = chunk->store + chunk->end;
+    const struct search_query *query = chunk->query;
+
+    // position is always at the start of a line here
+    while (position < end) {
+        const char *match = memmem(position, end - position, query->pattern, query->pattern_length);
+        if (!match) {
+            break;
+        }
+        const char *line_start = memrchr(position, '\n', match - position);
+        line_start = line_start ? line_start + 1 : position;
+        const char *line_end = memchr(match, '\n', end - match);
+        line_end = line_end ? line_end + 1 : end;
+
+        if (output_line(&chunk->output, query, line_start - chunk->store, line_start, line_end - line_start) < 0) {
+            return -1;
+        }
+        position = line_end;
+    }
+    return 0;
+}
+
+
+// Helper function to scan one chunk line by line for a regex
+static int search_chunk_regex(struct search_chunk *chunk) {
+    const char *position = chunk->store + chunk->start;
+    const char *end = chunk->store + chunk->end;
+
+    while (position < end) {
+        const char *line_end = memchr(position, '\n', end - position);
+        size_t text_length = line_end ? (size_t)(line_end - position) : (size_t)(end - position);
+        size_t line_length = line_end ? text_length + 1 : text_length;
+
+        // REG_STARTEND matches in place, without copying each line to terminate it
+        regmatch_t bounds = { .rm_so = 0, .rm_eo = text_length };
+        if (regexec(chunk->regex, position, 1, &bounds, REG_STARTEND) == 0) {
+            if (output_line(&chunk->output, chunk->query, position - chunk->store, position, line_length) < 0) {
+                return -1;
+            }
+        }
+        position += line_length;
+    }
+    return 0;
+}
+
+
+static void *search_chunk_thread(void *arg) {
+    struct search_chunk *chunk = arg;
+    if (chunk->query->regex) {
+        chunk->rc = search_chunk_regex(chunk);
+    }
+    else {
+        chunk->rc = search_chunk_substring(chunk);
+    }
+    return NULL;
+}
+
+
+int search_store(const char *store, size_t len, const struct search_query *query, char **reply, size_t *reply_len) {
+    struct search_chunk chunks[SEARCH_MAX_THREADS];
+    regex_t regex;
+    int chunk_count, rc = 0;
+
+    if (query->regex) {
+        char *pattern = strndup(query->pattern, query->pattern_length);
+        if (!pattern) {
+            return -1;
+        }
+        rc = regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB);
+        free(pattern);
+        if (rc != 0) {
+            syslog(LOG_WARNING, "Invalid search regex");
+            return -1;
+        }
+    }
+
+    // One thread per SEARCH_CHUNK_MIN bytes, bounded by the CPUs we have
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    chunk_count = len / SEARCH_CHUNK_MIN > SEARCH_MAX_THREADS ? SEARCH_MAX_THREADS : (int)(len / SEARCH_CHUNK_MIN);
+    if (cpus > 0 && chunk_count > cpus) {
+        chunk_count = cpus;
+    }
+    if (chunk_count < 1) {
+        chunk_count = 1;
+    }
+
+    // Split on line boundaries so no line is seen by two threads
+    size_t start = 0;
+    for (int i = 0; i < chunk_count; i++) {
+        size_t end = len;
+        if (i < chunk_count - 1) {
+            end = len / chunk_count * (i + 1);
+            if (end < start) {
+                end = start;
+            }
+            const char *newline = memchr(store + end, '\n', len - end);
+            end = newline ? (size_t)(newline - store) + 1 : len;
+        }
+        chunks[i] = (struct search_chunk) {
+            .store = store,
+            .start = start,
+            .end = end,
+            .query = query,
+            .regex = &regex,
+        };
+        start = end;
+    }
+
+    for (int i = 1; i < chunk_count; i++) {
+        if (placement_thread_create(&chunks[i].thread_id, PLACEMENT_WORKER, "aesd-search", search_chunk_thread, &chunks[i]) != 0) {
+            // Fall back to scanning it ourselves
+            chunks[i].thread_id = 0;
+        }
+    }
+    search_chunk_thread(&chunks[0]);
+
+    struct search_output output = { 0 };
+    for (int i = 0; i < chunk_count; i++) {
+        if (i > 0) {
+            if (chunks[i].thread_id) {
+                pthread_join(chunks[i].thread_id, NULL);
+            }
+            else {
+                search_chunk_thread(&chunks[i]);
+            }
+        }
+        if (chunks[i].rc < 0 || (chunks[i].output.len && output_append(&output, chunks[i].output.buf, chunks[i].output.len) < 0)) {
+            rc = -1;
+        }
+        free(chunks[i].output.buf);
+    }
+
+    if (query->regex) {
+        regfree(&regex);
+    }
+
+    if (rc < 0) {
+        free(output.buf);
+        return -1;
+    }
+    *reply = output.buf;
+    *reply_len = output.len;
+    return 0;
+}
+
+
+// Helper function to hash a trigram into a bucket
+static uint32_t ngram_bucket(uint32_t key) {
+    return (key * 2654435761u) >> (32 - 16);
+}
+
+
+static uint32_t ngram_key(const char *text) {
+    return ((uint32_t)(unsigned char)text[0] << 16) | ((uint32_t)(unsigned char)text[1] << 8) |
+           (uint32_t)(unsigned char)text[2];
+}
+
+
+static struct ngram_posting *ngram_find(uint32_t key) {
+    struct ngram_posting *posting = g_buckets[ngram_bucket(key)];
+    while (posting && posting->key != key) {
+        posting = posting->next;
+    }
+    return posting;
+}
+
+
+// Helper function to add a complete line to the index, returns -1 if out of memory
+static int index_line(const char *text, size_t len, uint64_t offset, size_t line_length) {
+    if (g_line_count == g_line_capacity) {
+        uint32_t capacity = g_line_capacity ? g_line_capacity * 2 : 1024;
+        struct index_line *bigger_lines = realloc(g_lines, capacity * sizeof(struct index_line));
+        if (!bigger_lines) {
+            return -1;
+        }
+        g_lines = bigger_lines;
+        g_line_capacity = capacity;
+    }
+    uint32_t line_id = g_line_count++;
+    g_lines[line_id].offset = offset;
+    g_lines[line_id].length = line_length;
+
+    for (size_t i = 0; i + 3 <= len; i++) {
+        uint32_t key = ngram_key(text + i);
+        struct ngram_posting *posting = ngram_find(key);
+        if (!posting) {
+            posting = calloc(1, sizeof(struct ngram_posting));
+            if (!posting) {
+                return -1;
+            }
+            posting->key = key;
+            posting->next = g_buckets[ngram_bucket(key)];
+            g_buckets[ngram_bucket(key)] = posting;
+        }
+        // A trigram repeated within the line is only listed once
+        if (posting->count && posting->lines[posting->count - 1] == line_id) {
+            continue;
+        }
+        if (posting->count == posting->capacity) {
+            uint32_t capacity = posting->capacity ? posting->capacity * 2 : 4;
+            uint32_t *bigger_list = realloc(posting->lines, capacity * sizeof(uint32_t));
+            if (!bigger_list) {
+                return -1;
+            }
+            posting->lines = bigger_list;
+            posting->capacity = capacity;
+        }
+        posting->lines[posting->count++] = line_id;
+    }
+    return 0;
+}
+
+
+// Helper function to drop everything indexed so far
+static void index_clear(void) {
+    if (g_buckets) {
+        for (int i = 0; i < SEARCH_NGRAM_BUCKETS; i++) {
+            struct ngram_posting *posting = g_buckets[i];
+            while (posting) {
+                struct ngram_posting *next = posting->next;
+                free(posting->lines);
+                free(posting);
+                posting = next;
+            }
+            g_buckets[i] = NULL;
+        }
+    }
+    free(g_lines);
+    g_lines = NULL;
+    g_line_count = g_line_capacity = 0;
+    g_line_offset = 0;
+    g_partial_length = 0;
+}
+
+
+// Helper function for the append path, with the index write lock held
+static int index_append_locked(const char *buf, size_t len) {
+    while (len > 0) {
+        const char *newline = memchr(buf, '\n', len);
+        size_t take = newline ? (size_t)(newline - buf) + 1 : len;
+
+        if (g_partial_length == 0 && newline) {
+            // Whole line in one piece, index it in place
+            if (index_line(buf, take - 1, g_line_offset, take) < 0) {
+                return -1;
+            }
+            g_line_offset += take;
+        }
+        else {
+            // Hold on to an unterminated line until its newline arrives
+            if (g_partial_length + take > g_partial_capacity) {
+                size_t capacity = g_partial_capacity ? g_partial_capacity : INITIAL_BUFFER_SIZE;
+                while (capacity < g_partial_length + take) {
+                    capacity *= 2;
+                }
+                char *bigger_partial = realloc(g_partial, capacity);
+                if (!bigger_partial) {
+                    return -1;
+                }
+                g_partial = bigger_partial;
+                g_partial_capacity = capacity;
+            }
+            memcpy(g_partial + g_partial_length, buf, take);
+            g_partial_length += take;
+            if (newline) {
+                if (index_line(g_partial, g_partial_length - 1, g_line_offset, g_partial_length) < 0) {
+                    return -1;
+                }
+                g_line_offset += g_partial_length;
+                g_partial_length = 0;
+            }
+        }
+        buf += take;
+        len -= take;
+    }
+    return 0;
+}
+
+
+void search_index_append(const char *buf, size_t len) {
+    pthread_rwlock_wrlock(&g_index_lock);
+    if (g_index_enabled && index_append_locked(buf, len) < 0) {
+        // Queries still work by scanning
+        syslog(LOG_ERR, "Out of memory for the search index, disabling it");
+        g_index_enabled = false;
+        index_clear();
+    }
+    pthread_rwlock_unlock(&g_index_lock);
+}
+
+
+void search_index_reset(void) {
+    pthread_rwlock_wrlock(&g_index_lock);
+    index_clear();
+    pthread_rwlock_unlock(&g_index_lock);
+}
+
+
+int search_index_init(const char *path) {
+    char read_buf[16384];
+    ssize_t bytes_read;
+
+    g_buckets = calloc(SEARCH_NGRAM_BUCKETS, sizeof(struct ngram_posting *));
+    if (!g_buckets) {
+        perror("Call to calloc() failed for search index");
+        return -1;
+    }
+
+    // Candidates are checked against the store itself, so no line text is duplicated in memory
+    g_index_fd = open(path, O_RDONLY | O_CREAT | O_CLOEXEC, 0666);
+    if (g_index_fd < 0) {
+        perror("Call to open() failed for search index");
+        free(g_buckets);
+        g_buckets = NULL;
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&g_index_lock);
+    g_index_enabled = true;
+    while ((bytes_read = read(g_index_fd, read_buf, sizeof(read_buf))) > 0) {
+        if (index_append_locked(read_buf, bytes_read) < 0) {
+            g_index_enabled = false;
+            index_clear();
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&g_index_lock);
+
+    return g_index_enabled ? 0 : -1;
+}
+
+
+// Helper function to keep the entries of candidates that also appear in list, both ascending
+static uint32_t intersect(uint32_t *candidates, uint32_t count, const struct ngram_posting *posting) {
+    uint32_t kept = 0, j = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        while (j < posting->count && posting->lines[j] < candidates[i]) {
+            j++;
+        }
+        if (j == posting->count) {
+            break;
+        }
+        if (posting->lines[j] == candidates[i]) {
+            candidates[kept++] = candidates[i];
+        }
+    }
+    return kept;
+}
+
+
+int search_index_query(const struct search_query *query, char **reply, size_t *reply_len) {
+    struct search_output output = { 0 };
+    uint32_t *candidates = NULL;
+    uint32_t candidate_count = 0;
+    const struct ngram_posting *smallest = NULL;
+    char *line_buf = NULL;
+    int rc = 0;
+
+    // Regexes and patterns shorter than a trigram need the full scan
+    if (query->regex || query->pattern_length < 3) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&g_index_lock);
+    if (!g_index_enabled) {
+        pthread_rwlock_unlock(&g_index_lock);
+        return -1;
+    }
+
+    // Start from the rarest trigram, a missing one means no indexed line can match
+    bool missing = false;
+    for (size_t i = 0; i + 3 <= query->pattern_length; i++) {
+        const struct ngram_posting *posting = ngram_find(ngram_key(query->pattern + i));
+        if (!posting) {
+            missing = true;
+            break;
+        }
+        if (!smallest || posting->count < smallest->count) {
+            smallest = posting;
+        }
+    }
+
+    if (!missing && smallest) {
+        candidates = malloc(smallest->count * sizeof(uint32_t));
+        if (!candidates) {
+            rc = -1;
+            goto out;
+        }
+        memcpy(candidates, smallest->lines, smallest->count * sizeof(uint32_t));
+        candidate_count = smallest->count;
+        for (size_t i = 0; i + 3 <= query->pattern_length && candidate_count; i++) {
+            const struct ngram_posting *posting = ngram_find(ngram_key(query->pattern + i));
+            if (posting != smallest) {
+                candidate_count = intersect(candidates, candidate_count, posting);
+            }
+        }
+    }
+
+    // Trigrams only narrow it down, confirm each candidate against the store
+    for (uint32_t i = 0; i < candidate_count; i++) {
+        const struct index_line *line = &g_lines[candidates[i]];
+        char *bigger_line_buf = realloc(line_buf, line->length);
+        if (!bigger_line_buf) {
+            rc = -1;
+            goto out;
+        }
+        line_buf = bigger_line_buf;
+        if (pread(g_index_fd, line_buf, line->length, line->offset) != (ssize_t)line->length) {
+            rc = -1;
+            goto out;
+        }
+        if (memmem(line_buf, line->length, query->pattern, query->pattern_length) &&
+                output_line(&output, query, line->offset, line_buf, line->length) < 0) {
+            rc = -1;
+            goto out;
+        }
+    }
+
+    // The unterminated last line isn't indexed yet
+    if (g_partial_length && memmem(g_partial, g_partial_length, query->pattern, query->pattern_length) &&
+            output_line(&output, query, g_line_offset, g_partial, g_partial_length) < 0) {
+        rc = -1;
+    }
+
+out:
+    pthread_rwlock_unlock(&g_index_lock);
+    free(candidates);
+    free(line_buf);
+    if (rc < 0) {
+        free(output.buf);
+        return -1;
+    }
+    *reply = output.buf;
+    *reply_len = output.len;
+    return 0;
+}
+
+
+void search_index_free(void) {
+    pthread_rwlock_wrlock(&g_index_lock);
+    g_index_enabled = false;
+    index_clear();
+    free(g_buckets);
+    g_buckets = NULL;
+    free(g_partial);
+    g_partial = NULL;
+    g_partial_capacity = 0;
+    if (g_index_fd != -1) {
+        close(g_index_fd);
+        g_index_fd = -1;
+    }
+    pthread_rwlock_unlock(&g_index_lock);
+}
@@ -0,0 +1,54 @@
+// Server-side search over the lines of the aesdsocket store
+// Author: Eric Percin, 10/18/2026
+//
+// Queries arrive as "AESDSOCKET_SEARCH:<flags>:<pattern>\n" where flags is any
+// combination of 'r' (pattern is a POSIX extended regex instead of a substring)
+// and 'o' (prefix each matching line with its byte offset in the store and ':').
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SEARCH_PREFIX "AESDSOCKET_SEARCH:"
+
+// Stores smaller than this per thread are scanned by a single thread
+#define SEARCH_CHUNK_MIN (256 * 1024)
+#define SEARCH_MAX_THREADS 8
+
+// Hash buckets of the trigram index
+#define SEARCH_NGRAM_BUCKETS 65536
+
+struct search_query {
+    const char *pattern;
+    size_t pattern_length;
+    bool regex;
+    bool with_offsets;
+};
+
+// Parse the part of a search command after SEARCH_PREFIX, up to its newline.
+// pattern points into command. Returns 0 on success, -1 if malformed.
+int search_parse(const char *command, size_t len, struct search_query *query);
+
+// Scan store (len bytes, in parallel for large stores) for lines matching query.
+// On success *reply is a malloc'd buffer of the matching lines. Returns 0 or -1.
+int search_store(const char *store, size_t len, const struct search_query *query, char **reply, size_t *reply_len);
+
+// Keep a trigram index of the file store at path, indexing what it already holds.
+// Returns 0 on success, -1 on failure.
+int search_index_init(const char *path);
+
+// Index len bytes just appended to the store. The caller holds the write lock.
+void search_index_append(const char *buf, size_t len);
+
+// Forget everything, the store was truncated. The caller holds the write lock.
+void search_index_reset(void);
+
+// Answer a substring query from the index. Returns 0 with *reply set when the index
+// could answer it, or -1 if the query has to be scanned instead.
+int search_index_query(const struct search_query *query, char **reply, size_t *reply_len);
+
+void search_index_free(void);
+
+#endif // SEARCH_H
@@ -0,0 +1,124 @@
+// Connection and traffic counters for aesdsocket
+// Author: Eric Percin, 10/18/2026
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include "stats.h"
+
+static struct aesd_stats g_fallback_stats;
+static struct aesd_stats *g_stats_slots = NULL;
+struct aesd_stats *g_stats = &g_fallback_stats;
+
+
+int stats_init(void) {
+    // Shared anonymous mapping survives fork, so the prefork master sees worker updates
+    g_stats_slots = mmap(NULL, STATS_MAX_SLOTS * sizeof(struct aesd_stats), PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (g_stats_slots == MAP_FAILED) {
+        perror("Call to mmap() failed for stats");
+        g_stats_slots = NULL;
+        return -1;
+    }
+    stats_use_slot(0);
+    return 0;
+}
+
+
+void stats_use_slot(int slot) {
+    struct aesd_stats *my_slot = stats_slot(slot);
+    if (!my_slot) {
+        return;
+    }
+    // Totals from a dead worker are kept, only the pid changes
+    __atomic_store_n(&my_slot->pid, getpid(), __ATOMIC_RELAXED);
+    g_stats = my_slot;
+}
+
+
+struct aesd_stats *stats_slot(int slot) {
+    if (!g_stats_slots || slot < 0 || slot >= STATS_MAX_SLOTS) {
+        return NULL;
+    }
+    return &g_stats_slots[slot];
+}
+
+
+// Helper function to append formatted text without overrunning buf
+static void stats_append(char *buf, size_t len, size_t *used, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static void stats_append(char *buf, size_t len, size_t *used, const char *fmt, ...) {
+    va_list args;
+    int rc;
+
+    if (*used >= len) {
+        return;
+    }
+    va_start(args, fmt);
+    rc = vsnprintf(buf + *used, len - *used, fmt, args);
+    va_end(args);
+    if (rc > 0) {
+        *used += ((size_t)rc < len - *used) ? (size_t)rc : len - *used - 1;
+    }
+}
+
+
+size_t stats_format(char *buf, size_t len) {
+    struct aesd_stats total;
+    size_t used = 0;
+    int active = 0;
+
+    if (len == 0) {
+        return 0;
+    }
+    buf[0] = '\0';
+
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < STATS_MAX_SLOTS; i++) {
+        struct aesd_stats *slot = stats_slot(i);
+        if (!slot || !slot->pid) {
+            continue;
+        }
+        active++;
+        total.connections += __atomic_load_n(&slot->connections, __ATOMIC_RELAXED);
+        total.commands += __atomic_load_n(&slot->commands, __ATOMIC_RELAXED);
+        total.bytes_received += __atomic_load_n(&slot->bytes_received, __ATOMIC_RELAXED);
+        total.bytes_sent += __atomic_load_n(&slot->bytes_sent, __ATOMIC_RELAXED);
+        total.errors += __atomic_load_n(&slot->errors, __ATOMIC_RELAXED);
+        total.restarts += __atomic_load_n(&slot->restarts, __ATOMIC_RELAXED);
+        total.throttled += __atomic_load_n(&slot->throttled, __ATOMIC_RELAXED);
+        total.idle_timeouts += __atomic_load_n(&slot->idle_timeouts, __ATOMIC_RELAXED);
+        total.read_timeouts += __atomic_load_n(&slot->read_timeouts, __ATOMIC_RELAXED);
+        total.lifetime_timeouts += __atomic_load_n(&slot->lifetime_timeouts, __ATOMIC_RELAXED);
+        total.commit_batches += __atomic_load_n(&slot->commit_batches, __ATOMIC_RELAXED);
+    }
+
+    stats_append(buf, len, &used, "processes: %d\n", active);
+    stats_append(buf, len, &used, "connections: %" PRIu64 "\n", total.connections);
+    stats_append(buf, len, &used, "commands: %" PRIu64 "\n", total.commands);
+    stats_append(buf, len, &used, "bytes_received: %" PRIu64 "\n", total.bytes_received);
+    stats_append(buf, len, &used, "bytes_sent: %" PRIu64 "\n", total.bytes_sent);
+    stats_append(buf, len, &used, "errors: %" PRIu64 "\n", total.errors);
+    stats_append(buf, len, &used, "restarts: %" PRIu64 "\n", total.restarts);
+    stats_append(buf, len, &used, "throttled: %" PRIu64 "\n", total.throttled);
+    stats_append(buf, len, &used, "idle_timeouts: %" PRIu64 "\n", total.idle_timeouts);
+    stats_append(buf, len, &used, "read_timeouts: %" PRIu64 "\n", total.read_timeouts);
+    stats_append(buf, len, &used, "lifetime_timeouts: %" PRIu64 "\n", total.lifetime_timeouts);
+    stats_append(buf, len, &used, "commit_batches: %" PRIu64 "\n", total.commit_batches);
+
+    for (int i = 1; i < STATS_MAX_SLOTS; i++) {
+        struct aesd_stats *slot = stats_slot(i);
+        if (!slot || !slot->pid) {
+            continue;
+        }
+        stats_append(buf, len, &used, "worker %d: pid %d connections %" PRIu64 " commands %" PRIu64
+                     " restarts %" PRIu64 "\n", i, (int)slot->pid, slot->connections, slot->commands,
+                     slot->restarts);
+    }
+
+    return used;
+}
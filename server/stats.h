@@ -0,0 +1,49 @@
+// Connection and traffic counters for aesdsocket
+// Author: Eric Percin, 10/18/2026
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Slot 0 is the single process (or prefork master), slots 1..N are prefork workers
+#define STATS_MAX_SLOTS 65
+
+// Counters for one process, kept in shared memory so the prefork master can aggregate them
+struct aesd_stats {
+    pid_t pid;
+    uint64_t connections;
+    uint64_t commands;
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    uint64_t errors;
+    uint64_t restarts;
+    uint64_t throttled;     // times a client was held back by its rate limit
+    uint64_t idle_timeouts;
+    uint64_t read_timeouts;
+    uint64_t lifetime_timeouts;
+    uint64_t commit_batches;    // writes done by the commit thread, each covering one or more lines
+};
+
+// Counters of the calling process
+extern struct aesd_stats *g_stats;
+
+#define STATS_ADD(field, n) __atomic_fetch_add(&g_stats->field, (n), __ATOMIC_RELAXED)
+
+// Map the shared counter slots and select slot 0. Returns 0 on success, -1 on failure.
+int stats_init(void);
+
+// Select the slot the calling process updates and record its pid there. Totals left by
+// a dead worker in the slot are kept
+void stats_use_slot(int slot);
+
+// Return a slot, or NULL if slot is out of range
+struct aesd_stats *stats_slot(int slot);
+
+// Write the totals across all slots followed by one line per active slot into buf.
+// Returns the number of bytes written (excluding the terminator).
+size_t stats_format(char *buf, size_t len);
+
+#endif // STATS_H
@@ -0,0 +1,288 @@
+// Connection timeouts for aesdsocket, tracked on a hierarchical timer wheel
+// Author: Eric Percin, 10/18/2026
+// References: http://www.cs.columbia.edu/~nahum/w6998/papers/sosp87-timing-wheels.pdf
+//             https://lwn.net/Articles/152436/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "aesdsocket.h"
+#include "timerwheel.h"
+#include "stats.h"
+#include "placement.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+// Half the range of the top level, so a clamped timer still lands ahead of the current slot
+#define TIMER_WHEEL_MAX_TICKS (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS - 1))
+
+static pthread_mutex_t g_wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct conn_timer *g_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+// Next tick to be processed, starts at 1 so 0 can mean "not armed"
+static uint64_t g_wheel_now = 1;
+static uint64_t g_wheel_start_ms;
+static uint64_t g_idle_ticks = TIMER_DEFAULT_IDLE_SEC * 1000 / TIMER_WHEEL_TICK_MS;
+static uint64_t g_read_ticks = TIMER_DEFAULT_READ_SEC * 1000 / TIMER_WHEEL_TICK_MS;
+static uint64_t g_lifetime_ticks = TIMER_DEFAULT_LIFETIME_SEC * 1000 / TIMER_WHEEL_TICK_MS;
+static pthread_t g_wheel_thread;
+static bool g_wheel_running = false;
+static volatile bool g_wheel_stop = false;
+
+
+static uint64_t timer_wheel_now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+// Helper function to file timer in the slot for its expiry, with g_wheel_lock held
+static void timer_wheel_insert(struct conn_timer *timer, uint64_t expires) {
+    struct conn_timer **slot;
+    int level = 0;
+
+    // Already due: the slot processed on the next tick
+    if (expires < g_wheel_now) {
+        expires = g_wheel_now;
+    }
+    if (expires - g_wheel_now > TIMER_WHEEL_MAX_TICKS) {
+        expires = g_wheel_now + TIMER_WHEEL_MAX_TICKS;
+    }
+
+    // The lowest level where the expiry is less than a full rotation of slots away,
+    // so it never lands in a slot that has already been cascaded this rotation
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           (expires >> (TIMER_WHEEL_BITS * level)) - (g_wheel_now >> (TIMER_WHEEL_BITS * level)) >= TIMER_WHEEL_SIZE) {
+        level++;
+    }
+    slot = &g_wheel[level][(expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+
+    timer->expires = expires;
+    timer->next = *slot;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+
+// Helper function to take timer off the wheel, with g_wheel_lock held
+static void timer_wheel_unlink(struct conn_timer *timer) {
+    if (!timer->pprev) {
+        return;
+    }
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+}
+
+
+// Helper function for the earliest armed deadline, 0 if none
+static uint64_t conn_timer_earliest(const struct conn_timer *timer) {
+    uint64_t earliest = 0;
+    const uint64_t deadlines[] = { timer->idle_deadline, timer->read_deadline, timer->lifetime_deadline };
+    for (size_t i = 0; i < sizeof(deadlines) / sizeof(deadlines[0]); i++) {
+        if (deadlines[i] && (!earliest || deadlines[i] < earliest)) {
+            earliest = deadlines[i];
+        }
+    }
+    return earliest;
+}
+
+
+// Helper function to refile timer after its deadlines changed, with g_wheel_lock held.
+// Later deadlines are picked up lazily when the timer fires.
+static void conn_timer_reschedule(struct conn_timer *timer) {
+    uint64_t earliest = conn_timer_earliest(timer);
+    if (earliest && (!timer->expires || earliest < timer->expires)) {
+        timer_wheel_unlink(timer);
+        timer_wheel_insert(timer, earliest);
+    }
+}
+
+
+// Helper function to move the timers of one upper level slot down to where they now belong
+static void timer_wheel_cascade(int level, int index) {
+    struct conn_timer *timer = g_wheel[level][index];
+    g_wheel[level][index] = NULL;
+    while (timer) {
+        struct conn_timer *next = timer->next;
+        timer->next = NULL;
+        timer->pprev = NULL;
+        timer_wheel_insert(timer, timer->expires);
+        timer = next;
+    }
+}
+
+
+// Helper function to close the connection of a timer whose deadline passed
+static void conn_timer_fire(struct conn_timer *timer) {
+    uint64_t now = g_wheel_now;
+
+    if (timer->lifetime_deadline && timer->lifetime_deadline <= now) {
+        timer->expired = CONN_TIMEOUT_LIFETIME;
+        STATS_ADD(lifetime_timeouts, 1);
+    }
+    else if (timer->read_deadline && timer->read_deadline <= now) {
+        timer->expired = CONN_TIMEOUT_READ;
+        STATS_ADD(read_timeouts, 1);
+    }
+    else if (timer->idle_deadline && timer->idle_deadline <= now) {
+        timer->expired = CONN_TIMEOUT_IDLE;
+        STATS_ADD(idle_timeouts, 1);
+    }
+    else {
+        // A deadline moved since the timer was filed
+        uint64_t earliest = conn_timer_earliest(timer);
+        if (earliest) {
+            timer_wheel_insert(timer, earliest);
+        }
+        return;
+    }
+
+    static const char *reasons[] = { "", "idle", "read", "lifetime" };
+    syslog(LOG_INFO, "Closing connection on fd %d after %s timeout", timer->fd, reasons[timer->expired]);
+
+    // The connection's thread sees EOF, cleans up and closes the fd itself
+    if (shutdown(timer->fd, SHUT_RDWR) < 0 && errno != ENOTCONN) {
+        perror("Call to shutdown() failed for timed out connection");
+    }
+}
+
+
+// Helper function to process one tick, with g_wheel_lock held
+static void timer_wheel_tick(void) {
+    int index = g_wheel_now & TIMER_WHEEL_MASK;
+
+    // Every time a level wraps, pull the next slot of the level above down into it
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if ((g_wheel_now >> (TIMER_WHEEL_BITS * (level - 1))) & TIMER_WHEEL_MASK) {
+            break;
+        }
+        timer_wheel_cascade(level, (g_wheel_now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+    }
+
+    struct conn_timer *timer = g_wheel[0][index];
+    g_wheel[0][index] = NULL;
+    g_wheel_now++;
+    while (timer) {
+        struct conn_timer *next = timer->next;
+        timer->next = NULL;
+        timer->pprev = NULL;
+        timer->expires = 0;
+        conn_timer_fire(timer);
+        timer = next;
+    }
+}
+
+
+// Thread function that turns the wheel in step with the monotonic clock
+static void *timer_wheel_thread(void *arg) {
+    (void)arg;
+    while (!g_wheel_stop) {
+        struct timespec delay = { .tv_sec = 0, .tv_nsec = TIMER_WHEEL_TICK_MS * 1000000L };
+        nanosleep(&delay, NULL);
+
+        // Catch up on every tick that passed, a late wakeup must not skip slots
+        uint64_t target = (timer_wheel_now_ms() - g_wheel_start_ms) / TIMER_WHEEL_TICK_MS + 1;
+        pthread_mutex_lock(&g_wheel_lock);
+        while (g_wheel_now <= target) {
+            timer_wheel_tick();
+        }
+        pthread_mutex_unlock(&g_wheel_lock);
+    }
+    return NULL;
+}
+
+
+void timer_wheel_configure(unsigned int idle_sec, unsigned int read_sec, unsigned int lifetime_sec) {
+    pthread_mutex_lock(&g_wheel_lock);
+    g_idle_ticks = (uint64_t)idle_sec * 1000 / TIMER_WHEEL_TICK_MS;
+    g_read_ticks = (uint64_t)read_sec * 1000 / TIMER_WHEEL_TICK_MS;
+    g_lifetime_ticks = (uint64_t)lifetime_sec * 1000 / TIMER_WHEEL_TICK_MS;
+    pthread_mutex_unlock(&g_wheel_lock);
+}
+
+
+int timer_wheel_start(void) {
+    g_wheel_start_ms = timer_wheel_now_ms();
+    g_wheel_now = 1;
+    g_wheel_stop = false;
+    if (placement_thread_create(&g_wheel_thread, PLACEMENT_TIMER, "aesd-timer", timer_wheel_thread, NULL) != 0) {
+        perror("Call to pthread_create() failed for timer wheel");
+        return -1;
+    }
+    g_wheel_running = true;
+    return 0;
+}
+
+
+void timer_wheel_stop(void) {
+    if (!g_wheel_running) {
+        return;
+    }
+    g_wheel_stop = true;
+    pthread_join(g_wheel_thread, NULL);
+    g_wheel_running = false;
+}
+
+
+void conn_timer_add(struct conn_timer *timer, int fd) {
+    memset(timer, 0, sizeof(struct conn_timer));
+    timer->fd = fd;
+
+    pthread_mutex_lock(&g_wheel_lock);
+    if (g_idle_ticks) {
+        timer->idle_deadline = g_wheel_now + g_idle_ticks;
+    }
+    if (g_lifetime_ticks) {
+        timer->lifetime_deadline = g_wheel_now + g_lifetime_ticks;
+    }
+    conn_timer_reschedule(timer);
+    pthread_mutex_unlock(&g_wheel_lock);
+}
+
+
+void conn_timer_activity(struct conn_timer *timer, bool line_pending) {
+    pthread_mutex_lock(&g_wheel_lock);
+    if (g_idle_ticks) {
+        timer->idle_deadline = g_wheel_now + g_idle_ticks;
+    }
+    // The read deadline runs from the first byte of the line, not the latest one
+    if (!line_pending) {
+        timer->read_deadline = 0;
+    }
+    else if (g_read_ticks && !timer->read_deadline) {
+        timer->read_deadline = g_wheel_now + g_read_ticks;
+    }
+    conn_timer_reschedule(timer);
+    pthread_mutex_unlock(&g_wheel_lock);
+}
+
+
+void conn_timer_replying(struct conn_timer *timer) {
+    pthread_mutex_lock(&g_wheel_lock);
+    timer->idle_deadline = 0;
+    timer->read_deadline = 0;
+    if (!timer->lifetime_deadline) {
+        timer_wheel_unlink(timer);
+    }
+    pthread_mutex_unlock(&g_wheel_lock);
+}
+
+
+enum conn_timeout conn_timer_remove(struct conn_timer *timer) {
+    pthread_mutex_lock(&g_wheel_lock);
+    timer_wheel_unlink(timer);
+    enum conn_timeout expired = timer->expired;
+    pthread_mutex_unlock(&g_wheel_lock);
+    return expired;
+}
@@ -0,0 +1,72 @@
+// Connection timeouts for aesdsocket, tracked on a hierarchical timer wheel
+// Author: Eric Percin, 10/18/2026
+// References: http://www.cs.columbia.edu/~nahum/w6998/papers/sosp87-timing-wheels.pdf
+//             https://lwn.net/Articles/152436/
+//
+// Every connection has up to three deadlines:
+//   idle     - nothing received for this long
+//   read     - a line was started but its newline hasn't arrived this long after
+//   lifetime - the connection has been open this long, whatever it is doing
+// A timer is only filed under its earliest deadline. Activity that pushes a deadline
+// later doesn't touch the wheel, the timer is refiled when it fires instead, so the
+// per-recv cost is constant and each tick only looks at the timers that are due.
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Wheel resolution
+#define TIMER_WHEEL_TICK_MS 100
+
+// 4 levels of 64 slots cover 2^24 ticks (about 19 days at 100 ms)
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+#define TIMER_DEFAULT_IDLE_SEC 60
+#define TIMER_DEFAULT_READ_SEC 30
+#define TIMER_DEFAULT_LIFETIME_SEC 0
+
+enum conn_timeout {
+    CONN_TIMEOUT_NONE = 0,
+    CONN_TIMEOUT_IDLE,
+    CONN_TIMEOUT_READ,
+    CONN_TIMEOUT_LIFETIME
+};
+
+struct conn_timer {
+    int fd;
+    // Deadlines in ticks, 0 when not armed
+    uint64_t idle_deadline;
+    uint64_t read_deadline;
+    uint64_t lifetime_deadline;
+    // Tick the timer is filed under, 0 when not on the wheel
+    uint64_t expires;
+    enum conn_timeout expired;
+    struct conn_timer *next;
+    struct conn_timer **pprev;
+};
+
+// Timeouts in seconds, 0 disables that timeout
+void timer_wheel_configure(unsigned int idle_sec, unsigned int read_sec, unsigned int lifetime_sec);
+
+// Start and stop the thread turning the wheel for this process
+int timer_wheel_start(void);
+void timer_wheel_stop(void);
+
+// Start tracking a new connection on fd
+void conn_timer_add(struct conn_timer *timer, int fd);
+
+// Bytes arrived; line_pending says whether an incomplete line is buffered
+void conn_timer_activity(struct conn_timer *timer, bool line_pending);
+
+// The command is complete and the reply is being sent, only the lifetime still applies
+void conn_timer_replying(struct conn_timer *timer);
+
+// Stop tracking the connection, must be called before its fd is closed.
+// Returns why the connection was timed out, or CONN_TIMEOUT_NONE.
+enum conn_timeout conn_timer_remove(struct conn_timer *timer);
+
+#endif // TIMERWHEEL_H
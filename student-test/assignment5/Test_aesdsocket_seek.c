@@ -0,0 +1,107 @@
+#include "unity.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+// Relative to the base directory unit-test.sh runs the tests from
+#define AESDSOCKET_PATH "server/aesdsocket"
+#define AESDSOCKET_TEST_PORT "9476"
+#define AESDSOCKET_TEST_DATA "/tmp/aesdsocket-seek-test.data"
+
+/**
+* Starts aesdsocket in the foreground on the test port
+* @return its pid, once it accepts connections
+*/
+static pid_t start_aesdsocket(void)
+{
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(atoi(AESDSOCKET_TEST_PORT)) };
+    pid_t pid;
+
+    unlink(AESDSOCKET_TEST_DATA);
+    pid = fork();
+    TEST_ASSERT_TRUE(pid >= 0);
+    if (pid == 0) {
+        freopen("/dev/null", "w", stdout);
+        execl(AESDSOCKET_PATH, AESDSOCKET_PATH, "-P", AESDSOCKET_TEST_PORT, "-D", AESDSOCKET_TEST_DATA, (char *)NULL);
+        _exit(127);
+    }
+
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int attempt = 0; attempt < 50; attempt++) {
+        int probe = socket(AF_INET, SOCK_STREAM, 0);
+        int rc = connect(probe, (struct sockaddr *)&address, sizeof(address));
+        close(probe);
+        if (rc == 0) {
+            return pid;
+        }
+        usleep(100 * 1000);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    TEST_FAIL_MESSAGE("aesdsocket didn't start listening");
+    return -1;
+}
+
+static void stop_aesdsocket(pid_t pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(AESDSOCKET_TEST_DATA);
+}
+
+/**
+* Sends @param command on a new connection and reads the reply into @param reply until the server
+* closes the connection, for at most 2 seconds
+* @return true if the server closed the connection in time
+*/
+static bool exchange(const char *command, char *reply, size_t capacity)
+{
+    struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(atoi(AESDSOCKET_TEST_PORT)) };
+    struct timeval timeout = { .tv_sec = 2, .tv_usec = 0 };
+    size_t length = 0;
+    ssize_t rc;
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    TEST_ASSERT_EQUAL_INT(0, connect(client, (struct sockaddr *)&address, sizeof(address)));
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    TEST_ASSERT_EQUAL_INT((int)strlen(command), (int)send(client, command, strlen(command), 0));
+
+    while ((rc = recv(client, reply + length, capacity - 1 - length, 0)) > 0) {
+        length += rc;
+    }
+    reply[length] = '\0';
+    close(client);
+    return rc == 0;
+}
+
+void test_aesdsocket_malformed_seek_closes_connection()
+{
+    char reply[256];
+    pid_t pid;
+
+    if (access(AESDSOCKET_PATH, X_OK) != 0) {
+        TEST_IGNORE_MESSAGE("Build server/aesdsocket to run this test");
+    }
+    pid = start_aesdsocket();
+
+    // Used to leave the line buffered and handle it again forever, without replying
+    bool closed = exchange("AESDCHAR_IOCSEEKTO:x\n", reply, sizeof(reply));
+    bool replied = strncmp(reply, "ERROR", strlen("ERROR")) == 0;
+    bool served = exchange("after the bad seek\n", reply, sizeof(reply));
+    stop_aesdsocket(pid);
+
+    TEST_ASSERT_TRUE_MESSAGE(closed, "Connection left open after a malformed seek command");
+    TEST_ASSERT_TRUE_MESSAGE(replied, "No ERROR reply to a malformed seek command");
+    TEST_ASSERT_TRUE_MESSAGE(served, "Next connection not served after a malformed seek command");
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("after the bad seek\n", reply, "Next write not stored after a malformed seek command");
+}
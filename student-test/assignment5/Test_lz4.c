@@ -0,0 +1,187 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../server/lz4.h"
+
+#define LZ4_TEST_MAX_INPUT (70 * 1024)
+
+static uint64_t lz4_test_seed = 0x9e3779b97f4a7c15ULL;
+
+/**
+* @return the next value of a xorshift generator, fixed seed so a failure can be reproduced
+*/
+static uint32_t lz4_test_random(void)
+{
+    lz4_test_seed ^= lz4_test_seed << 13;
+    lz4_test_seed ^= lz4_test_seed >> 7;
+    lz4_test_seed ^= lz4_test_seed << 17;
+    return (uint32_t)(lz4_test_seed >> 32);
+}
+
+/**
+* Fills @param buffer with @param len bytes drawn from @param alphabet symbols, so that a small
+* alphabet gives compressible data and 256 gives incompressible data
+*/
+static void lz4_test_fill(char *buffer, size_t len, unsigned int alphabet)
+{
+    for (size_t i = 0; i < len; i++) {
+        buffer[i] = (char)(lz4_test_random() % alphabet);
+    }
+}
+
+/**
+* Compresses @param len bytes of @param input, verifies the block decompresses back to the input
+* and that any smaller output buffer is refused
+*/
+static void lz4_test_roundtrip(const char *input, size_t len)
+{
+    size_t bound = AESD_LZ4_BOUND(len);
+    char *compressed = malloc(bound);
+    // Exactly len bytes, so that writing past the end is caught by the sanitizers
+    char *output = malloc(len ? len : 1);
+    size_t compressed_length;
+    ssize_t output_length;
+
+    TEST_ASSERT_NOT_NULL(compressed);
+    TEST_ASSERT_NOT_NULL(output);
+
+    compressed_length = aesd_lz4_compress(input, len, compressed, bound);
+    TEST_ASSERT_TRUE_MESSAGE(compressed_length > 0, "Input didn't compress within AESD_LZ4_BOUND");
+    TEST_ASSERT_TRUE(compressed_length <= bound);
+
+    output_length = aesd_lz4_decompress(compressed, compressed_length, output, len);
+    TEST_ASSERT_EQUAL_INT_MESSAGE((int)len, (int)output_length, "Decompressed length doesn't match the input");
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(input, output, len, "Decompressed bytes don't match the input");
+
+    if (len > 0) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(-1, (int)aesd_lz4_decompress(compressed, compressed_length, output, len - 1),
+                "Decompressed into a buffer too small for the output");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, (int)aesd_lz4_compress(input, len, compressed, compressed_length - 1),
+                "Compressed into a buffer too small for the block");
+    }
+
+    free(output);
+    free(compressed);
+}
+
+void test_lz4_roundtrip_short_inputs()
+{
+    char input[64];
+
+    // Around the minimum match and the trailing literals the format requires
+    for (size_t len = 0; len <= sizeof(input); len++) {
+        lz4_test_fill(input, len, 2);
+        lz4_test_roundtrip(input, len);
+        memset(input, 'a', len);
+        lz4_test_roundtrip(input, len);
+    }
+}
+
+void test_lz4_roundtrip_random_inputs()
+{
+    char *input = malloc(LZ4_TEST_MAX_INPUT);
+    static const unsigned int alphabets[] = { 1, 2, 4, 26, 256 };
+
+    TEST_ASSERT_NOT_NULL(input);
+    for (int round = 0; round < 100; round++) {
+        size_t len = lz4_test_random() % (LZ4_TEST_MAX_INPUT + 1);
+        lz4_test_fill(input, len, alphabets[round % (sizeof(alphabets) / sizeof(alphabets[0]))]);
+        lz4_test_roundtrip(input, len);
+    }
+    free(input);
+}
+
+void test_lz4_roundtrip_long_lines()
+{
+    char *input = malloc(LZ4_TEST_MAX_INPUT);
+    size_t len = 0;
+
+    TEST_ASSERT_NOT_NULL(input);
+    // Repeated log lines give long matches and literal runs past 15 bytes
+    while (len + 64 < LZ4_TEST_MAX_INPUT) {
+        int line = lz4_test_random() % 8;
+        len += sprintf(input + len, "timestamp:%08d line %d of the aesdsocket log\n", line * 1000, line);
+    }
+    lz4_test_roundtrip(input, len);
+
+    // A repeat further back than the 64 KiB an LZ4 offset can reach must not be matched.
+    // The zeros in between compress to long matches, leaving the first copy in the match table
+    lz4_test_fill(input, 4096, 256);
+    memset(input + 4096, 0, LZ4_TEST_MAX_INPUT - 2 * 4096);
+    memcpy(input + LZ4_TEST_MAX_INPUT - 4096, input, 4096);
+    lz4_test_roundtrip(input, LZ4_TEST_MAX_INPUT);
+    free(input);
+}
+
+void test_lz4_truncated_blocks()
+{
+    char input[4096];
+    char compressed[AESD_LZ4_BOUND(sizeof(input))];
+    char output[sizeof(input)];
+    size_t compressed_length;
+
+    for (size_t i = 0; i < sizeof(input); i++) {
+        input[i] = "abcabdabe\n"[lz4_test_random() % 10];
+    }
+    compressed_length = aesd_lz4_compress(input, sizeof(input), compressed, sizeof(compressed));
+    TEST_ASSERT_TRUE(compressed_length > 0);
+
+    // A cut can fall right after a sequence's literals, which is a valid shorter block.
+    // Anywhere else it must be refused, and never produce bytes that aren't in the input
+    for (size_t len = 0; len < compressed_length; len++) {
+        ssize_t output_length = aesd_lz4_decompress(compressed, len, output, sizeof(output));
+        TEST_ASSERT_TRUE_MESSAGE(output_length < (ssize_t)sizeof(input), "Truncated block decompressed in full");
+        if (output_length >= 0) {
+            TEST_ASSERT_EQUAL_MEMORY_MESSAGE(input, output, output_length, "Truncated block decompressed to other bytes");
+        }
+    }
+}
+
+void test_lz4_malformed_blocks()
+{
+    static const struct {
+        const char *block;
+        size_t len;
+        const char *message;
+    } malformed[] = {
+        { "\x10" "a" "\x00\x00", 4, "Accepted a match offset of 0" },
+        { "\x10" "a" "\x02\x00", 4, "Accepted a match offset before the start of the output" },
+        { "\x10" "a" "\x01", 3, "Accepted a match offset missing a byte" },
+        { "\x50" "abc", 4, "Accepted literals past the end of the block" },
+        { "\xf0", 1, "Accepted a literal length missing its extension" },
+        { "\xf0\xff", 2, "Accepted a literal length extension cut after 255" },
+        { "\x1f" "a" "\x01\x00", 4, "Accepted a match length missing its extension" },
+        { "\x1f" "a" "\x01\x00\xff", 5, "Accepted a match length extension cut after 255" },
+        { "\x1f" "a" "\x01\x00\xff\xff\xff\x10", 8, "Accepted a match longer than the output buffer" },
+    };
+    char output[256];
+
+    for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(-1, (int)aesd_lz4_decompress(malformed[i].block, malformed[i].len, output, sizeof(output)),
+                malformed[i].message);
+    }
+
+    // An overlapping match repeats the bytes it is producing, which is valid
+    TEST_ASSERT_EQUAL_INT(5, (int)aesd_lz4_decompress("\x10" "a" "\x01\x00", 4, output, sizeof(output)));
+    TEST_ASSERT_EQUAL_MEMORY("aaaaa", output, 5);
+    TEST_ASSERT_EQUAL_INT(0, (int)aesd_lz4_decompress("", 0, output, sizeof(output)));
+}
+
+void test_lz4_random_blocks()
+{
+    char block[64];
+    char *output = malloc(256);
+
+    TEST_ASSERT_NOT_NULL(output);
+    // Garbage must be refused or fit in the output, the sanitizers catch anything read or written out of bounds
+    for (int round = 0; round < 100000; round++) {
+        size_t len = lz4_test_random() % sizeof(block);
+        lz4_test_fill(block, len, 256);
+        ssize_t output_length = aesd_lz4_decompress(block, len, output, 256);
+        TEST_ASSERT_TRUE_MESSAGE(output_length >= -1 && output_length <= 256, "Decompressed length out of range");
+    }
+    free(output);
+}
@@ -0,0 +1,351 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+#define TEST_ENTRIES 25
+
+static char entry_text[TEST_ENTRIES][16];
+
+/**
+* @return the size of entry number @param number, entries get different sizes so that
+* their boundaries don't line up with any fixed stride
+*/
+static size_t format_numbered_entry(int number)
+{
+    return snprintf(entry_text[number], sizeof(entry_text[number]), "write%.*s%d\n", number % 4, "xyz", number);
+}
+
+/**
+* Adds entry number @param number to @param buffer
+*/
+static void add_numbered_entry(struct aesd_circular_buffer *buffer, int number)
+{
+    struct aesd_buffer_entry entry;
+
+    format_numbered_entry(number);
+    entry.buffptr = entry_text[number];
+    entry.size = strlen(entry_text[number]);
+    aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+/**
+* Verifies every byte of @param buffer is found at its offset in @param expected, entries start where
+* aesd_circular_buffer_entry_at says they do, and the first byte past the end is not found
+*/
+static void verify_contents(struct aesd_circular_buffer *buffer, const char *expected)
+{
+    size_t length = strlen(expected);
+    size_t entry_offset;
+    size_t char_offset;
+    size_t start;
+    struct aesd_buffer_entry *entry;
+    uint32_t index;
+
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(length, buffer->total_size, "total_size doesn't match the stored entries");
+    for (char_offset = 0; char_offset < length; char_offset++) {
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, &entry_offset);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, "No entry found for an offset within the buffer");
+        TEST_ASSERT_TRUE_MESSAGE(entry_offset < entry->size, "Entry offset past the end of the entry");
+        TEST_ASSERT_EQUAL_CHAR_MESSAGE(expected[char_offset], entry->buffptr[entry_offset],
+                "Wrong byte found for an offset within the buffer");
+    }
+
+    start = 0;
+    for (index = 0; index < buffer->count; index++) {
+        entry = aesd_circular_buffer_entry_at(buffer, index, &char_offset);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, "No entry at an index below count");
+        TEST_ASSERT_EQUAL_UINT32_MESSAGE(start, char_offset, "Entry doesn't start after the previous one");
+        TEST_ASSERT_TRUE_MESSAGE(entry == aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset, &entry_offset),
+                "The first byte of an entry maps to another entry");
+        TEST_ASSERT_EQUAL_UINT32(0, entry_offset);
+        if (char_offset > 0) {
+            TEST_ASSERT_TRUE_MESSAGE(entry != aesd_circular_buffer_find_entry_offset_for_fpos(buffer, char_offset - 1, &entry_offset),
+                    "The last byte of the previous entry maps to this entry");
+        }
+        start += entry->size;
+    }
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_entry_at(buffer, buffer->count, &char_offset),
+            "Found an entry at index count");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(buffer, length, &entry_offset),
+            "Found an entry for the first byte past the end");
+}
+
+/**
+* Builds the concatenation of entries first to last - 1 into @param expected
+*/
+static void expected_contents(char *expected, int first, int last)
+{
+    expected[0] = '\0';
+    for (int number = first; number < last; number++) {
+        strcat(expected, entry_text[number]);
+    }
+}
+
+/**
+* Checks that @param evicted was the oldest entry of @param buffer, at stream offset @param oldest_start,
+* and that it is gone
+*/
+static void verify_evicted(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *evicted,
+            uint64_t oldest_start)
+{
+    TEST_ASSERT_TRUE_MESSAGE(evicted->start == oldest_start, "Evicted entry wasn't the oldest");
+    TEST_ASSERT_TRUE_MESSAGE(buffer->count == 0 || buffer->entry[buffer->out_offs].start == oldest_start + evicted->size,
+            "Evicted entry still the oldest");
+}
+
+/**
+* Changes the capacity of @param buffer the way aesd_resize() in the driver does: slots are allocated
+* only past the inline ones, and aesd_circular_buffer_evict_over_capacity() removes the oldest entries
+* beyond the new capacity first
+*/
+static void resize_buffer(struct aesd_circular_buffer *buffer, uint32_t capacity)
+{
+    struct aesd_buffer_entry *slots = NULL;
+    struct aesd_buffer_entry evicted;
+    uint32_t slot_count = aesd_circular_buffer_slots_for(capacity);
+    uint32_t expected_evictions = buffer->count > capacity ? buffer->count - capacity : 0;
+    uint32_t evictions = 0;
+
+    if (slot_count > AESDCHAR_INLINE_SLOTS) {
+        slots = calloc(slot_count, sizeof(struct aesd_buffer_entry));
+        TEST_ASSERT_NOT_NULL(slots);
+    }
+    while (buffer->count > 0) {
+        uint64_t oldest_start = buffer->entry[buffer->out_offs].start;
+        if (!aesd_circular_buffer_evict_over_capacity(buffer, capacity, &evicted)) {
+            break;
+        }
+        verify_evicted(buffer, &evicted, oldest_start);
+        evictions++;
+    }
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(expected_evictions, evictions, "Wrong number of entries evicted for the capacity");
+    free(aesd_circular_buffer_resize(buffer, slots, capacity));
+    TEST_ASSERT_TRUE_MESSAGE(buffer->entry == (slots ? slots : buffer->inline_entry), "Buffer not using the new slots");
+    TEST_ASSERT_EQUAL_UINT32(slot_count - 1, buffer->mask);
+    TEST_ASSERT_EQUAL_UINT32(capacity, buffer->capacity);
+}
+
+/**
+* Evicts the oldest entries of @param buffer with aesd_circular_buffer_evict_over_budget() until
+* @param incoming more bytes fit in @param budget, the way aesd_enforce_budget() in the driver does
+* @return the number of entries evicted
+*/
+static uint32_t enforce_budget(struct aesd_circular_buffer *buffer, size_t budget, size_t incoming)
+{
+    struct aesd_buffer_entry evicted;
+    uint32_t evictions = 0;
+
+    while (buffer->count > 0) {
+        uint64_t oldest_start = buffer->entry[buffer->out_offs].start;
+        if (!aesd_circular_buffer_evict_over_budget(buffer, budget, incoming, &evicted)) {
+            break;
+        }
+        verify_evicted(buffer, &evicted, oldest_start);
+        evictions++;
+    }
+    TEST_ASSERT_FALSE_MESSAGE(aesd_circular_buffer_evict_over_budget(buffer, budget, incoming, &evicted),
+            "Evicted from an empty buffer");
+    return evictions;
+}
+
+void test_circular_buffer_empty()
+{
+    struct aesd_circular_buffer buffer;
+    size_t offset;
+
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &offset),
+            "Found an entry in an empty buffer");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_entry_at(&buffer, 0, &offset),
+            "Found an entry at index 0 of an empty buffer");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_remove_oldest(&buffer), "Removed an entry from an empty buffer");
+    verify_contents(&buffer, "");
+}
+
+void test_circular_buffer_single_entry()
+{
+    struct aesd_circular_buffer buffer;
+
+    aesd_circular_buffer_init(&buffer);
+    add_numbered_entry(&buffer, 0);
+    verify_contents(&buffer, entry_text[0]);
+
+    // A lone entry that was not the first one written, so it doesn't start at stream offset 0
+    aesd_circular_buffer_remove_oldest(&buffer);
+    add_numbered_entry(&buffer, 1);
+    TEST_ASSERT_EQUAL_UINT32(1, buffer.count);
+    verify_contents(&buffer, entry_text[1]);
+}
+
+void test_circular_buffer_boundaries_after_wraparound()
+{
+    struct aesd_circular_buffer buffer;
+    char expected[TEST_ENTRIES * sizeof(entry_text[0])];
+
+    aesd_circular_buffer_init(&buffer);
+    // Past the capacity and past the number of slots, so both out_offs and the slot index wrap
+    for (int number = 0; number < TEST_ENTRIES; number++) {
+        add_numbered_entry(&buffer, number);
+        int first = number + 1 > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED ?
+                number + 1 - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED : 0;
+        expected_contents(expected, first, number + 1);
+        verify_contents(&buffer, expected);
+    }
+    TEST_ASSERT_TRUE(buffer.full);
+    TEST_ASSERT_EQUAL_UINT32(AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, buffer.count);
+}
+
+void test_circular_buffer_offsets_above_32_bits()
+{
+    struct aesd_circular_buffer buffer;
+    char expected[TEST_ENTRIES * sizeof(entry_text[0])];
+    uint64_t stream_start = (1ULL << 32) - 10;
+
+    aesd_circular_buffer_init(&buffer);
+    // As if 4 GiB had already gone through the buffer, the stored entries straddle 2^32
+    buffer.next_start = stream_start;
+    for (int number = 0; number < TEST_ENTRIES; number++) {
+        add_numbered_entry(&buffer, number);
+    }
+    expected_contents(expected, TEST_ENTRIES - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, TEST_ENTRIES);
+    verify_contents(&buffer, expected);
+
+    expected_contents(expected, 0, TEST_ENTRIES);
+    TEST_ASSERT_TRUE_MESSAGE(buffer.next_start == stream_start + strlen(expected), "Stream offset lost its upper bits");
+    TEST_ASSERT_TRUE(buffer.entry[buffer.out_offs].start > UINT32_MAX);
+}
+
+void test_circular_buffer_shrink_while_full()
+{
+    struct aesd_circular_buffer buffer;
+    char expected[TEST_ENTRIES * sizeof(entry_text[0])];
+
+    aesd_circular_buffer_init(&buffer);
+    for (int number = 0; number < TEST_ENTRIES - 1; number++) {
+        add_numbered_entry(&buffer, number);
+    }
+    TEST_ASSERT_TRUE(buffer.full);
+
+    // The newest entries are kept in order, and the buffer stays full at its new capacity
+    resize_buffer(&buffer, 4);
+    TEST_ASSERT_TRUE(buffer.full);
+    expected_contents(expected, TEST_ENTRIES - 5, TEST_ENTRIES - 1);
+    verify_contents(&buffer, expected);
+
+    add_numbered_entry(&buffer, TEST_ENTRIES - 1);
+    TEST_ASSERT_EQUAL_UINT32(4, buffer.count);
+    expected_contents(expected, TEST_ENTRIES - 4, TEST_ENTRIES);
+    verify_contents(&buffer, expected);
+}
+
+void test_circular_buffer_grow_and_shrink_slots()
+{
+    struct aesd_circular_buffer buffer;
+    char expected[TEST_ENTRIES * sizeof(entry_text[0])];
+
+    aesd_circular_buffer_init(&buffer);
+    // Wrapped in the inline slots before growing, so the entries have to be moved in order
+    for (int number = 0; number < 13; number++) {
+        add_numbered_entry(&buffer, number);
+    }
+
+    resize_buffer(&buffer, 100);
+    TEST_ASSERT_FALSE(buffer.full);
+    expected_contents(expected, 3, 13);
+    verify_contents(&buffer, expected);
+    for (int number = 13; number < TEST_ENTRIES; number++) {
+        add_numbered_entry(&buffer, number);
+    }
+    TEST_ASSERT_EQUAL_UINT32(TEST_ENTRIES - 3, buffer.count);
+    expected_contents(expected, 3, TEST_ENTRIES);
+    verify_contents(&buffer, expected);
+
+    // Back in the inline slots, which frees the allocated ones
+    resize_buffer(&buffer, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    TEST_ASSERT_TRUE(buffer.full);
+    expected_contents(expected, TEST_ENTRIES - AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, TEST_ENTRIES);
+    verify_contents(&buffer, expected);
+
+    // Growing within the inline slots moves the entries within the same array
+    resize_buffer(&buffer, AESDCHAR_INLINE_SLOTS);
+    TEST_ASSERT_FALSE(buffer.full);
+    verify_contents(&buffer, expected);
+}
+
+void test_circular_buffer_capacity_extremes()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry = { .buffptr = "ab", .size = 2 };
+    struct aesd_buffer_entry *found;
+    size_t offset;
+
+    aesd_circular_buffer_init(&buffer);
+    resize_buffer(&buffer, 1);
+    for (int number = 0; number < 3; number++) {
+        add_numbered_entry(&buffer, number);
+        TEST_ASSERT_EQUAL_UINT32(1, buffer.count);
+        TEST_ASSERT_TRUE(buffer.full);
+        verify_contents(&buffer, entry_text[number]);
+    }
+
+    TEST_ASSERT_EQUAL_UINT32(AESDCHAR_MAX_CAPACITY, aesd_circular_buffer_slots_for(AESDCHAR_MAX_CAPACITY));
+    resize_buffer(&buffer, AESDCHAR_MAX_CAPACITY);
+    TEST_ASSERT_EQUAL_UINT32(1, buffer.count);
+    for (uint32_t number = 0; number < AESDCHAR_MAX_CAPACITY + 2; number++) {
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+    TEST_ASSERT_TRUE(buffer.full);
+    TEST_ASSERT_EQUAL_UINT32(AESDCHAR_MAX_CAPACITY, buffer.count);
+    TEST_ASSERT_EQUAL_UINT32(2 * AESDCHAR_MAX_CAPACITY, buffer.total_size);
+
+    found = aesd_circular_buffer_entry_at(&buffer, AESDCHAR_MAX_CAPACITY - 1, &offset);
+    TEST_ASSERT_NOT_NULL(found);
+    TEST_ASSERT_EQUAL_UINT32(2 * (AESDCHAR_MAX_CAPACITY - 1), offset);
+    TEST_ASSERT_TRUE(found == aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 2 * AESDCHAR_MAX_CAPACITY - 1, &offset));
+    TEST_ASSERT_EQUAL_UINT32(1, offset);
+    TEST_ASSERT_NULL(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 2 * AESDCHAR_MAX_CAPACITY, &offset));
+
+    resize_buffer(&buffer, 1);
+    TEST_ASSERT_EQUAL_UINT32(1, buffer.count);
+    verify_contents(&buffer, "ab");
+}
+
+void test_circular_buffer_byte_budget_keeps_newest()
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry;
+    size_t budget = 24;
+    size_t offset;
+    static const char oversized[] = "this one alone is over the byte budget\n";
+
+    aesd_circular_buffer_init(&buffer);
+    for (int number = 0; number < TEST_ENTRIES; number++) {
+        enforce_budget(&buffer, budget, format_numbered_entry(number));
+        add_numbered_entry(&buffer, number);
+        TEST_ASSERT_TRUE_MESSAGE(buffer.total_size <= budget, "Buffer over the byte budget");
+        TEST_ASSERT_TRUE_MESSAGE(aesd_circular_buffer_entry_at(&buffer, buffer.count - 1, &offset)->buffptr == entry_text[number],
+                "Newest entry not kept");
+    }
+
+    // An entry over the budget by itself evicts everything else, but is kept
+    entry.buffptr = oversized;
+    entry.size = strlen(oversized);
+    enforce_budget(&buffer, budget, entry.size);
+    aesd_circular_buffer_add_entry(&buffer, &entry);
+    TEST_ASSERT_EQUAL_UINT32(1, buffer.count);
+    verify_contents(&buffer, oversized);
+
+    // Lowering the budget below the newest entry keeps it too
+    add_numbered_entry(&buffer, 0);
+    TEST_ASSERT_EQUAL_UINT32(1, enforce_budget(&buffer, 1, 0));
+    TEST_ASSERT_EQUAL_UINT32(1, buffer.count);
+    verify_contents(&buffer, entry_text[0]);
+
+    // Without a budget nothing is evicted, however large the incoming entry
+    TEST_ASSERT_EQUAL_UINT32(0, enforce_budget(&buffer, 0, SIZE_MAX / 2));
+    TEST_ASSERT_EQUAL_UINT32(1, buffer.count);
+}